@@ -1,33 +1,177 @@
 // SPDX-License-Identifier: GPL-2.0
+#include <linux/bitops.h>
+#include <linux/gpio/driver.h>
 #include <linux/init.h>
 #include <linux/i2c.h>
+#include <linux/i2c-smbus.h>
+#include <linux/irq.h>
+#include <linux/jiffies.h>
+#include <linux/kernel.h>
+#include <linux/math64.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
 #include <linux/slab.h>
 #include <linux/usb.h>
+#include <linux/workqueue.h>
 
 #include "mpsse.h"
 
 const int FTDI_IO_TIMEOUT = 5000;
+// Bulk transfer timeouts are derived from the time the MPSSE needs to clock
+// the commands on the bus, the margin below covers USB scheduling and the FTDI
+// latency timer that delays partially filled packets (16ms by default).
+const int FTDI_IO_TIMEOUT_MARGIN = 50;
 const unsigned FTDI_I2C_FREQ = 100000;
-const size_t FTDI_IO_BUFFER_SIZE = 65536;
+// FT232H has 1KiB TX and RX FIFOs, buffers of that size are enough to keep
+// the chip busy for the typical I2C transfer, so that's what we start with.
+// The buffers grow when a transfer needs more, but never above the max size
+// to keep the allocations within the orders the page allocator can satisfy
+// on a fragmented system. Transfers that don't fit are split into chunks.
+const size_t FTDI_FIFO_SIZE = 1024;
+const size_t FTDI_BUFFER_MAX_SIZE = 16384;
 const u16 FTDI_BIT_MODE_RESET = 0x0000;
 const u16 FTDI_BIT_MODE_MPSSE = 0x0200;
 
+// Every bulk in packet starts with two status bytes: modem status and line
+// status. In MPSSE mode a set overrun or FIFO error bit in the line status
+// means that the device lost some of the data it was supposed to send us.
+const size_t FTDI_STATUS_SIZE = 2;
+const u8 FTDI_LINE_STATUS_ERRORS = 0x82;
+
+// GPIO lines are the ACBUS pins, ACBUS6 is driven by the I2C code, so it's
+// not available as a GPIO.
+#define FTDI_GPIO_LINES 8
+const u8 FTDI_GPIO_RESERVED = BIT(6);
+
+static unsigned int gpio_poll_ms = 10;
+module_param(gpio_poll_ms, uint, 0644);
+MODULE_PARM_DESC(gpio_poll_ms,
+	"How often to sample GPIO interrupt lines when the bus is idle (ms)");
+
+static int smbalert_line = -1;
+module_param(smbalert_line, int, 0444);
+MODULE_PARM_DESC(smbalert_line,
+	"GPIO line (ACBUS pin) connected to SMBALERT#, -1 to disable");
+
+
+// A kmalloc-ed buffer, so it's suitable for USB DMA.
+struct ftdi_buffer {
+	u8 *data;
+	size_t size;
+};
 
 struct ftdi_usb {
 	struct usb_device *udev;
 	struct usb_interface *interface;
-	u8 *buffer;
-	size_t buffer_size;
+	// Buffer for the commands we send to the device
+	struct ftdi_buffer tx;
+	// Buffer for the data received from the device. The status bytes are
+	// stripped from the data in the buffer, the data in the range
+	// [rx_head; rx_tail) has been received, but hasn't been consumed yet.
+	struct ftdi_buffer rx;
+	size_t rx_head;
+	size_t rx_tail;
 	struct i2c_adapter adapter;
-	// Timeout in milliseconds for USB IO operations
+	// Max packet size of the bulk in endpoint, every packet of this size
+	// carries its own status bytes.
+	size_t packet_size;
+	// Upper bound on the timeout in milliseconds for USB IO operations
 	int io_timeout;
+	// Deadline in jiffies for the response to the last submitted command
+	unsigned long rx_deadline;
 	// I2C bus frequency
 	unsigned freq;
+
+	// Serializes all the IO to the device between the I2C adapter, the
+	// GPIO chip and the GPIO sampling.
+	struct mutex io_lock;
+	// The pins state we last asked the device to set.
+	unsigned pins_mask;
+	unsigned pins_vals;
+
+	struct gpio_chip gpio;
+	// Direction and output values of the GPIO lines, protected by io_lock.
+	u8 gpio_dir;
+	u8 gpio_val;
+	// The last sampled state of the GPIO lines and the time in jiffies when
+	// they were sampled, protected by io_lock.
+	u8 gpio_pins;
+	bool gpio_pins_valid;
+	unsigned long gpio_sampled;
+	// There is no interrupt controller, instead we sample the GPIO lines
+	// with every submission that expects a response and periodically
+	// when the bus is idle. If the sampled state triggers an interrupt we
+	// handle it later from a work, since the handler may want to use the
+	// bus as well. Bit N in the masks below describes line N.
+	unsigned long irq_enabled;
+	unsigned long irq_rising;
+	unsigned long irq_falling;
+	unsigned long irq_high;
+	unsigned long irq_low;
+	unsigned long irq_pending;
+	// irq_chip bus lock and the lines enabled when it was taken.
+	struct mutex irq_lock;
+	unsigned long irq_enabled_locked;
+	struct delayed_work gpio_poll;
+	struct work_struct irq_work;
+
+	// SMBALERT# line and the alert response address device handling it.
+	struct gpio_desc *smbalert;
+	struct i2c_client *ara;
 };
 
+static int ftdi_buffer_setup(struct ftdi_buffer *buf, size_t size)
+{
+	buf->data = kmalloc(size, GFP_KERNEL);
+	if (!buf->data)
+		return -ENOMEM;
+	buf->size = size;
+	return 0;
+}
+
+static void ftdi_buffer_release(struct ftdi_buffer *buf)
+{
+	kfree(buf->data);
+	buf->data = NULL;
+	buf->size = 0;
+}
+
+// Makes sure that the buffer has at least the requested size if it doesn't
+// exceed FTDI_BUFFER_MAX_SIZE. The buffer content is not preserved. On
+// failure the buffer stays as it was, so the caller can fall back to
+// smaller chunks.
+static int ftdi_buffer_reserve(struct ftdi_buffer *buf, size_t size)
+{
+	u8 *data;
+
+	size = min(size, FTDI_BUFFER_MAX_SIZE);
+	if (size <= buf->size)
+		return 0;
+
+	size = min_t(size_t, roundup_pow_of_two(size), FTDI_BUFFER_MAX_SIZE);
+	data = kmalloc(size, GFP_KERNEL | __GFP_NOWARN);
+	if (!data)
+		return -ENOMEM;
+
+	kfree(buf->data);
+	buf->data = data;
+	buf->size = size;
+	return 0;
+}
+
+// Returns the timeout in milliseconds for a transfer that requires the MPSSE
+// to run the bus clock for the given number of periods.
+static int ftdi_io_timeout(const struct ftdi_usb *ftdi, size_t clocks)
+{
+	const u64 us = div_u64((u64)clocks * USEC_PER_SEC, ftdi->freq);
+	const u64 ms = FTDI_IO_TIMEOUT_MARGIN + DIV_ROUND_UP_ULL(us, 1000);
+
+	return min_t(u64, ms, ftdi->io_timeout);
+}
+
 static int ftdi_mpsse_write(
-	struct ftdi_usb *ftdi, u8 *data, size_t size, size_t *written)
+	struct ftdi_usb *ftdi, u8 *data, size_t size, size_t *written,
+	int timeout)
 {
 	int actual_length;
 	int ret;
@@ -37,13 +181,14 @@ static int ftdi_mpsse_write(
 		/* data = */data,
 		/* len = */size,
 		/* actual_length = */&actual_length,
-		ftdi->io_timeout);
+		timeout);
 	*written = actual_length;
 	return ret;
 }
 
 static int ftdi_mpsse_read(
-	struct ftdi_usb *ftdi, u8 *data, size_t size, size_t *read)
+	struct ftdi_usb *ftdi, u8 *data, size_t size, size_t *read,
+	int timeout)
 {
 	int actual_length;
 	int ret;
@@ -53,7 +198,7 @@ static int ftdi_mpsse_read(
 		/* data = */data,
 		/* len = */size,
 		/* actual_length = */&actual_length,
-		ftdi->io_timeout);
+		timeout);
 	*read = actual_length;
 	return ret;
 }
@@ -61,6 +206,7 @@ static int ftdi_mpsse_read(
 static int ftdi_mpsse_submit(
 	struct ftdi_usb *ftdi, const struct ftdi_mpsse_cmd *cmd)
 {
+	const int timeout = ftdi_io_timeout(ftdi, cmd->clocks);
 	size_t written = 0;
 
 	while (written < cmd->offset) {
@@ -70,48 +216,162 @@ static int ftdi_mpsse_submit(
 		ret = ftdi_mpsse_write(ftdi,
 				       cmd->buffer + written,
 				       cmd->offset - written,
-				       &actual_length);
+				       &actual_length,
+				       timeout);
 		if (ret < 0)
 			return ret;
 
 		written += actual_length;
 	}
 
+	ftdi->rx_deadline = jiffies + msecs_to_jiffies(timeout);
 	return 0;
 }
 
+// Strips the status bytes from the bulk in packets in the RX buffer and makes
+// the payload available for consumption. Returns a negative error if the
+// device reported an error.
+static int ftdi_mpsse_unpack(struct ftdi_usb *ftdi, size_t received)
+{
+	size_t copied = 0;
+	size_t offset;
+
+	for (offset = 0; offset < received; offset += ftdi->packet_size) {
+		const size_t packet = min(ftdi->packet_size, received - offset);
+		const u8 *status = ftdi->rx.data + offset;
+
+		if (packet < FTDI_STATUS_SIZE)
+			return -EIO;
+
+		if (status[1] & FTDI_LINE_STATUS_ERRORS)
+			return -EIO;
+
+		memmove(ftdi->rx.data + copied,
+			status + FTDI_STATUS_SIZE,
+			packet - FTDI_STATUS_SIZE);
+		copied += packet - FTDI_STATUS_SIZE;
+	}
+
+	ftdi->rx_head = 0;
+	ftdi->rx_tail = copied;
+	return 0;
+}
+
+// While the MPSSE has nothing to send the device still answers bulk in
+// requests with packets that contain only the status bytes. So we keep reading
+// until the deadline for the submitted command passes and then treat the
+// device as stalled instead of waiting for the generic IO timeout.
 static int ftdi_mpsse_receive(struct ftdi_usb *ftdi, u8 *data, size_t size)
 {
+	const size_t payload = ftdi->packet_size - FTDI_STATUS_SIZE;
+	const size_t max_len = rounddown(ftdi->rx.size, ftdi->packet_size);
 	size_t read = 0;
 
 	while (read < size) {
+		const long remaining = (long)(ftdi->rx_deadline - jiffies);
 		size_t actual_length;
+		size_t len;
 		int ret;
 
+		if (ftdi->rx_head != ftdi->rx_tail) {
+			len = min(size - read, ftdi->rx_tail - ftdi->rx_head);
+			memcpy(data + read, ftdi->rx.data + ftdi->rx_head, len);
+			ftdi->rx_head += len;
+			read += len;
+			continue;
+		}
+
+		if (remaining <= 0)
+			return -ETIMEDOUT;
+
+		len = DIV_ROUND_UP(size - read, payload) * ftdi->packet_size;
 		ret = ftdi_mpsse_read(ftdi,
-				      ftdi->buffer,
-				      min(ftdi->buffer_size, size - read + 2),
-				      &actual_length);
+				      ftdi->rx.data,
+				      min(max_len, len),
+				      &actual_length,
+				      max(jiffies_to_msecs(remaining), 1u));
 		if (ret < 0)
 			return ret;
 
-		if (actual_length < 2)
-			return -EIO;
+		ret = ftdi_mpsse_unpack(ftdi, actual_length);
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
 
-		memcpy(data + read, ftdi->buffer + 2, actual_length - 2);
-		read += actual_length - 2;
+// Updates the sampled state of the GPIO lines and triggers the interrupts if
+// needed. Must be called with io_lock held.
+static void ftdi_gpio_update(struct ftdi_usb *ftdi, u8 pins)
+{
+	const unsigned long old = ftdi->gpio_pins;
+	const unsigned long new = pins;
+	unsigned long fired;
+	unsigned bit;
+
+	ftdi->gpio_sampled = jiffies;
+	ftdi->gpio_pins = pins;
+	if (!ftdi->gpio_pins_valid) {
+		// We don't know the previous state, so we can't detect edges.
+		ftdi->gpio_pins_valid = true;
+		return;
 	}
 
+	fired = (~old & new & ftdi->irq_rising)
+		| (old & ~new & ftdi->irq_falling)
+		| (new & ftdi->irq_high)
+		| (~new & ftdi->irq_low);
+	fired &= READ_ONCE(ftdi->irq_enabled) & GENMASK(FTDI_GPIO_LINES - 1, 0);
+	if (!fired)
+		return;
+
+	for_each_set_bit(bit, &fired, FTDI_GPIO_LINES)
+		set_bit(bit, &ftdi->irq_pending);
+	schedule_work(&ftdi->irq_work);
+}
+
+// We sample the GPIO lines only if somebody waits for an interrupt.
+static bool ftdi_gpio_sampling(const struct ftdi_usb *ftdi)
+{
+	return READ_ONCE(ftdi->irq_enabled) != 0;
+}
+
+// Receives the state of the pins sampled with ftdi_mpsse_read_pins_high.
+static int ftdi_gpio_receive_sample(struct ftdi_usb *ftdi)
+{
+	u8 pins;
+	int ret;
+
+	ret = ftdi_mpsse_receive(ftdi, &pins, sizeof(pins));
+	if (ret < 0)
+		return ret;
+
+	ftdi_gpio_update(ftdi, pins);
 	return 0;
 }
 
+// Sets the pins used by the I2C code keeping the GPIO lines as they are.
+static int ftdi_i2c_set_output(struct ftdi_usb *ftdi,
+			       struct ftdi_mpsse_cmd *cmd,
+			       unsigned pinmask, unsigned pinvals)
+{
+	const unsigned gpio = (unsigned)(u8)~FTDI_GPIO_RESERVED << 8;
+
+	pinmask = (pinmask & ~gpio) | ((unsigned)ftdi->gpio_dir << 8);
+	pinvals = (pinvals & ~gpio) | ((unsigned)ftdi->gpio_val << 8);
+	ftdi->pins_mask = pinmask;
+	ftdi->pins_vals = pinvals;
+	return ftdi_mpsse_set_output(cmd, pinmask, pinvals);
+}
+
 static int ftdi_i2c_idle(struct ftdi_usb *ftdi)
 {
 	struct ftdi_mpsse_cmd cmd;
 	int ret;
 
-	ftdi_mpsse_cmd_setup(&cmd, ftdi->buffer, ftdi->buffer_size);
-	ret = ftdi_mpsse_set_output(&cmd, 0x40fb, 0xffff);
+	ftdi_mpsse_cmd_setup(&cmd, ftdi->tx.data, ftdi->tx.size);
+	ret = ftdi_i2c_set_output(ftdi, &cmd, 0x40fb, 0xffff);
 	if (ret < 0)
 		return ret;
 
@@ -128,8 +388,8 @@ static int ftdi_i2c_start(struct ftdi_usb *ftdi)
 	struct ftdi_mpsse_cmd cmd;
 	int ret;
 
-	ftdi_mpsse_cmd_setup(&cmd, ftdi->buffer, ftdi->buffer_size);
-	ret = ftdi_mpsse_set_output(&cmd, 0x00fb, 0x00fd);
+	ftdi_mpsse_cmd_setup(&cmd, ftdi->tx.data, ftdi->tx.size);
+	ret = ftdi_i2c_set_output(ftdi, &cmd, 0x00fb, 0x00fd);
 	if (ret < 0)
 		return ret;
 
@@ -140,7 +400,7 @@ static int ftdi_i2c_start(struct ftdi_usb *ftdi)
 	usleep_range(100, 200);
 
 	ftdi_mpsse_cmd_reset(&cmd);
-	ret = ftdi_mpsse_set_output(&cmd, 0x40fb, 0x00fc);
+	ret = ftdi_i2c_set_output(ftdi, &cmd, 0x40fb, 0x00fc);
 	if (ret < 0)
 		return ret;
 
@@ -157,8 +417,8 @@ static int ftdi_i2c_stop(struct ftdi_usb *ftdi)
 	struct ftdi_mpsse_cmd cmd;
 	int ret;
 
-	ftdi_mpsse_cmd_setup(&cmd, ftdi->buffer, ftdi->buffer_size);
-	ret = ftdi_mpsse_set_output(&cmd, 0x00fb, 0x00fc);
+	ftdi_mpsse_cmd_setup(&cmd, ftdi->tx.data, ftdi->tx.size);
+	ret = ftdi_i2c_set_output(ftdi, &cmd, 0x00fb, 0x00fc);
 	if (ret < 0)
 		return ret;
 
@@ -169,7 +429,7 @@ static int ftdi_i2c_stop(struct ftdi_usb *ftdi)
 	usleep_range(100, 200);
 
 	ftdi_mpsse_cmd_reset(&cmd);
-	ret = ftdi_mpsse_set_output(&cmd, 0x00fb, 0x00fd);
+	ret = ftdi_i2c_set_output(ftdi, &cmd, 0x00fb, 0x00fd);
 	if (ret < 0)
 		return ret;
 
@@ -180,7 +440,7 @@ static int ftdi_i2c_stop(struct ftdi_usb *ftdi)
 	usleep_range(100, 200);
 
 	ftdi_mpsse_cmd_reset(&cmd);
-	ret = ftdi_mpsse_set_output(&cmd, 0x40fb, 0xffff);
+	ret = ftdi_i2c_set_output(ftdi, &cmd, 0x40fb, 0xffff);
 	if (ret < 0)
 		return ret;
 
@@ -194,15 +454,16 @@ static int ftdi_i2c_stop(struct ftdi_usb *ftdi)
 
 static int ftdi_i2c_write_byte(struct ftdi_usb *ftdi, u8 byte)
 {
+	const bool sample = ftdi_gpio_sampling(ftdi);
 	struct ftdi_mpsse_cmd cmd;
 	int ret;
 
-	ftdi_mpsse_cmd_setup(&cmd, ftdi->buffer, ftdi->buffer_size);
+	ftdi_mpsse_cmd_setup(&cmd, ftdi->tx.data, ftdi->tx.size);
 	ret = ftdi_mpsse_write_bytes(&cmd, &byte, sizeof(byte));
 	if (ret < 0)
 		return ret;
 
-	ret = ftdi_mpsse_set_output(&cmd, 0x00fb, 0x00fe);
+	ret = ftdi_i2c_set_output(ftdi, &cmd, 0x00fb, 0x00fe);
 	if (ret < 0)
 		return ret;
 
@@ -210,6 +471,12 @@ static int ftdi_i2c_write_byte(struct ftdi_usb *ftdi, u8 byte)
 	if (ret < 0)
 		return ret;
 
+	if (sample) {
+		ret = ftdi_mpsse_read_pins_high(&cmd);
+		if (ret < 0)
+			return ret;
+	}
+
 	ret = ftdi_mpsse_complete(&cmd);
 	if (ret < 0)
 		return ret;
@@ -222,6 +489,12 @@ static int ftdi_i2c_write_byte(struct ftdi_usb *ftdi, u8 byte)
 	if (ret < 0)
 		return ret;
 
+	if (sample) {
+		ret = ftdi_gpio_receive_sample(ftdi);
+		if (ret < 0)
+			return ret;
+	}
+
 	if ((byte & 0x1) != 0)
 		return -EIO;
 
@@ -248,48 +521,82 @@ static int ftdi_i2c_write_addr(struct ftdi_usb *ftdi, u8 i2c_addr, int read)
 	return ftdi_i2c_write_byte(ftdi, byte);
 }
 
+// Every byte we read takes a read command (3 bytes), the ACK bit (3 bytes) and
+// a command to release SDA for the next byte (6 bytes). On top of that every
+// chunk takes a pin sample and a send immediate command (1 byte each).
+const size_t FTDI_I2C_READ_CMD_SIZE = 12;
+const size_t FTDI_I2C_READ_CHUNK_OVERHEAD = 2;
+
 static int ftdi_i2c_read_bytes(struct ftdi_usb *ftdi, u8 *data, size_t size)
 {
+	const size_t payload = ftdi->packet_size - FTDI_STATUS_SIZE;
 	struct ftdi_mpsse_cmd cmd;
-	size_t i;
+	size_t chunk;
+	size_t read;
 	int ret;
 
-	ftdi_mpsse_cmd_setup(&cmd, ftdi->buffer, ftdi->buffer_size);
-	ret = ftdi_mpsse_read_bytes(&cmd, 1);
-	if (ret < 0)
-		return ret;
-
-	for (i = 1; i < size; ++i) {
-		ret = ftdi_mpsse_write_bits(&cmd, 0x00, 1);
+	// Failing to grow the buffers is not an error, we just read in smaller
+	// chunks. RX buffer content is not preserved, so we can only grow it
+	// when all the received data has been consumed.
+	ftdi_buffer_reserve(&ftdi->tx, size * FTDI_I2C_READ_CMD_SIZE
+			    + FTDI_I2C_READ_CHUNK_OVERHEAD);
+	if (ftdi->rx_head == ftdi->rx_tail)
+		ftdi_buffer_reserve(
+			&ftdi->rx,
+			DIV_ROUND_UP(size, payload) * ftdi->packet_size);
+
+	for (read = 0; read < size; read += chunk) {
+		const bool sample = ftdi_gpio_sampling(ftdi);
+		size_t i;
+
+		chunk = min(size - read,
+			    (ftdi->tx.size - FTDI_I2C_READ_CHUNK_OVERHEAD)
+			    / FTDI_I2C_READ_CMD_SIZE);
+		ftdi_mpsse_cmd_setup(&cmd, ftdi->tx.data, ftdi->tx.size);
+		for (i = read; i < read + chunk; ++i) {
+			// We ACK all bytes, but the last one to let the
+			// device know that we are done.
+			const u8 ack = i + 1 == size ? 0xff : 0x00;
+
+			ret = ftdi_mpsse_read_bytes(&cmd, 1);
+			if (ret < 0)
+				return ret;
+
+			ret = ftdi_mpsse_write_bits(&cmd, ack, 1);
+			if (ret < 0)
+				return ret;
+
+			ret = ftdi_i2c_set_output(ftdi, &cmd, 0x00fb, 0x00fe);
+			if (ret < 0)
+				return ret;
+		}
+
+		if (sample) {
+			ret = ftdi_mpsse_read_pins_high(&cmd);
+			if (ret < 0)
+				return ret;
+		}
+
+		ret = ftdi_mpsse_complete(&cmd);
 		if (ret < 0)
 			return ret;
 
-		ret = ftdi_mpsse_set_output(&cmd, 0x00fb, 0x00fe);
+		ret = ftdi_mpsse_submit(ftdi, &cmd);
 		if (ret < 0)
 			return ret;
 
-		ret = ftdi_mpsse_read_bytes(&cmd, 1);
+		ret = ftdi_mpsse_receive(ftdi, data + read, chunk);
 		if (ret < 0)
 			return ret;
-	}
-
-	ret = ftdi_mpsse_write_bits(&cmd, 0xff, 1);
-	if (ret < 0)
-		return ret;
 
-	ret = ftdi_mpsse_set_output(&cmd, 0x00fb, 0x00fe);
-	if (ret < 0)
-		return ret;
-
-	ret = ftdi_mpsse_complete(&cmd);
-	if (ret < 0)
-		return ret;
-
-	ret = ftdi_mpsse_submit(ftdi, &cmd);
-	if (ret < 0)
-		return ret;
+		if (sample) {
+			ret = ftdi_gpio_receive_sample(ftdi);
+			if (ret < 0)
+				return ret;
+		}
+	}
 
-	return ftdi_mpsse_receive(ftdi, data, size);
+	return 0;
 }
 
 static int ftdi_reset(struct ftdi_usb *ftdi);
@@ -301,6 +608,7 @@ static int ftdi_usb_i2c_xfer(struct i2c_adapter *adapter,
 	int i;
 	int ret;
 
+	mutex_lock(&ftdi->io_lock);
 	for (i = 0; i < num; ++i) {
 		const int read = (msg[i].flags & I2C_M_RD) != 0;
 
@@ -329,10 +637,12 @@ static int ftdi_usb_i2c_xfer(struct i2c_adapter *adapter,
 		usleep_range(100, 200);
 	}
 
+	mutex_unlock(&ftdi->io_lock);
 	return num;
 
 err:
 	ftdi_reset(ftdi);
+	mutex_unlock(&ftdi->io_lock);
 	return ret;
 }
 
@@ -347,6 +657,375 @@ static const struct i2c_algorithm ftdi_usb_i2c_algo = {
 	.functionality = ftdi_usb_i2c_func,
 };
 
+// Must be called with io_lock held.
+static int ftdi_gpio_read_pins(struct ftdi_usb *ftdi, u8 *pins)
+{
+	struct ftdi_mpsse_cmd cmd;
+	int ret;
+
+	ftdi_mpsse_cmd_setup(&cmd, ftdi->tx.data, ftdi->tx.size);
+	ret = ftdi_mpsse_read_pins_high(&cmd);
+	if (ret < 0)
+		return ret;
+
+	ret = ftdi_mpsse_complete(&cmd);
+	if (ret < 0)
+		return ret;
+
+	ret = ftdi_mpsse_submit(ftdi, &cmd);
+	if (ret < 0)
+		return ret;
+
+	ret = ftdi_mpsse_receive(ftdi, pins, sizeof(*pins));
+	if (ret < 0)
+		return ret;
+
+	ftdi_gpio_update(ftdi, *pins);
+	return 0;
+}
+
+// Must be called with io_lock held.
+static int ftdi_gpio_write_pins(struct ftdi_usb *ftdi)
+{
+	const u8 reserved_mask = (ftdi->pins_mask >> 8) & FTDI_GPIO_RESERVED;
+	const u8 reserved_vals = (ftdi->pins_vals >> 8) & FTDI_GPIO_RESERVED;
+	struct ftdi_mpsse_cmd cmd;
+	int ret;
+
+	ftdi_mpsse_cmd_setup(&cmd, ftdi->tx.data, ftdi->tx.size);
+	ret = ftdi_mpsse_set_output_high(&cmd,
+					 reserved_mask | ftdi->gpio_dir,
+					 reserved_vals | ftdi->gpio_val);
+	if (ret < 0)
+		return ret;
+
+	return ftdi_mpsse_submit(ftdi, &cmd);
+}
+
+static int ftdi_gpio_request(struct gpio_chip *chip, unsigned offset)
+{
+	(void) chip;
+
+	if (BIT(offset) & FTDI_GPIO_RESERVED)
+		return -EBUSY;
+	return 0;
+}
+
+static int ftdi_gpio_get_direction(struct gpio_chip *chip, unsigned offset)
+{
+	struct ftdi_usb *ftdi = gpiochip_get_data(chip);
+	int ret;
+
+	mutex_lock(&ftdi->io_lock);
+	ret = (ftdi->gpio_dir & BIT(offset))
+		? GPIO_LINE_DIRECTION_OUT : GPIO_LINE_DIRECTION_IN;
+	mutex_unlock(&ftdi->io_lock);
+	return ret;
+}
+
+static int ftdi_gpio_set_config(struct ftdi_usb *ftdi, unsigned offset,
+				bool output, int value)
+{
+	u8 dir, val;
+	int ret;
+
+	mutex_lock(&ftdi->io_lock);
+	dir = ftdi->gpio_dir;
+	val = ftdi->gpio_val;
+	if (output)
+		ftdi->gpio_dir |= BIT(offset);
+	else
+		ftdi->gpio_dir &= ~BIT(offset);
+
+	if (value)
+		ftdi->gpio_val |= BIT(offset);
+	else
+		ftdi->gpio_val &= ~BIT(offset);
+
+	// Keep the cached state matching what the pins were last set to.
+	ret = ftdi_gpio_write_pins(ftdi);
+	if (ret < 0) {
+		ftdi->gpio_dir = dir;
+		ftdi->gpio_val = val;
+		ftdi_reset(ftdi);
+	}
+	mutex_unlock(&ftdi->io_lock);
+	return ret;
+}
+
+static int ftdi_gpio_direction_input(struct gpio_chip *chip, unsigned offset)
+{
+	return ftdi_gpio_set_config(gpiochip_get_data(chip), offset, false, 0);
+}
+
+static int ftdi_gpio_direction_output(
+	struct gpio_chip *chip, unsigned offset, int value)
+{
+	return ftdi_gpio_set_config(
+		gpiochip_get_data(chip), offset, true, value);
+}
+
+static void ftdi_gpio_set(struct gpio_chip *chip, unsigned offset, int value)
+{
+	struct ftdi_usb *ftdi = gpiochip_get_data(chip);
+
+	ftdi_gpio_set_config(
+		ftdi, offset, ftdi->gpio_dir & BIT(offset), value);
+}
+
+static int ftdi_gpio_get(struct gpio_chip *chip, unsigned offset)
+{
+	struct ftdi_usb *ftdi = gpiochip_get_data(chip);
+	u8 pins;
+	int ret;
+
+	mutex_lock(&ftdi->io_lock);
+	ret = ftdi_gpio_read_pins(ftdi, &pins);
+	if (ret < 0)
+		ftdi_reset(ftdi);
+	mutex_unlock(&ftdi->io_lock);
+
+	if (ret < 0)
+		return ret;
+	return (pins & BIT(offset)) ? 1 : 0;
+}
+
+// Samples the GPIO lines when nobody else did it for gpio_poll_ms and
+// reschedules itself while there are enabled interrupts.
+static void ftdi_gpio_poll(struct work_struct *work)
+{
+	struct ftdi_usb *ftdi = container_of(
+		to_delayed_work(work), struct ftdi_usb, gpio_poll);
+	const unsigned long interval =
+		max(msecs_to_jiffies(READ_ONCE(gpio_poll_ms)), 1ul);
+	unsigned long next;
+
+	mutex_lock(&ftdi->io_lock);
+	if (!ftdi_gpio_sampling(ftdi)) {
+		mutex_unlock(&ftdi->io_lock);
+		return;
+	}
+
+	if (!ftdi->gpio_pins_valid ||
+	    time_after_eq(jiffies, ftdi->gpio_sampled + interval)) {
+		u8 pins;
+
+		if (ftdi_gpio_read_pins(ftdi, &pins) < 0) {
+			ftdi_reset(ftdi);
+			ftdi->gpio_sampled = jiffies;
+		}
+	}
+	next = ftdi->gpio_sampled + interval;
+	mutex_unlock(&ftdi->io_lock);
+
+	queue_delayed_work(system_wq, &ftdi->gpio_poll,
+			   time_after(next, jiffies) ? next - jiffies : 0);
+}
+
+// Interrupt handlers are threaded, so we run them from the work and not
+// under io_lock, that allows them to use the I2C bus.
+static void ftdi_gpio_irq_work(struct work_struct *work)
+{
+	struct ftdi_usb *ftdi = container_of(
+		work, struct ftdi_usb, irq_work);
+	unsigned long pending = xchg(&ftdi->irq_pending, 0);
+	unsigned bit;
+
+	for_each_set_bit(bit, &pending, FTDI_GPIO_LINES)
+		handle_nested_irq(irq_find_mapping(ftdi->gpio.irq.domain, bit));
+}
+
+static void ftdi_gpio_irq_mask(struct irq_data *d)
+{
+	struct gpio_chip *gpio = irq_data_get_irq_chip_data(d);
+	struct ftdi_usb *ftdi = gpiochip_get_data(gpio);
+	const irq_hw_number_t line = irqd_to_hwirq(d);
+
+	clear_bit(line, &ftdi->irq_enabled);
+	gpiochip_disable_irq(gpio, line);
+}
+
+static void ftdi_gpio_irq_unmask(struct irq_data *d)
+{
+	struct gpio_chip *gpio = irq_data_get_irq_chip_data(d);
+	struct ftdi_usb *ftdi = gpiochip_get_data(gpio);
+	const irq_hw_number_t line = irqd_to_hwirq(d);
+
+	gpiochip_enable_irq(gpio, line);
+	set_bit(line, &ftdi->irq_enabled);
+}
+
+static int ftdi_gpio_irq_set_type(struct irq_data *d, unsigned int type)
+{
+	struct ftdi_usb *ftdi =
+		gpiochip_get_data(irq_data_get_irq_chip_data(d));
+	const irq_hw_number_t line = irqd_to_hwirq(d);
+
+	clear_bit(line, &ftdi->irq_rising);
+	clear_bit(line, &ftdi->irq_falling);
+	clear_bit(line, &ftdi->irq_high);
+	clear_bit(line, &ftdi->irq_low);
+
+	switch (type & IRQ_TYPE_SENSE_MASK) {
+	case IRQ_TYPE_EDGE_RISING:
+		set_bit(line, &ftdi->irq_rising);
+		break;
+	case IRQ_TYPE_EDGE_FALLING:
+		set_bit(line, &ftdi->irq_falling);
+		break;
+	case IRQ_TYPE_EDGE_BOTH:
+		set_bit(line, &ftdi->irq_rising);
+		set_bit(line, &ftdi->irq_falling);
+		break;
+	case IRQ_TYPE_LEVEL_HIGH:
+		set_bit(line, &ftdi->irq_high);
+		break;
+	case IRQ_TYPE_LEVEL_LOW:
+		set_bit(line, &ftdi->irq_low);
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static void ftdi_gpio_irq_bus_lock(struct irq_data *d)
+{
+	struct ftdi_usb *ftdi =
+		gpiochip_get_data(irq_data_get_irq_chip_data(d));
+
+	mutex_lock(&ftdi->irq_lock);
+	ftdi->irq_enabled_locked = READ_ONCE(ftdi->irq_enabled);
+}
+
+static void ftdi_gpio_irq_bus_sync_unlock(struct irq_data *d)
+{
+	struct ftdi_usb *ftdi =
+		gpiochip_get_data(irq_data_get_irq_chip_data(d));
+
+	// Edges that happened while nobody was sampling the lines are lost, so
+	// we start with a fresh state when the first interrupt is enabled.
+	if (!ftdi->irq_enabled_locked && ftdi_gpio_sampling(ftdi)) {
+		mutex_lock(&ftdi->io_lock);
+		ftdi->gpio_pins_valid = false;
+		mutex_unlock(&ftdi->io_lock);
+		queue_delayed_work(system_wq, &ftdi->gpio_poll, 0);
+	}
+	mutex_unlock(&ftdi->irq_lock);
+}
+
+static const struct irq_chip ftdi_gpio_irq_chip = {
+	.name = "ftdi-gpio",
+	.irq_mask = ftdi_gpio_irq_mask,
+	.irq_unmask = ftdi_gpio_irq_unmask,
+	.irq_set_type = ftdi_gpio_irq_set_type,
+	.irq_bus_lock = ftdi_gpio_irq_bus_lock,
+	.irq_bus_sync_unlock = ftdi_gpio_irq_bus_sync_unlock,
+	.flags = IRQCHIP_IMMUTABLE,
+	GPIOCHIP_IRQ_RESOURCE_HELPERS,
+};
+
+static int ftdi_gpio_add(struct ftdi_usb *ftdi)
+{
+	struct gpio_chip *gpio = &ftdi->gpio;
+	struct gpio_irq_chip *girq = &gpio->irq;
+
+	gpio->label = "ftdi-gpio";
+	gpio->parent = &ftdi->interface->dev;
+	gpio->owner = THIS_MODULE;
+	gpio->base = -1;
+	gpio->ngpio = FTDI_GPIO_LINES;
+	gpio->can_sleep = true;
+	gpio->request = ftdi_gpio_request;
+	gpio->get_direction = ftdi_gpio_get_direction;
+	gpio->direction_input = ftdi_gpio_direction_input;
+	gpio->direction_output = ftdi_gpio_direction_output;
+	gpio->get = ftdi_gpio_get;
+	gpio->set = ftdi_gpio_set;
+
+	gpio_irq_chip_set_chip(girq, &ftdi_gpio_irq_chip);
+	girq->handler = handle_simple_irq;
+	girq->default_type = IRQ_TYPE_NONE;
+	girq->threaded = true;
+
+	return gpiochip_add_data(gpio, ftdi);
+}
+
+static void ftdi_gpio_remove(struct ftdi_usb *ftdi)
+{
+	WRITE_ONCE(ftdi->irq_enabled, 0);
+	cancel_delayed_work_sync(&ftdi->gpio_poll);
+	cancel_work_sync(&ftdi->irq_work);
+	gpiochip_remove(&ftdi->gpio);
+}
+
+// SMBALERT# is an active low open drain line shared by all the targets that
+// want attention. We configure it as a level triggered interrupt and let the
+// smbus_alert driver read the alert response address and notify the target
+// drivers when it fires. The line is sampled the same way as other interrupt
+// lines, so the bus stays quiet until some target asserts SMBALERT#.
+//
+// Host notify is not supported: it requires the adapter to act as an I2C
+// target and MPSSE can only be a bus master.
+static int ftdi_smbalert_add(struct ftdi_usb *ftdi)
+{
+	struct i2c_smbus_alert_setup setup = {};
+	struct gpio_desc *desc;
+	struct i2c_client *ara;
+	int irq;
+	int ret;
+
+	if (smbalert_line < 0)
+		return 0;
+
+	if (smbalert_line >= FTDI_GPIO_LINES ||
+	    (BIT(smbalert_line) & FTDI_GPIO_RESERVED))
+		return -EINVAL;
+
+	desc = gpiochip_request_own_desc(&ftdi->gpio, smbalert_line,
+					 "smbalert", GPIO_ACTIVE_LOW,
+					 GPIOD_IN);
+	if (IS_ERR(desc))
+		return PTR_ERR(desc);
+
+	irq = gpiod_to_irq(desc);
+	if (irq < 0) {
+		ret = irq;
+		goto err;
+	}
+
+	ret = irq_set_irq_type(irq, IRQ_TYPE_LEVEL_LOW);
+	if (ret < 0)
+		goto err;
+
+	setup.irq = irq;
+	ara = i2c_new_smbus_alert_device(&ftdi->adapter, &setup);
+	if (IS_ERR(ara)) {
+		ret = PTR_ERR(ara);
+		goto err;
+	}
+
+	ftdi->smbalert = desc;
+	ftdi->ara = ara;
+	return 0;
+
+err:
+	gpiochip_free_own_desc(desc);
+	return ret;
+}
+
+static void ftdi_smbalert_remove(struct ftdi_usb *ftdi)
+{
+	if (!ftdi->ara)
+		return;
+
+	i2c_unregister_device(ftdi->ara);
+	gpiochip_free_own_desc(ftdi->smbalert);
+	ftdi->ara = NULL;
+	ftdi->smbalert = NULL;
+}
+
 static const struct usb_device_id ftdi_id_table[] = {
 	{ USB_DEVICE(0x0005, 0x0001) },
 	{ }
@@ -357,17 +1036,18 @@ static void ftdi_usb_delete(struct ftdi_usb *ftdi)
 {
 	usb_put_intf(ftdi->interface);
 	usb_put_dev(ftdi->udev);
-	kfree(ftdi->buffer);
+	ftdi_buffer_release(&ftdi->tx);
+	ftdi_buffer_release(&ftdi->rx);
 	kfree(ftdi);
 }
 
 static int ftdi_mpsse_verify(struct ftdi_usb *ftdi)
 {
 	struct ftdi_mpsse_cmd cmd;
-	size_t received;
+	u8 response[2];
 	int ret;
 
-	ftdi_mpsse_cmd_setup(&cmd, ftdi->buffer, ftdi->buffer_size);
+	ftdi_mpsse_cmd_setup(&cmd, ftdi->tx.data, ftdi->tx.size);
 	ret = ftdi_mpsse_command(&cmd, 0xaa);
 	if (ret < 0)
 		return ret;
@@ -376,12 +1056,11 @@ static int ftdi_mpsse_verify(struct ftdi_usb *ftdi)
 	if (ret < 0)
 		return ret;
 
-	ret = ftdi_mpsse_read(
-		ftdi, ftdi->buffer, ftdi->buffer_size, &received);
+	ret = ftdi_mpsse_receive(ftdi, response, sizeof(response));
 	if (ret < 0)
 		return ret;
 
-	if (received != 4 || ftdi->buffer[2] != 0xfa || ftdi->buffer[3] != 0xaa)
+	if (response[0] != 0xfa || response[1] != 0xaa)
 		return -EIO;
 
 	ftdi_mpsse_cmd_reset(&cmd);
@@ -393,12 +1072,11 @@ static int ftdi_mpsse_verify(struct ftdi_usb *ftdi)
 	if (ret < 0)
 		return ret;
 
-	ret = ftdi_mpsse_read(
-		ftdi, ftdi->buffer, ftdi->buffer_size, &received);
+	ret = ftdi_mpsse_receive(ftdi, response, sizeof(response));
 	if (ret < 0)
 		return ret;
 
-	if (received != 4 || ftdi->buffer[2] != 0xfa || ftdi->buffer[3] != 0xab)
+	if (response[0] != 0xfa || response[1] != 0xab)
 		return -EIO;
 
 	return 0;
@@ -409,7 +1087,7 @@ static int ftdi_mpsse_i2c_setup(struct ftdi_usb *ftdi)
 	struct ftdi_mpsse_cmd cmd;
 	int ret;
 
-	ftdi_mpsse_cmd_setup(&cmd, ftdi->buffer, ftdi->buffer_size);
+	ftdi_mpsse_cmd_setup(&cmd, ftdi->tx.data, ftdi->tx.size);
 	ret = ftdi_mpsse_disable_adaptive_clocking(&cmd);
 	if (ret < 0)
 		return ret;
@@ -451,14 +1129,14 @@ static int ftdi_set_bit_mode(struct ftdi_usb *ftdi, u16 mode)
 	// ignore the actual values.
 	ret = usb_bulk_msg(
 		ftdi->udev, usb_rcvbulkpipe(ftdi->udev, 1),
-		/* data = */ftdi->buffer,
-		/* len = */ftdi->buffer_size,
+		/* data = */ftdi->rx.data,
+		/* len = */ftdi->packet_size,
 		/* actual_length = */&actual_length,
-		ftdi->io_timeout);
+		ftdi_io_timeout(ftdi, 0));
 	if (ret < 0)
 		return ret;
 
-	if (actual_length != 2)
+	if (actual_length != FTDI_STATUS_SIZE)
 		return -EIO;
 
 	return 0;
@@ -512,6 +1190,10 @@ static int ftdi_reset(struct ftdi_usb *ftdi)
 {
 	int ret;
 
+	// Whatever we received before the reset is of no use anymore.
+	ftdi->rx_head = 0;
+	ftdi->rx_tail = 0;
+
 	ret = usb_control_msg(
 		ftdi->udev, usb_sndctrlpipe(ftdi->udev, 0),
 		/* bRequest = */0x00,
@@ -575,22 +1257,34 @@ static int ftdi_usb_probe(struct usb_interface *interface,
 			  const struct usb_device_id *id)
 {
 	struct usb_device *dev = interface_to_usbdev(interface);
+	struct usb_endpoint_descriptor *bulk_in;
 	struct ftdi_usb *ftdi;
 	int ret;
 
 	(void) id;
 
+	ret = usb_find_bulk_in_endpoint(interface->cur_altsetting, &bulk_in);
+	if (ret < 0) {
+		dev_err(&interface->dev,
+			"Failed to find bulk in endpoint: %d\n", ret);
+		return ret;
+	}
+
 	ftdi = kzalloc(sizeof(*ftdi), GFP_KERNEL);
 	if (!ftdi)
 		return -ENOMEM;
 
 	ftdi->udev = usb_get_dev(dev);
 	ftdi->interface = usb_get_intf(interface);
+	ftdi->packet_size = usb_endpoint_maxp(bulk_in);
 	ftdi->io_timeout = FTDI_IO_TIMEOUT;
 	ftdi->freq = FTDI_I2C_FREQ;
-	ftdi->buffer = kzalloc(FTDI_IO_BUFFER_SIZE, GFP_KERNEL);
-	ftdi->buffer_size = FTDI_IO_BUFFER_SIZE;
-	if (!ftdi->buffer) {
+	mutex_init(&ftdi->io_lock);
+	mutex_init(&ftdi->irq_lock);
+	INIT_DELAYED_WORK(&ftdi->gpio_poll, ftdi_gpio_poll);
+	INIT_WORK(&ftdi->irq_work, ftdi_gpio_irq_work);
+	if (ftdi_buffer_setup(&ftdi->tx, FTDI_FIFO_SIZE) < 0 ||
+	    ftdi_buffer_setup(&ftdi->rx, FTDI_FIFO_SIZE) < 0) {
 		dev_err(&interface->dev,
 			"Failed to initialize the FTDI-based device: %d\n",
 			-ENOMEM);
@@ -615,6 +1309,23 @@ static int ftdi_usb_probe(struct usb_interface *interface,
 		 dev->bus->busnum, dev->devnum);
 	i2c_add_adapter(&ftdi->adapter);
 
+	ret = ftdi_gpio_add(ftdi);
+	if (ret < 0) {
+		dev_err(&interface->dev,
+			"Failed to register FTDI GPIO chip: %d\n", ret);
+		i2c_del_adapter(&ftdi->adapter);
+		ftdi_usb_delete(ftdi);
+		return ret;
+	}
+
+	// The I2C adapter and the GPIO chip are usable without the alert
+	// client, so a bad smbalert_line doesn't fail the probe.
+	ret = ftdi_smbalert_add(ftdi);
+	if (ret < 0)
+		dev_warn(&interface->dev,
+			 "Failed to setup SMBALERT# on line %d: %d\n",
+			 smbalert_line, ret);
+
 	usb_set_intfdata(interface, ftdi);
 	dev_info(&interface->dev, "Initialized FTDI-based device\n");
 	return 0;
@@ -624,7 +1335,9 @@ static void ftdi_usb_disconnect(struct usb_interface *interface)
 {
 	struct ftdi_usb *ftdi = usb_get_intfdata(interface);
 
+	ftdi_smbalert_remove(ftdi);
 	i2c_del_adapter(&ftdi->adapter);
+	ftdi_gpio_remove(ftdi);
 	usb_set_intfdata(interface, NULL);
 	ftdi_usb_delete(ftdi);
 	dev_info(&interface->dev, "FTDI-based device has been disconnected\n");
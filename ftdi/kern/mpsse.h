@@ -10,6 +10,9 @@ struct ftdi_mpsse_cmd {
 	u8 *buffer;
 	size_t offset;
 	size_t size;
+	// Number of clock periods the MPSSE needs to execute the commands, it's
+	// used to estimate how long it should take the device to respond.
+	size_t clocks;
 };
 
 static inline void ftdi_mpsse_cmd_setup(
@@ -18,11 +21,13 @@ static inline void ftdi_mpsse_cmd_setup(
 	cmd->buffer = buffer;
 	cmd->size = size;
 	cmd->offset = 0;
+	cmd->clocks = 0;
 }
 
 static inline void ftdi_mpsse_cmd_reset(struct ftdi_mpsse_cmd *cmd)
 {
 	cmd->offset = 0;
+	cmd->clocks = 0;
 }
 
 static inline int ftdi_mpsse_command(struct ftdi_mpsse_cmd *cmd, u8 command)
@@ -91,9 +96,31 @@ static inline int ftdi_mpsse_set_output(
 	cmd->buffer[cmd->offset++] = 0x82;
 	cmd->buffer[cmd->offset++] = (pinvals >> 8) & 0xff;
 	cmd->buffer[cmd->offset++] = (pinmask >> 8) & 0xff;
+	cmd->clocks += 1;
 	return 0;
 }
 
+static inline int ftdi_mpsse_set_output_high(
+	struct ftdi_mpsse_cmd *cmd, u8 pinmask, u8 pinvals)
+{
+	if (cmd->offset + 3 > cmd->size)
+		return -ENOMEM;
+
+	cmd->buffer[cmd->offset++] = 0x82;
+	cmd->buffer[cmd->offset++] = pinvals;
+	cmd->buffer[cmd->offset++] = pinmask;
+	cmd->clocks += 1;
+	return 0;
+}
+
+// Reads the current state of the high byte pins (ACBUS on FT232H), the result
+// is a single byte in the response.
+static inline int ftdi_mpsse_read_pins_high(struct ftdi_mpsse_cmd *cmd)
+{
+	cmd->clocks += 1;
+	return ftdi_mpsse_command(cmd, 0x83);
+}
+
 static inline int ftdi_mpsse_write_bytes(
 	struct ftdi_mpsse_cmd *cmd, const u8 *data, size_t size)
 {
@@ -108,6 +135,7 @@ static inline int ftdi_mpsse_write_bytes(
 	cmd->buffer[cmd->offset++] = ((size - 1) >> 8) & 0xff;
 	memcpy(cmd->buffer + cmd->offset, data, size);
 	cmd->offset += size;
+	cmd->clocks += 8 * size;
 	return 0;
 }
 
@@ -123,6 +151,7 @@ static inline int ftdi_mpsse_write_bits(
 	cmd->buffer[cmd->offset++] = 0x13;
 	cmd->buffer[cmd->offset++] = (bits - 1) & 0xff;
 	cmd->buffer[cmd->offset++] = data;
+	cmd->clocks += bits;
 	return 0;
 }
 
@@ -137,6 +166,7 @@ static inline int ftdi_mpsse_read_bytes(struct ftdi_mpsse_cmd *cmd, size_t size)
 	cmd->buffer[cmd->offset++] = 0x20;
 	cmd->buffer[cmd->offset++] = (size - 1) & 0xff;
 	cmd->buffer[cmd->offset++] = ((size - 1) >> 8) & 0xff;
+	cmd->clocks += 8 * size;
 	return 0;
 }
 
@@ -150,6 +180,7 @@ static inline int ftdi_mpsse_read_bits(struct ftdi_mpsse_cmd *cmd, size_t bits)
 
 	cmd->buffer[cmd->offset++] = 0x22;
 	cmd->buffer[cmd->offset++] = (bits - 1) & 0xff;
+	cmd->clocks += bits;
 	return 0;
 }
 
@@ -0,0 +1,640 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ftdi.h"
+#include "i2c.h"
+#include "mpsse.h"
+#include "sim.h"
+
+#ifdef TRANSPORT_D2XX
+static const unsigned device_vid = 0x0005;
+static const unsigned device_pid = 0x0001;
+#endif
+
+// Reads are split into chunks, so the MPSSE commands of one read stay
+// reasonably small.
+#define EEPROM_READ_CHUNK 4096u
+
+// Pages programmed with one submission and the bounds of the number of ACK
+// polling probes that follow every page.
+#define EEPROM_BATCH_PAGES 16u
+#define EEPROM_MIN_POLL 4u
+#define EEPROM_MAX_POLL 256u
+
+// The datasheets promise at most 5ms or 10ms per write cycle, leave some
+// margin.
+#define EEPROM_WRITE_TIMEOUT 0.05
+
+#define EEPROM_MAX_PAGE 128u
+#define EEPROM_MAX_SIZE 65536u
+
+struct eeprom_type {
+	const char *name;
+	unsigned size;
+	unsigned page;
+	// Number of the memory address bytes sent after the I2C address.
+	unsigned addr_bytes;
+};
+
+// The 24C04, 24C08 and 24C16 parts put the high bits of the memory address
+// into the I2C address, they are not supported.
+static const struct eeprom_type eeprom_types[] = {
+	{ "24c01", 128, 8, 1 },
+	{ "24c02", 256, 8, 1 },
+	{ "24c32", 4096, 32, 2 },
+	{ "24c64", 8192, 32, 2 },
+	{ "24c128", 16384, 64, 2 },
+	{ "24c256", 32768, 64, 2 },
+	{ "24c512", 65536, 128, 2 },
+};
+
+struct eeprom {
+	struct i2c_bus *bus;
+	const struct eeprom_type *type;
+	unsigned char addr;
+	// How many address probes follow every page written.
+	unsigned poll;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *what, unsigned size, double start)
+{
+	const double seconds = now() - start;
+
+	fprintf(stdout, "%s %u bytes in %.3f s, %.2f KB/s\n",
+		what, size, seconds,
+		seconds > 0 ? size / seconds / 1e3 : 0.0);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stdout,
+		"%s -s serial -t type [-a i2c_addr] [-o offset] [-l size] "
+		"[-O] [-r file | -w file | -v file] [-h]\n\n"
+		"\t-h           print the usage information.\n"
+		"\t-s serial    specify the FTDI serial number of the device "
+		"               used as I2C bridge, optionally prefixed "
+		"               with the transport, e.g. d2xx:serial or "
+		"               usb:serial[@vid:pid], the usb transport "
+		"               looks for 0x0005:0x0001 and then for "
+		"               0x0403:0x6014 by default.\n"
+		"\t-t type      EEPROM type: 24c01, 24c02, 24c32, 24c64, "
+		"               24c128, 24c256 or 24c512.\n"
+		"\t-a i2c_addr  I2C address of the EEPROM, 0x50 by default.\n"
+		"\t-o offset    EEPROM offset to start from, 0 by default.\n"
+		"\t-l size      amount of data to read, the whole EEPROM by "
+		"               default.\n"
+		"\t-O           drop the repeated pin writes that hold the "
+		"               START and STOP conditions.\n"
+		"\t-r file      read the EEPROM into the file.\n"
+		"\t-w file      program the file and verify it.\n"
+		"\t-v file      compare the EEPROM with the file.\n",
+		name);
+}
+
+static const struct eeprom_type *eeprom_find_type(const char *name)
+{
+	const unsigned count = sizeof(eeprom_types) / sizeof(eeprom_types[0]);
+
+	for (unsigned i = 0; i < count; ++i) {
+		if (strcmp(eeprom_types[i].name, name) == 0)
+			return &eeprom_types[i];
+	}
+	return NULL;
+}
+
+// Puts the memory address into buf and returns the number of bytes used.
+static unsigned eeprom_addr(
+	const struct eeprom *eeprom, unsigned char *buf, unsigned offset)
+{
+	if (eeprom->type->addr_bytes == 1) {
+		buf[0] = offset & 0xff;
+		return 1;
+	}
+
+	buf[0] = (offset >> 8) & 0xff;
+	buf[1] = offset & 0xff;
+	return 2;
+}
+
+static void eeprom_probe(struct i2c_segment *seg, unsigned char addr)
+{
+	seg->addr = addr;
+	seg->flags = I2C_SEGMENT_STOP;
+	seg->buf = NULL;
+	seg->len = 0;
+}
+
+// The EEPROM doesn't acknowledge its address until the write cycle is over,
+// so probe the address until it does.
+static int eeprom_wait(struct eeprom *eeprom)
+{
+	const double deadline = now() + EEPROM_WRITE_TIMEOUT;
+	struct i2c_segment probe;
+
+	while (1) {
+		eeprom_probe(&probe, eeprom->addr);
+		if (i2c_bus_transfer(eeprom->bus, &probe, 1) < 0)
+			return -1;
+		if (probe.nack < 0)
+			return 0;
+		if (now() > deadline) {
+			fprintf(stderr, "EEPROM at 0x%02x doesn't respond\n",
+				eeprom->addr);
+			return -1;
+		}
+	}
+}
+
+// Sequential read: set the address pointer with a write and read the data
+// after a repeated START, the EEPROM increments the address by itself.
+static int eeprom_read(
+	struct eeprom *eeprom, unsigned offset, void *data, unsigned size)
+{
+	unsigned char *bytes = data;
+	unsigned char addr[2];
+
+	while (size > 0) {
+		const unsigned len =
+			size < EEPROM_READ_CHUNK ? size : EEPROM_READ_CHUNK;
+		struct i2c_segment segs[2];
+
+		segs[0].addr = eeprom->addr;
+		segs[0].flags = 0;
+		segs[0].buf = addr;
+		segs[0].len = eeprom_addr(eeprom, addr, offset);
+		segs[1].addr = eeprom->addr;
+		segs[1].flags = I2C_SEGMENT_READ | I2C_SEGMENT_STOP;
+		segs[1].buf = bytes;
+		segs[1].len = len;
+
+		if (i2c_bus_transfer(eeprom->bus, segs, 2) != 0) {
+			fprintf(stderr, "Failed to read at 0x%04x\n", offset);
+			return -1;
+		}
+
+		bytes += len;
+		offset += len;
+		size -= len;
+	}
+
+	return 0;
+}
+
+// Every page is written with its own transaction followed by address
+// probes, so the ACK polling of the write cycle happens in the same
+// submission and the next page starts as soon as the previous one is done.
+// If the EEPROM was still busy after all the probes of a page it ignores
+// the following pages, those are programmed again with the next submission.
+// The number of probes follows how long the write cycles actually take.
+static int eeprom_program(
+	struct eeprom *eeprom, unsigned offset, const void *data, unsigned size)
+{
+	const unsigned page = eeprom->type->page;
+	const unsigned stride = 2 + page;
+	const unsigned char *bytes = data;
+	struct i2c_segment *segs;
+	unsigned char *bufs;
+	unsigned failures = 0;
+	unsigned pos = 0;
+
+	segs = calloc(EEPROM_BATCH_PAGES * (1 + EEPROM_MAX_POLL),
+		      sizeof(*segs));
+	bufs = malloc(EEPROM_BATCH_PAGES * stride);
+	if (!segs || !bufs)
+		goto err;
+
+	while (pos < size) {
+		struct i2c_segment *writes[EEPROM_BATCH_PAGES];
+		unsigned lens[EEPROM_BATCH_PAGES];
+		const unsigned poll = eeprom->poll;
+		unsigned slowest = 0;
+		unsigned pages = 0;
+		unsigned count = 0;
+		unsigned done = 0;
+		unsigned next = pos;
+
+		while (pages < EEPROM_BATCH_PAGES && next < size) {
+			unsigned char *buf = &bufs[pages * stride];
+			unsigned len = page - (offset + next) % page;
+			unsigned addr_len;
+
+			if (len > size - next)
+				len = size - next;
+			addr_len = eeprom_addr(eeprom, buf, offset + next);
+			memcpy(buf + addr_len, bytes + next, len);
+
+			writes[pages] = &segs[count];
+			lens[pages] = len;
+			segs[count].addr = eeprom->addr;
+			segs[count].flags = I2C_SEGMENT_STOP;
+			segs[count].buf = buf;
+			segs[count].len = addr_len + len;
+			++count;
+			for (unsigned i = 0; i < poll; ++i)
+				eeprom_probe(&segs[count++], eeprom->addr);
+
+			next += len;
+			++pages;
+		}
+
+		if (i2c_bus_transfer(eeprom->bus, segs, count) < 0)
+			goto err;
+
+		for (; done < pages; ++done) {
+			const struct i2c_segment *write = writes[done];
+			unsigned ready = poll;
+
+			// The EEPROM was busy with the previous page.
+			if (write->nack == 0)
+				break;
+			if (write->nack > 0) {
+				fprintf(stderr,
+					"EEPROM refused data at 0x%04x, is it "
+					"write protected?\n",
+					offset + pos);
+				goto err;
+			}
+
+			for (unsigned i = 0; i < poll; ++i) {
+				if (write[1 + i].nack < 0) {
+					ready = i;
+					break;
+				}
+			}
+			if (ready > slowest)
+				slowest = ready;
+			pos += lens[done];
+		}
+
+		if (slowest == poll) {
+			eeprom->poll = poll * 2 > EEPROM_MAX_POLL ?
+				EEPROM_MAX_POLL : poll * 2;
+		} else {
+			// Leave some margin, so we don't have to redo pages
+			// because of small variations of the write cycle.
+			eeprom->poll = slowest + slowest / 4 + 2;
+			if (eeprom->poll < EEPROM_MIN_POLL)
+				eeprom->poll = EEPROM_MIN_POLL;
+			if (eeprom->poll > EEPROM_MAX_POLL)
+				eeprom->poll = EEPROM_MAX_POLL;
+		}
+
+		if (done == pages)
+			continue;
+
+		// Wait for the write cycle before programming the rest, but
+		// give up if even that doesn't help.
+		if (done == 0 && ++failures > 2) {
+			fprintf(stderr, "EEPROM ignores writes at 0x%04x\n",
+				offset + pos);
+			goto err;
+		}
+		if (done != 0)
+			failures = 0;
+		if (eeprom_wait(eeprom) != 0)
+			goto err;
+	}
+
+	free(bufs);
+	free(segs);
+	return eeprom_wait(eeprom);
+
+err:
+	free(bufs);
+	free(segs);
+	return -1;
+}
+
+static int eeprom_verify(
+	struct eeprom *eeprom, unsigned offset, const void *data, unsigned size)
+{
+	const unsigned char *expected = data;
+	unsigned char *actual = malloc(size);
+
+	if (!actual)
+		return -1;
+
+	if (eeprom_read(eeprom, offset, actual, size) != 0) {
+		free(actual);
+		return -1;
+	}
+
+	for (unsigned i = 0; i < size; ++i) {
+		if (actual[i] != expected[i]) {
+			fprintf(stderr,
+				"Mismatch at 0x%04x: expected 0x%02x, "
+				"got 0x%02x\n",
+				offset + i, expected[i], actual[i]);
+			free(actual);
+			return -1;
+		}
+	}
+
+	free(actual);
+	return 0;
+}
+
+// Maps the whole image file for reading.
+static void *map_image(const char *name, unsigned *size)
+{
+	struct stat st;
+	void *data;
+	int fd;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) != 0 || st.st_size == 0 ||
+	    st.st_size > EEPROM_MAX_SIZE) {
+		close(fd);
+		return NULL;
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return NULL;
+
+	*size = st.st_size;
+	return data;
+}
+
+static int do_read(
+	struct eeprom *eeprom, unsigned offset, unsigned size, const char *name)
+{
+	double start;
+	void *data;
+	int ret;
+	int fd;
+
+	fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to create %s\n", name);
+		return -1;
+	}
+
+	if (ftruncate(fd, size) != 0) {
+		fprintf(stderr, "Failed to resize %s\n", name);
+		close(fd);
+		return -1;
+	}
+
+	data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		fprintf(stderr, "Failed to map %s\n", name);
+		return -1;
+	}
+
+	start = now();
+	ret = eeprom_read(eeprom, offset, data, size);
+	if (ret == 0)
+		report("Read", size, start);
+	else
+		fprintf(stderr, "Failed to read the EEPROM\n");
+	munmap(data, size);
+	return ret;
+}
+
+static int do_write(struct eeprom *eeprom, unsigned offset, const char *name)
+{
+	unsigned size;
+	double start;
+	void *data;
+	int ret = -1;
+
+	data = map_image(name, &size);
+	if (!data) {
+		fprintf(stderr, "Failed to map %s\n", name);
+		return -1;
+	}
+
+	if (size > eeprom->type->size - offset) {
+		fprintf(stderr, "%s doesn't fit into the EEPROM\n", name);
+		goto out;
+	}
+
+	start = now();
+	if (eeprom_program(eeprom, offset, data, size) != 0) {
+		fprintf(stderr, "Failed to program the EEPROM\n");
+		goto out;
+	}
+	report("Programmed", size, start);
+
+	start = now();
+	if (eeprom_verify(eeprom, offset, data, size) != 0) {
+		fprintf(stderr, "Failed to verify the EEPROM\n");
+		goto out;
+	}
+	report("Verified", size, start);
+	ret = 0;
+
+out:
+	munmap(data, size);
+	return ret;
+}
+
+static int do_verify(struct eeprom *eeprom, unsigned offset, const char *name)
+{
+	unsigned size;
+	double start;
+	void *data;
+	int ret;
+
+	data = map_image(name, &size);
+	if (!data) {
+		fprintf(stderr, "Failed to map %s\n", name);
+		return -1;
+	}
+
+	if (size > eeprom->type->size - offset) {
+		fprintf(stderr, "%s doesn't fit into the EEPROM\n", name);
+		munmap(data, size);
+		return -1;
+	}
+
+	start = now();
+	ret = eeprom_verify(eeprom, offset, data, size);
+	if (ret == 0)
+		report("Verified", size, start);
+	else
+		fprintf(stderr, "Failed to verify the EEPROM\n");
+	munmap(data, size);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	const char *serial = NULL;
+	const char *read_file = NULL;
+	const char *write_file = NULL;
+	const char *verify_file = NULL;
+	const struct eeprom_type *type = NULL;
+	unsigned i2c_addr = 0x50;
+	unsigned offset = 0;
+	unsigned size = 0;
+	int optimize = 0;
+	char *endptr;
+
+	struct mpsse mpsse;
+	struct i2c_bus bus;
+	struct eeprom eeprom;
+	int ret;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:t:a:o:l:Or:w:v:h")) != -1) {
+		switch (opt) {
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		case 's':
+			serial = optarg;
+			break;
+		case 't':
+			type = eeprom_find_type(optarg);
+			if (!type) {
+				fprintf(stderr, "Unknown EEPROM type %s\n",
+					optarg);
+				return 1;
+			}
+			break;
+		case 'a':
+			i2c_addr = strtoul(optarg, &endptr, 0);
+			if (*endptr != '\0' || i2c_addr > 0x7f) {
+				fprintf(stderr,
+					"Failed to parse I2C address %s\n",
+					optarg);
+				return 1;
+			}
+			break;
+		case 'o':
+			offset = strtoul(optarg, &endptr, 0);
+			if (*endptr != '\0') {
+				fprintf(stderr, "Failed to parse offset %s\n",
+					optarg);
+				return 1;
+			}
+			break;
+		case 'l':
+			size = strtoul(optarg, &endptr, 0);
+			if (*endptr != '\0') {
+				fprintf(stderr, "Failed to parse size %s\n",
+					optarg);
+				return 1;
+			}
+			break;
+		case 'O':
+			optimize = 1;
+			break;
+		case 'r':
+			read_file = optarg;
+			break;
+		case 'w':
+			write_file = optarg;
+			break;
+		case 'v':
+			verify_file = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (!serial) {
+		fprintf(stderr, "Expect exactly one -s argument\n");
+		return 1;
+	}
+
+	if (!type) {
+		fprintf(stderr, "Expect exactly one -t argument\n");
+		return 1;
+	}
+
+	if (!!read_file + !!write_file + !!verify_file != 1) {
+		fprintf(stderr, "Expect exactly one of -r, -w and -v\n");
+		return 1;
+	}
+
+	if (offset >= type->size) {
+		fprintf(stderr, "Offset 0x%x is beyond the EEPROM\n", offset);
+		return 1;
+	}
+	if (size == 0 || size > type->size - offset)
+		size = type->size - offset;
+
+#ifdef TRANSPORT_D2XX
+	if (ftdi_register_device_id(device_vid, device_pid) != 0) {
+		fprintf(stderr,
+			"Failed to register VID:PID 0x%04x:0x%04x\n",
+			device_vid,
+			device_pid);
+		return 1;
+	}
+#endif
+
+	if (mpsse_open_spec(serial, &mpsse) != 0) {
+		fprintf(stderr, "Failed to enable MPSSE on %s\n", serial);
+		return 1;
+	}
+
+	if (mpsse_verify(&mpsse) != 0) {
+		fprintf(stderr, "Failed to verify MPSSE mode on %s\n", serial);
+		mpsse_close(&mpsse);
+		return 1;
+	}
+
+	if (i2c_bus_open(&bus, &mpsse) != 0) {
+		fprintf(stderr, "Failed to configure I2C on %s\n", serial);
+		mpsse_close(&mpsse);
+		return 1;
+	}
+
+	// The data bytes read don't ask the device to send them immediately,
+	// but every ACK bit of a byte written does. Page writes and ACK
+	// polling send a lot of bytes, there is no point in sending the ACKs
+	// back in tiny packets in the middle of a batch.
+	bus.optimize = optimize ? MPSSE_OPT_ALL : MPSSE_OPT_FLUSH;
+
+	eeprom.bus = &bus;
+	eeprom.type = type;
+	eeprom.addr = i2c_addr;
+	eeprom.poll = EEPROM_MIN_POLL;
+
+	if (sim_is_sim(mpsse.transport))
+		sim_reset_stats(mpsse.transport);
+
+	if (read_file)
+		ret = do_read(&eeprom, offset, size, read_file);
+	else if (write_file)
+		ret = do_write(&eeprom, offset, write_file);
+	else
+		ret = do_verify(&eeprom, offset, verify_file);
+
+	if (sim_is_sim(mpsse.transport))
+		sim_print_stats(mpsse.transport, stdout);
+
+	i2c_bus_close(&bus);
+	if (mpsse_close(&mpsse) != 0) {
+		fprintf(stderr, "Failed to close %s\n", serial);
+		ret = -1;
+	}
+
+	return ret == 0 ? 0 : 1;
+}
@@ -1,6 +1,19 @@
 // SPDX-License-Identifier: GPL-2.0
 #include "ftdi.h"
 
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+// Upper bound on a single sleep of the event forwarding thread. D2XX signals
+// the event without any regard to whether somebody waits on it, so we could
+// miss a notification that arrived right before we started waiting. The
+// bound makes sure that we recheck the queue eventually.
+static const int FTDI_EVENT_RECHECK_TIMEOUT = 100;
+
 int ftdi_devices(int *devices)
 {
 	FT_STATUS status;
@@ -140,22 +153,192 @@ int ftdi_read(FT_HANDLE handle, void *buf, unsigned size)
 	return read;
 }
 
-int ftdi_read_exactly(FT_HANDLE handle, void *buf, unsigned size)
+static int ftdi_pending(FT_HANDLE handle, DWORD *pending)
 {
-	unsigned char *b = buf;
-	DWORD total = 0;
+	FT_STATUS status;
 
-	while (total < size) {
-		FT_STATUS status;
-		DWORD read;
+	status = FT_GetQueueStatus(handle, pending);
+	if (!FT_SUCCESS(status))
+		return -1;
+	return 0;
+}
 
-		status = FT_Read(
-			handle, (void *)(b + total), size - total, &read);
-		if (!FT_SUCCESS(status))
-			return -1;
-		total += read;
+int ftdi_event_setup(FT_HANDLE handle, struct ftdi_event *event)
+{
+	FT_STATUS status;
+
+	if (pthread_mutex_init(&event->handle.eMutex, NULL) != 0)
+		return -1;
+
+	if (pthread_cond_init(&event->handle.eCondVar, NULL) != 0) {
+		pthread_mutex_destroy(&event->handle.eMutex);
+		return -1;
 	}
-	return total;
+
+	if (pthread_cond_init(&event->wakeup, NULL) != 0) {
+		pthread_cond_destroy(&event->handle.eCondVar);
+		pthread_mutex_destroy(&event->handle.eMutex);
+		return -1;
+	}
+
+	event->handle.iVar = 0;
+	event->fd = -1;
+	event->stop = 0;
+
+	status = FT_SetEventNotification(
+		handle, FT_EVENT_RXCHAR, (PVOID)&event->handle);
+	if (!FT_SUCCESS(status)) {
+		pthread_cond_destroy(&event->wakeup);
+		pthread_cond_destroy(&event->handle.eCondVar);
+		pthread_mutex_destroy(&event->handle.eMutex);
+		return -1;
+	}
+
+	return 0;
+}
+
+void ftdi_event_stop(struct ftdi_event *event)
+{
+	if (event->fd < 0)
+		return;
+
+	pthread_mutex_lock(&event->handle.eMutex);
+	event->stop = 1;
+	pthread_cond_broadcast(&event->handle.eCondVar);
+	pthread_mutex_unlock(&event->handle.eMutex);
+	pthread_join(event->thread, NULL);
+	close(event->fd);
+	event->fd = -1;
+}
+
+void ftdi_event_release(struct ftdi_event *event)
+{
+	ftdi_event_stop(event);
+	pthread_cond_destroy(&event->wakeup);
+	pthread_cond_destroy(&event->handle.eCondVar);
+	pthread_mutex_destroy(&event->handle.eMutex);
+}
+
+static void ftdi_deadline(struct timespec *deadline, int timeout)
+{
+	clock_gettime(CLOCK_REALTIME, deadline);
+	deadline->tv_sec += timeout / 1000;
+	deadline->tv_nsec += (long)(timeout % 1000) * 1000000;
+	if (deadline->tv_nsec >= 1000000000) {
+		deadline->tv_sec += 1;
+		deadline->tv_nsec -= 1000000000;
+	}
+}
+
+int ftdi_wait(FT_HANDLE handle, struct ftdi_event *event, int timeout)
+{
+	struct timespec deadline;
+	DWORD pending = 0;
+	int ret = 0;
+
+	ftdi_deadline(&deadline, timeout);
+	pthread_mutex_lock(&event->handle.eMutex);
+	while (ret == 0) {
+		// D2XX signals the event under the mutex, so checking the
+		// queue with the mutex held we can't miss the notification.
+		if (ftdi_pending(handle, &pending) != 0) {
+			ret = -1;
+			break;
+		}
+
+		if (pending != 0) {
+			ret = 1;
+			break;
+		}
+
+		// Don't compete with the eventfd thread for the D2XX
+		// notification, it passes every one of them on.
+		if (pthread_cond_timedwait(event->fd >= 0 ?
+						&event->wakeup :
+						&event->handle.eCondVar,
+					   &event->handle.eMutex,
+					   &deadline) == ETIMEDOUT)
+			break;
+	}
+	pthread_mutex_unlock(&event->handle.eMutex);
+	return ret;
+}
+
+struct ftdi_event_thread_args {
+	FT_HANDLE handle;
+	struct ftdi_event *event;
+};
+
+static void *ftdi_event_thread(void *arg)
+{
+	struct ftdi_event_thread_args args =
+		*(struct ftdi_event_thread_args *)arg;
+	struct ftdi_event *event = args.event;
+
+	free(arg);
+	pthread_mutex_lock(&event->handle.eMutex);
+	while (!event->stop) {
+		struct timespec deadline;
+		const uint64_t one = 1;
+		DWORD pending = 0;
+
+		ftdi_deadline(&deadline, FTDI_EVENT_RECHECK_TIMEOUT);
+		pthread_cond_timedwait(
+			&event->handle.eCondVar,
+			&event->handle.eMutex,
+			&deadline);
+		if (event->stop)
+			break;
+
+		pthread_cond_broadcast(&event->wakeup);
+
+		if (ftdi_pending(args.handle, &pending) == 0 && pending == 0)
+			continue;
+
+		// On error we wake up the consumer as well, so it could find
+		// out about the error trying to read.
+		if (write(event->fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+			break;
+	}
+	pthread_mutex_unlock(&event->handle.eMutex);
+	return NULL;
+}
+
+int ftdi_event_fd(FT_HANDLE handle, struct ftdi_event *event)
+{
+	struct ftdi_event_thread_args *args;
+	int fd;
+
+	if (event->fd >= 0)
+		return event->fd;
+
+	args = malloc(sizeof(*args));
+	if (!args)
+		return -1;
+	args->handle = handle;
+	args->event = event;
+
+	fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd < 0) {
+		free(args);
+		return -1;
+	}
+
+	// ftdi_wait picks the condition variable to wait on by the fd.
+	pthread_mutex_lock(&event->handle.eMutex);
+	event->fd = fd;
+	event->stop = 0;
+	pthread_mutex_unlock(&event->handle.eMutex);
+	if (pthread_create(&event->thread, NULL, ftdi_event_thread, args)) {
+		pthread_mutex_lock(&event->handle.eMutex);
+		event->fd = -1;
+		pthread_mutex_unlock(&event->handle.eMutex);
+		close(fd);
+		free(args);
+		return -1;
+	}
+
+	return event->fd;
 }
 
 int ftdi_drain(FT_HANDLE handle)
@@ -214,3 +397,124 @@ int ftdi_write_exactly(FT_HANDLE handle, const void *buf, unsigned size)
 	}
 	return total;
 }
+
+struct ftdi_transport {
+	// Must be the first member, the transport operations convert the
+	// pointer to the transport back to the pointer to ftdi_transport.
+	struct transport transport;
+	FT_HANDLE handle;
+	struct ftdi_event event;
+};
+
+static struct ftdi_transport *ftdi_transport(struct transport *transport)
+{
+	return (struct ftdi_transport *)transport;
+}
+
+static int ftdi_transport_close(struct transport *transport)
+{
+	struct ftdi_transport *ftdi = ftdi_transport(transport);
+	int ret;
+
+	// The eventfd thread queries the handle, so it has to go before the
+	// handle, while D2XX may signal the event until the handle is closed.
+	ftdi_event_stop(&ftdi->event);
+	ret = ftdi_close(ftdi->handle);
+	ftdi_event_release(&ftdi->event);
+	free(ftdi);
+	return ret;
+}
+
+static int ftdi_transport_reset(struct transport *transport)
+{
+	return ftdi_reset(ftdi_transport(transport)->handle);
+}
+
+static int ftdi_transport_drain(struct transport *transport)
+{
+	return ftdi_drain(ftdi_transport(transport)->handle);
+}
+
+static int ftdi_transport_disable_special_chars(struct transport *transport)
+{
+	return ftdi_disable_special_chars(ftdi_transport(transport)->handle);
+}
+
+static int ftdi_transport_set_bit_mode(
+	struct transport *transport, unsigned mode)
+{
+	return ftdi_set_bit_mode(ftdi_transport(transport)->handle, mode);
+}
+
+static int ftdi_transport_write(
+	struct transport *transport, const void *buf, unsigned size)
+{
+	return ftdi_write_exactly(ftdi_transport(transport)->handle, buf, size);
+}
+
+static int ftdi_transport_read(
+	struct transport *transport, void *buf, unsigned size)
+{
+	struct ftdi_transport *ftdi = ftdi_transport(transport);
+	uint64_t counter;
+
+	// Clear the file descriptor before reading, so the data that arrives
+	// after we've read everything signals it again.
+	if (ftdi->event.fd >= 0 &&
+	    read(ftdi->event.fd, &counter, sizeof(counter)) < 0 &&
+	    errno != EAGAIN)
+		return -1;
+
+	return ftdi_read(ftdi->handle, buf, size);
+}
+
+static int ftdi_transport_wait(struct transport *transport, int timeout)
+{
+	struct ftdi_transport *ftdi = ftdi_transport(transport);
+
+	return ftdi_wait(ftdi->handle, &ftdi->event, timeout);
+}
+
+static int ftdi_transport_fd(struct transport *transport)
+{
+	struct ftdi_transport *ftdi = ftdi_transport(transport);
+
+	return ftdi_event_fd(ftdi->handle, &ftdi->event);
+}
+
+static const struct transport_ops ftdi_transport_ops = {
+	.close = ftdi_transport_close,
+	.reset = ftdi_transport_reset,
+	.drain = ftdi_transport_drain,
+	.disable_special_chars = ftdi_transport_disable_special_chars,
+	.set_bit_mode = ftdi_transport_set_bit_mode,
+	.write = ftdi_transport_write,
+	.read = ftdi_transport_read,
+	.wait = ftdi_transport_wait,
+	.fd = ftdi_transport_fd,
+};
+
+int ftdi_transport_open(
+	const struct serial *serial, struct transport **transport)
+{
+	struct ftdi_transport *ftdi;
+
+	ftdi = malloc(sizeof(*ftdi));
+	if (!ftdi)
+		return -1;
+
+	if (ftdi_open(serial, &ftdi->handle) != 0) {
+		free(ftdi);
+		return -1;
+	}
+
+	if (ftdi_event_setup(ftdi->handle, &ftdi->event) != 0) {
+		ftdi_close(ftdi->handle);
+		free(ftdi);
+		return -1;
+	}
+
+	ftdi->transport.ops = &ftdi_transport_ops;
+	*transport = &ftdi->transport;
+	return 0;
+}
@@ -2,7 +2,10 @@
 #ifndef __FTDI_H__
 #define __FTDI_H__
 
+#include <pthread.h>
+
 #include "ftd2xx.h"
+#include "transport.h"
 
 #define FTDI_BIT_MODE_RESET 0x0u
 #define FTDI_BIT_MODE_MPSSE 0x2u
@@ -35,11 +38,53 @@ int ftdi_set_device_id(FT_HANDLE handle, unsigned vid, unsigned pid);
 int ftdi_disable_special_chars(FT_HANDLE handle);
 int ftdi_set_bit_mode(FT_HANDLE handle, unsigned mode);
 
+// FTDI event is signalled by the D2XX driver when the device receives data,
+// so we can wait for the data to arrive without spinning. The D2XX driver
+// keeps a pointer to the event, so it must not be moved after setup.
+struct ftdi_event {
+	EVENT_HANDLE handle;
+	// eventfd signalled when the device has data to read, so the event
+	// could be used with poll/epoll. It's created on demand together
+	// with a thread that forwards the D2XX notifications to it.
+	int fd;
+	int stop;
+	pthread_t thread;
+	// D2XX wakes up only one waiter, so once the thread is running it's
+	// the only one waiting for D2XX and it passes every notification on
+	// to ftdi_wait through this condition variable. Protected by the
+	// mutex of the handle.
+	pthread_cond_t wakeup;
+};
+
+// The event is registered with the handle, so the handle must be closed
+// before the event is released. ftdi_event_stop stops the eventfd thread,
+// which uses the handle, it must be called before the handle is closed.
+int ftdi_event_setup(FT_HANDLE handle, struct ftdi_event *event);
+void ftdi_event_stop(struct ftdi_event *event);
+void ftdi_event_release(struct ftdi_event *event);
+
+// Waits until the device has data to read or the timeout in milliseconds
+// expires. Returns 1 if there is data to read, 0 on timeout and a negative
+// value on error.
+int ftdi_wait(FT_HANDLE handle, struct ftdi_event *event, int timeout);
+
+// Returns a file descriptor that becomes readable when the device has data
+// to read. The caller should read the 8 byte counter from the file descriptor
+// to clear it and then read the data from the device. Returns a negative
+// value on error.
+int ftdi_event_fd(FT_HANDLE handle, struct ftdi_event *event);
+
+// ftdi_read never blocks and returns the number of bytes read, which might
+// be 0, or a negative value on error.
 int ftdi_read(FT_HANDLE handle, void *buf, unsigned size);
-int ftdi_read_exactly(FT_HANDLE handle, void *buf, unsigned size);
 int ftdi_drain(FT_HANDLE handle);
 
 int ftdi_write(FT_HANDLE handle, const void *buf, unsigned size);
 int ftdi_write_exactly(FT_HANDLE handle, const void *buf, unsigned size);
 
+// Opens the device through the D2XX driver and wraps it into a transport
+// for the MPSSE library.
+int ftdi_transport_open(
+	const struct serial *serial, struct transport **transport);
+
 #endif  // __FTDI_H__
@@ -0,0 +1,580 @@
+// SPDX-License-Identifier: GPL-2.0
+#include "ftdi_usb.h"
+
+#include <libusb.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "usbid.h"
+
+// FTDI vendor requests, the same ones the D2XX driver and the kernel ftdi_sio
+// driver use. They all take the index of the interface in wIndex, interface
+// A has index 1.
+#define FTDI_USB_REQUEST_OUT 0x40
+#define FTDI_USB_SIO_RESET 0x00
+#define FTDI_USB_SIO_SET_EVENT_CHAR 0x06
+#define FTDI_USB_SIO_SET_ERROR_CHAR 0x07
+#define FTDI_USB_SIO_SET_LATENCY_TIMER 0x09
+#define FTDI_USB_SIO_SET_BITMODE 0x0b
+
+#define FTDI_USB_RESET_SIO 0
+#define FTDI_USB_RESET_PURGE_RX 1
+#define FTDI_USB_RESET_PURGE_TX 2
+
+#define FTDI_USB_INTERFACE 0
+#define FTDI_USB_INDEX 1
+#define FTDI_USB_EP_IN 0x81
+#define FTDI_USB_EP_OUT 0x02
+
+// Every bulk in packet starts with two modem status bytes, the second one
+// reports line errors, overrun and FIFO errors mean that we lost data.
+#define FTDI_USB_STATUS_SIZE 2
+#define FTDI_USB_LINE_STATUS_ERRORS 0x82
+
+// We keep several bulk in transfers submitted all the time, so the host
+// controller polls the device even while we process the previous transfer.
+// The received data is collected in a ring buffer, a transfer is only
+// submitted if the ring buffer has space for all of its data, so we never
+// have to drop anything.
+#define FTDI_USB_TRANSFERS 4
+#define FTDI_USB_TRANSFER_SIZE 4096
+#define FTDI_USB_RING_SIZE 65536
+
+// The latency timer defines how long the device holds incomplete packets
+// before sending them to the host, the D2XX default is 16ms.
+static const unsigned FTDI_USB_LATENCY = 1;
+static const unsigned FTDI_USB_TIMEOUT = 1000;
+// How many times in a row handling the events may fail while we wait for
+// the cancelled transfers on close before we give up on them.
+static const unsigned FTDI_USB_RELEASE_FAILURES = 10;
+
+struct ftdi_usb {
+	// Must be the first member, the transport operations convert the
+	// pointer to the transport back to the pointer to ftdi_usb.
+	struct transport transport;
+	libusb_context *ctx;
+	libusb_device_handle *handle;
+	unsigned packet_size;
+
+	struct libusb_transfer *transfers[FTDI_USB_TRANSFERS];
+	int active[FTDI_USB_TRANSFERS];
+	// Amount of space in the ring buffer reserved by the submitted
+	// transfers.
+	unsigned reserved;
+	int closing;
+	int error;
+
+	unsigned char ring[FTDI_USB_RING_SIZE];
+	unsigned head;
+	unsigned tail;
+
+	// epoll file descriptor that tracks all the libusb file descriptors.
+	int fd;
+};
+
+static struct ftdi_usb *ftdi_usb(struct transport *transport)
+{
+	return (struct ftdi_usb *)transport;
+}
+
+static int ftdi_usb_control(
+	struct ftdi_usb *usb, unsigned request, unsigned value)
+{
+	int ret;
+
+	ret = libusb_control_transfer(
+		usb->handle, FTDI_USB_REQUEST_OUT, request, value,
+		FTDI_USB_INDEX, NULL, 0, FTDI_USB_TIMEOUT);
+	if (ret < 0)
+		return -1;
+	return 0;
+}
+
+static unsigned ftdi_usb_ring_free(struct ftdi_usb *usb)
+{
+	return FTDI_USB_RING_SIZE - (usb->tail - usb->head);
+}
+
+static void ftdi_usb_unpack(
+	struct ftdi_usb *usb, const unsigned char *buf, unsigned size)
+{
+	unsigned offset;
+
+	for (offset = 0; offset < size; offset += usb->packet_size) {
+		unsigned len = size - offset;
+		unsigned i;
+
+		if (len > usb->packet_size)
+			len = usb->packet_size;
+		if (len < FTDI_USB_STATUS_SIZE)
+			continue;
+
+		if (buf[offset + 1] & FTDI_USB_LINE_STATUS_ERRORS)
+			usb->error = 1;
+
+		for (i = FTDI_USB_STATUS_SIZE; i < len; ++i) {
+			usb->ring[usb->tail % FTDI_USB_RING_SIZE] =
+				buf[offset + i];
+			++usb->tail;
+		}
+	}
+}
+
+static void ftdi_usb_submit(struct ftdi_usb *usb);
+
+static void ftdi_usb_in_done(struct libusb_transfer *transfer)
+{
+	struct ftdi_usb *usb = transfer->user_data;
+	int i;
+
+	for (i = 0; i < FTDI_USB_TRANSFERS; ++i) {
+		if (usb->transfers[i] == transfer)
+			usb->active[i] = 0;
+	}
+	usb->reserved -= transfer->length;
+
+	if (transfer->status == LIBUSB_TRANSFER_CANCELLED)
+		return;
+
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		usb->error = 1;
+		return;
+	}
+
+	ftdi_usb_unpack(usb, transfer->buffer, transfer->actual_length);
+	ftdi_usb_submit(usb);
+}
+
+static void ftdi_usb_submit(struct ftdi_usb *usb)
+{
+	int i;
+
+	if (usb->closing || usb->error)
+		return;
+
+	for (i = 0; i < FTDI_USB_TRANSFERS; ++i) {
+		if (usb->active[i])
+			continue;
+
+		if (ftdi_usb_ring_free(usb) - usb->reserved <
+				FTDI_USB_TRANSFER_SIZE)
+			return;
+
+		if (libusb_submit_transfer(usb->transfers[i]) < 0) {
+			usb->error = 1;
+			return;
+		}
+
+		usb->active[i] = 1;
+		usb->reserved += FTDI_USB_TRANSFER_SIZE;
+	}
+}
+
+// Runs the libusb callbacks for the completed transfers without blocking.
+static int ftdi_usb_process(struct ftdi_usb *usb)
+{
+	struct timeval zero = {0, 0};
+
+	if (libusb_handle_events_timeout_completed(usb->ctx, &zero, NULL) < 0)
+		return -1;
+	if (usb->error)
+		return -1;
+	return 0;
+}
+
+static void ftdi_usb_release(struct ftdi_usb *usb)
+{
+	struct timeval tv = {0, 100000};
+	unsigned failures = 0;
+	int i, active;
+
+	usb->closing = 1;
+	for (i = 0; i < FTDI_USB_TRANSFERS; ++i) {
+		if (usb->active[i])
+			libusb_cancel_transfer(usb->transfers[i]);
+	}
+
+	// Cancelled transfers still refer to their buffers and to usb until
+	// their callbacks run, so keep handling the events until all of them
+	// completed.
+	while (1) {
+		int ret;
+
+		active = 0;
+		for (i = 0; i < FTDI_USB_TRANSFERS; ++i)
+			active += usb->active[i];
+		if (active == 0)
+			break;
+
+		ret = libusb_handle_events_timeout_completed(
+			usb->ctx, &tv, NULL);
+		if (ret == 0 || ret == LIBUSB_ERROR_INTERRUPTED) {
+			failures = 0;
+			continue;
+		}
+		if (++failures == FTDI_USB_RELEASE_FAILURES)
+			break;
+	}
+
+	// libusb still owns the transfers, freeing anything they refer to is
+	// not safe, so leak all of it.
+	if (active != 0)
+		return;
+
+	for (i = 0; i < FTDI_USB_TRANSFERS; ++i) {
+		if (!usb->transfers[i])
+			continue;
+		free(usb->transfers[i]->buffer);
+		libusb_free_transfer(usb->transfers[i]);
+	}
+
+	if (usb->fd >= 0) {
+		libusb_set_pollfd_notifiers(usb->ctx, NULL, NULL, NULL);
+		close(usb->fd);
+	}
+
+	libusb_release_interface(usb->handle, FTDI_USB_INTERFACE);
+	libusb_close(usb->handle);
+	libusb_exit(usb->ctx);
+	free(usb);
+}
+
+static int ftdi_usb_close(struct transport *transport)
+{
+	ftdi_usb_release(ftdi_usb(transport));
+	return 0;
+}
+
+static int ftdi_usb_reset(struct transport *transport)
+{
+	return ftdi_usb_control(
+		ftdi_usb(transport), FTDI_USB_SIO_RESET, FTDI_USB_RESET_SIO);
+}
+
+static int ftdi_usb_drain(struct transport *transport)
+{
+	struct ftdi_usb *usb = ftdi_usb(transport);
+
+	if (ftdi_usb_control(usb, FTDI_USB_SIO_RESET,
+			     FTDI_USB_RESET_PURGE_RX) != 0)
+		return -1;
+
+	if (ftdi_usb_control(usb, FTDI_USB_SIO_RESET,
+			     FTDI_USB_RESET_PURGE_TX) != 0)
+		return -1;
+
+	// Drop whatever arrived before the device purged its buffers as well
+	// and forget about the errors we've seen so far.
+	usb->error = 0;
+	if (ftdi_usb_process(usb) != 0)
+		return -1;
+	usb->head = usb->tail;
+	ftdi_usb_submit(usb);
+	return usb->error ? -1 : 0;
+}
+
+static int ftdi_usb_disable_special_chars(struct transport *transport)
+{
+	struct ftdi_usb *usb = ftdi_usb(transport);
+
+	if (ftdi_usb_control(usb, FTDI_USB_SIO_SET_EVENT_CHAR, 0) != 0)
+		return -1;
+
+	if (ftdi_usb_control(usb, FTDI_USB_SIO_SET_ERROR_CHAR, 0) != 0)
+		return -1;
+
+	return 0;
+}
+
+static int ftdi_usb_set_bit_mode(struct transport *transport, unsigned mode)
+{
+	return ftdi_usb_control(
+		ftdi_usb(transport), FTDI_USB_SIO_SET_BITMODE, mode << 8);
+}
+
+static int ftdi_usb_write(
+	struct transport *transport, const void *buf, unsigned size)
+{
+	struct ftdi_usb *usb = ftdi_usb(transport);
+	const unsigned char *b = buf;
+	unsigned total = 0;
+
+	// Synchronous libusb transfers run the event loop while waiting, so
+	// the bulk in transfers keep going while we write.
+	while (total < size) {
+		int written = 0;
+		int ret;
+
+		ret = libusb_bulk_transfer(
+			usb->handle, FTDI_USB_EP_OUT,
+			(unsigned char *)(b + total), size - total,
+			&written, FTDI_USB_TIMEOUT);
+		if (ret < 0 && ret != LIBUSB_ERROR_TIMEOUT)
+			return -1;
+		if (ret == LIBUSB_ERROR_TIMEOUT && written == 0)
+			return -1;
+		total += written;
+	}
+
+	if (usb->error)
+		return -1;
+	return total;
+}
+
+static int ftdi_usb_read(
+	struct transport *transport, void *buf, unsigned size)
+{
+	struct ftdi_usb *usb = ftdi_usb(transport);
+	unsigned char *b = buf;
+	unsigned read = 0;
+
+	if (ftdi_usb_process(usb) != 0)
+		return -1;
+
+	while (read < size && usb->head != usb->tail) {
+		b[read++] = usb->ring[usb->head % FTDI_USB_RING_SIZE];
+		++usb->head;
+	}
+
+	ftdi_usb_submit(usb);
+	return read;
+}
+
+static int ftdi_usb_wait(struct transport *transport, int timeout)
+{
+	struct ftdi_usb *usb = ftdi_usb(transport);
+	struct timespec now, deadline;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += timeout / 1000;
+	deadline.tv_nsec += (long)(timeout % 1000) * 1000000;
+
+	while (1) {
+		struct timeval tv;
+		long left;
+
+		if (ftdi_usb_process(usb) != 0)
+			return -1;
+		if (usb->head != usb->tail)
+			return 1;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		left = (deadline.tv_sec - now.tv_sec) * 1000000 +
+			(deadline.tv_nsec - now.tv_nsec) / 1000;
+		if (left <= 0)
+			return 0;
+
+		tv.tv_sec = left / 1000000;
+		tv.tv_usec = left % 1000000;
+		if (libusb_handle_events_timeout_completed(
+				usb->ctx, &tv, NULL) < 0)
+			return -1;
+	}
+}
+
+static void ftdi_usb_pollfd_added(int fd, short events, void *arg)
+{
+	struct ftdi_usb *usb = arg;
+	struct epoll_event event;
+
+	memset(&event, 0, sizeof(event));
+	event.events = events;
+	event.data.fd = fd;
+	epoll_ctl(usb->fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+static void ftdi_usb_pollfd_removed(int fd, void *arg)
+{
+	struct ftdi_usb *usb = arg;
+
+	epoll_ctl(usb->fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+static int ftdi_usb_fd(struct transport *transport)
+{
+	struct ftdi_usb *usb = ftdi_usb(transport);
+	const struct libusb_pollfd **pollfds;
+	int i;
+
+	if (usb->fd >= 0)
+		return usb->fd;
+
+	// libusb may use several file descriptors, an epoll file descriptor
+	// becomes readable when any of them is ready, so the caller has to
+	// deal with only one.
+	usb->fd = epoll_create1(EPOLL_CLOEXEC);
+	if (usb->fd < 0)
+		return -1;
+
+	pollfds = libusb_get_pollfds(usb->ctx);
+	if (!pollfds) {
+		close(usb->fd);
+		usb->fd = -1;
+		return -1;
+	}
+
+	for (i = 0; pollfds[i]; ++i)
+		ftdi_usb_pollfd_added(pollfds[i]->fd, pollfds[i]->events, usb);
+	libusb_free_pollfds(pollfds);
+
+	libusb_set_pollfd_notifiers(
+		usb->ctx, ftdi_usb_pollfd_added, ftdi_usb_pollfd_removed, usb);
+	return usb->fd;
+}
+
+static const struct transport_ops ftdi_usb_ops = {
+	.close = ftdi_usb_close,
+	.reset = ftdi_usb_reset,
+	.drain = ftdi_usb_drain,
+	.disable_special_chars = ftdi_usb_disable_special_chars,
+	.set_bit_mode = ftdi_usb_set_bit_mode,
+	.write = ftdi_usb_write,
+	.read = ftdi_usb_read,
+	.wait = ftdi_usb_wait,
+	.fd = ftdi_usb_fd,
+};
+
+static int ftdi_usb_parse(
+	const char *spec, char *serial, unsigned size, unsigned *vid,
+	unsigned *pid)
+{
+	const char *at = strchr(spec, '@');
+	unsigned len = at ? (unsigned)(at - spec) : strlen(spec);
+
+	if (len > size - 1)
+		return -1;
+	memcpy(serial, spec, len);
+	serial[len] = '\0';
+
+	// 0:0 means that VID:PID wasn't given, see ftdi_usb_open.
+	*vid = 0;
+	*pid = 0;
+	if (at && parse_device_id(at + 1, vid, pid) != 0)
+		return -1;
+	return 0;
+}
+
+static libusb_device_handle *ftdi_usb_find(
+	libusb_context *ctx, const char *serial, unsigned vid, unsigned pid)
+{
+	libusb_device_handle *handle = NULL;
+	libusb_device **devices;
+	ssize_t count, i;
+
+	count = libusb_get_device_list(ctx, &devices);
+	if (count < 0)
+		return NULL;
+
+	for (i = 0; i < count && !handle; ++i) {
+		struct libusb_device_descriptor desc;
+		unsigned char buf[64];
+
+		if (libusb_get_device_descriptor(devices[i], &desc) != 0)
+			continue;
+		if (desc.idVendor != vid || desc.idProduct != pid)
+			continue;
+		if (libusb_open(devices[i], &handle) != 0) {
+			handle = NULL;
+			continue;
+		}
+		if (serial[0] == '\0')
+			break;
+
+		if (libusb_get_string_descriptor_ascii(
+				handle, desc.iSerialNumber, buf,
+				sizeof(buf)) < 0 ||
+		    strcmp((const char *)buf, serial) != 0) {
+			libusb_close(handle);
+			handle = NULL;
+		}
+	}
+
+	libusb_free_device_list(devices, 1);
+	return handle;
+}
+
+int ftdi_usb_open(const char *spec, struct transport **transport)
+{
+	struct ftdi_usb *usb;
+	unsigned vid, pid;
+	char serial[64];
+	int i, ret;
+
+	if (ftdi_usb_parse(spec, serial, sizeof(serial), &vid, &pid) != 0)
+		return -1;
+
+	usb = calloc(1, sizeof(*usb));
+	if (!usb)
+		return -1;
+	usb->fd = -1;
+
+	if (libusb_init(&usb->ctx) != 0) {
+		free(usb);
+		return -1;
+	}
+
+	if (vid == 0 && pid == 0) {
+		usb->handle = ftdi_usb_find(
+			usb->ctx, serial,
+			FTDI_USB_DEFAULT_VID, FTDI_USB_DEFAULT_PID);
+		if (!usb->handle)
+			usb->handle = ftdi_usb_find(
+				usb->ctx, serial,
+				FTDI_USB_FT232H_VID, FTDI_USB_FT232H_PID);
+	} else {
+		usb->handle = ftdi_usb_find(usb->ctx, serial, vid, pid);
+	}
+	if (!usb->handle) {
+		libusb_exit(usb->ctx);
+		free(usb);
+		return -1;
+	}
+
+	libusb_set_auto_detach_kernel_driver(usb->handle, 1);
+	if (libusb_claim_interface(usb->handle, FTDI_USB_INTERFACE) != 0) {
+		libusb_close(usb->handle);
+		libusb_exit(usb->ctx);
+		free(usb);
+		return -1;
+	}
+
+	// From here on ftdi_usb_release can clean up after us.
+	ret = libusb_get_max_packet_size(
+		libusb_get_device(usb->handle), FTDI_USB_EP_IN);
+	if (ret <= FTDI_USB_STATUS_SIZE)
+		goto err;
+	usb->packet_size = ret;
+
+	if (ftdi_usb_control(usb, FTDI_USB_SIO_SET_LATENCY_TIMER,
+			     FTDI_USB_LATENCY) != 0)
+		goto err;
+
+	for (i = 0; i < FTDI_USB_TRANSFERS; ++i) {
+		unsigned char *buf = malloc(FTDI_USB_TRANSFER_SIZE);
+
+		usb->transfers[i] = libusb_alloc_transfer(0);
+		if (!buf || !usb->transfers[i]) {
+			free(buf);
+			goto err;
+		}
+
+		libusb_fill_bulk_transfer(
+			usb->transfers[i], usb->handle, FTDI_USB_EP_IN,
+			buf, FTDI_USB_TRANSFER_SIZE, ftdi_usb_in_done, usb, 0);
+	}
+
+	ftdi_usb_submit(usb);
+	if (usb->error)
+		goto err;
+
+	usb->transport.ops = &ftdi_usb_ops;
+	*transport = &usb->transport;
+	return 0;
+
+err:
+	ftdi_usb_release(usb);
+	return -1;
+}
@@ -0,0 +1,21 @@
+// SPDX-License-Identifier: GPL-2.0
+#ifndef __FTDI_USB_H__
+#define __FTDI_USB_H__
+
+#include "transport.h"
+
+// The dongles used with this repository are reprogrammed to 0005:0001 (see
+// setvidpid), a stock FT232H uses 0403:6014.
+#define FTDI_USB_DEFAULT_VID 0x0005
+#define FTDI_USB_DEFAULT_PID 0x0001
+#define FTDI_USB_FT232H_VID 0x0403
+#define FTDI_USB_FT232H_PID 0x6014
+
+// Opens the FTDI device directly through libusb without the D2XX driver.
+// The spec has format [serial][@vid:pid], if the serial is omitted the first
+// device with matching VID:PID is used, if VID:PID is omitted the default
+// VID:PID is tried first and then the stock FT232H VID:PID. The function
+// returns 0 on success and a non-0 value otherwise.
+int ftdi_usb_open(const char *spec, struct transport **transport);
+
+#endif  // __FTDI_USB_H__
@@ -0,0 +1,371 @@
+// SPDX-License-Identifier: GPL-2.0
+#include "i2c.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+// Submits the commands in the MPSSE IO buffer, but leaves them in the buffer,
+// so the caller can look at their data.
+static int i2c_bus_execute(struct i2c_bus *bus)
+{
+	if (bus->optimize &&
+	    mpsse_optimize(&bus->io, bus->optimize, NULL, 0) != 0)
+		return -1;
+	return mpsse_submit(bus->mpsse, &bus->io);
+}
+
+static int i2c_bus_submit(struct i2c_bus *bus)
+{
+	int ret = i2c_bus_execute(bus);
+
+	mpsse_io_buffer_reset(&bus->io);
+	return ret;
+}
+
+static int i2c_bus_setup(struct i2c_bus *bus)
+{
+	struct mpsse_io_buffer *io = &bus->io;
+
+	mpsse_disable_freq_div5(io, NULL);
+	mpsse_disable_adaptive_clocking(io, NULL);
+	mpsse_enable_3phase_clocking(io, NULL);
+	mpsse_set_drive0_pins(io, 0x7, NULL);
+	mpsse_disable_loopback(io, NULL);
+	mpsse_set_freq_divisor(io, 0xffff, NULL);
+	return i2c_bus_submit(bus);
+}
+
+int i2c_bus_open(struct i2c_bus *bus, struct mpsse *mpsse)
+{
+	bus->mpsse = mpsse;
+	bus->active = 0;
+	bus->optimize = 0;
+	mpsse_io_buffer_setup(&bus->io);
+
+	if (i2c_bus_setup(bus) != 0 || i2c_bus_idle(bus) != 0) {
+		i2c_bus_close(bus);
+		return -1;
+	}
+
+	return 0;
+}
+
+void i2c_bus_close(struct i2c_bus *bus)
+{
+	mpsse_io_buffer_release(&bus->io);
+	bus->mpsse = NULL;
+	bus->active = 0;
+}
+
+// The functions below only add the commands to the MPSSE IO buffer, the
+// caller is responsible for submitting them.
+static void i2c_encode_idle(struct mpsse_io_buffer *io)
+{
+	mpsse_set_output(io, 0x40fb, 0xffff, NULL);
+}
+
+// The same pins state is repeated a few times to hold it long enough.
+static void i2c_encode_start(struct mpsse_io_buffer *io)
+{
+	for (int i = 0; i < 5; ++i)
+		mpsse_set_output(io, 0x00fb, 0x00fd, NULL);
+	for (int i = 0; i < 5; ++i)
+		mpsse_set_output(io, 0x40fb, 0x00fc, NULL);
+}
+
+static void i2c_encode_stop(struct mpsse_io_buffer *io)
+{
+	for (int i = 0; i < 5; ++i)
+		mpsse_set_output(io, 0x00fb, 0x00fc, NULL);
+	for (int i = 0; i < 5; ++i)
+		mpsse_set_output(io, 0x00fb, 0x00fd, NULL);
+	for (int i = 0; i < 5; ++i)
+		mpsse_set_output(io, 0x40fb, 0xffff, NULL);
+}
+
+// Sends the byte and reads the ACK bit, the ACK bit takes 1 byte of data. If
+// offset is not NULL it receives the offset of the byte in the commands.
+static void i2c_encode_byte(
+	struct mpsse_io_buffer *io,
+	unsigned char byte,
+	unsigned *offset,
+	struct mpsse_cmd *ack)
+{
+	struct mpsse_cmd cmd;
+
+	mpsse_write_bytes(io, &byte, sizeof(byte), &cmd);
+	if (offset)
+		*offset = cmd.cmd_offset + 3;
+	mpsse_set_output(io, 0x00fb, 0x00fe, NULL);
+	mpsse_read_bits(io, 1, ack);
+}
+
+// Reads size bytes acknowledging all but the last one. If dst is not NULL
+// the bytes go straight to dst, otherwise they are laid out contiguously in
+// the data of the MPSSE IO buffer. Neither asks the device to send the byte
+// immediately, mpsse_submit does it once at the end.
+static void i2c_encode_read(
+	struct mpsse_io_buffer *io, unsigned size, unsigned char *dst)
+{
+	for (unsigned i = 0; i < size; ++i) {
+		if (i != 0) {
+			mpsse_write_bits(io, 0x00, 1, NULL);
+			mpsse_set_output(io, 0x00fb, 0x00fe, NULL);
+		}
+		if (dst)
+			mpsse_shift_bytes_to(
+				io, MPSSE_SHIFT_IN, NULL, dst + i, 1, NULL);
+		else
+			mpsse_shift_bytes(io, MPSSE_SHIFT_IN, NULL, 1, NULL);
+	}
+	mpsse_write_bits(io, 0xff, 1, NULL);
+	mpsse_set_output(io, 0x00fb, 0x00fe, NULL);
+}
+
+static unsigned char i2c_addr_byte(unsigned char i2c_addr, int read)
+{
+	return read ? ((i2c_addr << 1) | 1) : (i2c_addr << 1);
+}
+
+int i2c_bus_idle(struct i2c_bus *bus)
+{
+	i2c_encode_idle(&bus->io);
+	return i2c_bus_submit(bus);
+}
+
+int i2c_bus_start(struct i2c_bus *bus)
+{
+	i2c_encode_start(&bus->io);
+	if (i2c_bus_submit(bus) != 0)
+		return -1;
+
+	bus->active = 1;
+	return 0;
+}
+
+int i2c_bus_stop(struct i2c_bus *bus)
+{
+	i2c_encode_stop(&bus->io);
+	if (i2c_bus_submit(bus) != 0)
+		return -1;
+
+	bus->active = 0;
+	return 0;
+}
+
+int i2c_bus_send_byte(struct i2c_bus *bus, unsigned char byte)
+{
+	struct mpsse_cmd cmd;
+	const unsigned char *ack;
+
+	i2c_encode_byte(&bus->io, byte, NULL, &cmd);
+	if (i2c_bus_execute(bus) != 0) {
+		mpsse_io_buffer_reset(&bus->io);
+		return -1;
+	}
+
+	ack = mpsse_data(&cmd);
+	mpsse_io_buffer_reset(&bus->io);
+	return (*ack & 0x1) != 0x0 ? -1 : 0;
+}
+
+int i2c_bus_send_addr(struct i2c_bus *bus, unsigned char i2c_addr, int read)
+{
+	return i2c_bus_send_byte(bus, i2c_addr_byte(i2c_addr, read));
+}
+
+int i2c_bus_read_bytes(struct i2c_bus *bus, void *data, unsigned size)
+{
+	if (size == 0)
+		return 0;
+
+	i2c_encode_read(&bus->io, size, data);
+	return i2c_bus_submit(bus);
+}
+
+// If offsets is not NULL it receives the offsets of the address byte and of
+// the bytes written in the commands. If direct is not 0 the data read goes
+// straight to the buffer of the segment.
+static void i2c_encode_segment(
+	struct mpsse_io_buffer *io,
+	const struct i2c_segment *seg,
+	int active,
+	int direct,
+	unsigned *offsets)
+{
+	const int read = (seg->flags & I2C_SEGMENT_READ) != 0;
+	const unsigned char *buf = seg->buf;
+
+	// Repeated START: release both lines and then do a regular START.
+	if (active)
+		i2c_encode_idle(io);
+	i2c_encode_start(io);
+	i2c_encode_byte(io, i2c_addr_byte(seg->addr, read), offsets, NULL);
+	if (read && seg->len > 0)
+		i2c_encode_read(io, seg->len, direct ? seg->buf : NULL);
+	for (unsigned i = 0; !read && i < seg->len; ++i)
+		i2c_encode_byte(io, buf ? buf[i] : 0,
+				offsets ? &offsets[i + 1] : NULL, NULL);
+	if (seg->flags & I2C_SEGMENT_STOP)
+		i2c_encode_stop(io);
+}
+
+// Parses the data the segment produced and returns a pointer to the data of
+// the next segment, direct must be the same as for i2c_encode_segment.
+static const unsigned char *i2c_decode_segment(
+	struct i2c_segment *seg, const unsigned char *data, int direct)
+{
+	seg->nack = (*data++ & 0x1) ? 0 : -1;
+	if (seg->flags & I2C_SEGMENT_READ) {
+		if (direct && seg->buf)
+			return data;
+		// Zero length reads (e.g. SMBus quick read) may have no
+		// buffer.
+		if (seg->len)
+			memcpy(seg->buf, data, seg->len);
+		return data + seg->len;
+	}
+
+	for (unsigned i = 0; i < seg->len; ++i, ++data) {
+		if (seg->nack < 0 && (*data & 0x1))
+			seg->nack = i + 1;
+	}
+	return data;
+}
+
+int i2c_bus_transfer(
+	struct i2c_bus *bus, struct i2c_segment *segs, unsigned count)
+{
+	const unsigned char *data;
+	int active = bus->active;
+	int nacks = 0;
+
+	for (unsigned i = 0; i < count; ++i) {
+		i2c_encode_segment(&bus->io, &segs[i], active, 1, NULL);
+		active = (segs[i].flags & I2C_SEGMENT_STOP) == 0;
+	}
+
+	if (i2c_bus_execute(bus) != 0) {
+		mpsse_io_buffer_reset(&bus->io);
+		return -1;
+	}
+
+	// All the commands in the MPSSE IO buffer were added in order, so the
+	// data they produced is in the same order.
+	data = bus->io.data;
+	for (unsigned i = 0; i < count; ++i) {
+		data = i2c_decode_segment(&segs[i], data, 1);
+		if (segs[i].nack >= 0)
+			++nacks;
+	}
+
+	bus->active = active;
+	mpsse_io_buffer_reset(&bus->io);
+	return nacks;
+}
+
+// Number of the command bytes of the segment the template patches.
+static unsigned i2c_template_patches(const struct i2c_segment *seg)
+{
+	return seg->flags & I2C_SEGMENT_READ ? 1 : 1 + seg->len;
+}
+
+int i2c_template_compile(
+	struct i2c_bus *bus,
+	struct i2c_template *tmpl,
+	const struct i2c_segment *segs,
+	unsigned count)
+{
+	unsigned patches = 0;
+	int active = bus->active;
+
+	for (unsigned i = 0; i < count; ++i)
+		patches += i2c_template_patches(&segs[i]);
+
+	mpsse_io_buffer_setup(&tmpl->io);
+	tmpl->segs = malloc(count * sizeof(*tmpl->segs));
+	tmpl->offsets = malloc(patches * sizeof(*tmpl->offsets));
+	tmpl->count = count;
+	tmpl->patches = patches;
+	tmpl->active_before = active;
+	if (!tmpl->segs || !tmpl->offsets)
+		goto err;
+
+	for (unsigned i = 0, patch = 0; i < count; ++i) {
+		tmpl->segs[i] = segs[i];
+		tmpl->segs[i].buf = NULL;
+		tmpl->segs[i].nack = -1;
+		i2c_encode_segment(&tmpl->io, &segs[i], active, 0,
+				   &tmpl->offsets[patch]);
+		patch += i2c_template_patches(&segs[i]);
+		active = (segs[i].flags & I2C_SEGMENT_STOP) == 0;
+	}
+	tmpl->active_after = active;
+
+	if (tmpl->io.error)
+		goto err;
+	// The optimizer keeps all the bytes written, so none of the offsets
+	// becomes UINT_MAX.
+	if (bus->optimize && mpsse_optimize(
+			&tmpl->io, bus->optimize, tmpl->offsets, patches) != 0)
+		goto err;
+	return 0;
+
+err:
+	i2c_template_release(tmpl);
+	return -1;
+}
+
+void i2c_template_release(struct i2c_template *tmpl)
+{
+	mpsse_io_buffer_release(&tmpl->io);
+	free(tmpl->segs);
+	free(tmpl->offsets);
+	tmpl->segs = NULL;
+	tmpl->offsets = NULL;
+	tmpl->count = 0;
+	tmpl->patches = 0;
+}
+
+int i2c_template_run(
+	struct i2c_bus *bus,
+	struct i2c_template *tmpl,
+	struct i2c_segment *segs)
+{
+	unsigned char *cmd = tmpl->io.cmd;
+	const unsigned *offset = tmpl->offsets;
+	const unsigned char *data;
+	int nacks = 0;
+
+	if (bus->active != tmpl->active_before)
+		return -1;
+
+	for (unsigned i = 0; i < tmpl->count; ++i) {
+		const int read = (segs[i].flags & I2C_SEGMENT_READ) != 0;
+		const unsigned char *buf = segs[i].buf;
+
+		if (segs[i].flags != tmpl->segs[i].flags ||
+		    segs[i].len != tmpl->segs[i].len)
+			return -1;
+
+		cmd[*offset++] = i2c_addr_byte(segs[i].addr, read);
+		for (unsigned j = 0; !read && j < segs[i].len; ++j)
+			cmd[*offset++] = buf[j];
+	}
+
+	// The data the commands produce is overwritten on every run, the
+	// commands stay in the MPSSE IO buffer.
+	if (mpsse_submit(bus->mpsse, &tmpl->io) != 0)
+		return -1;
+
+	data = tmpl->io.data;
+	for (unsigned i = 0; i < tmpl->count; ++i) {
+		data = i2c_decode_segment(&segs[i], data, 0);
+		if (segs[i].nack >= 0)
+			++nacks;
+	}
+
+	bus->active = tmpl->active_after;
+	return nacks;
+}
@@ -0,0 +1,122 @@
+// SPDX-License-Identifier: GPL-2.0
+#ifndef __I2C_H__
+#define __I2C_H__
+
+#include "mpsse.h"
+
+// I2C bus on top of an MPSSE device: ADBUS0 is SCL, ADBUS1 is SDA output and
+// ADBUS2 is SDA input, so ADBUS1 and ADBUS2 have to be connected together.
+//
+// I2C bus owns the MPSSE IO buffer it uses to build the commands, the buffer
+// is reused for all the operations on the bus. So once the buffer grew to
+// the size of the largest operation, operations on the bus don't need any
+// heap allocations.
+struct i2c_bus {
+	struct mpsse *mpsse;
+	struct mpsse_io_buffer io;
+	// Non-0 between START and STOP conditions.
+	int active;
+	// MPSSE_OPT_* flags passed to mpsse_optimize before submitting the
+	// commands, 0 by default. Pin writes are repeated to hold the START
+	// and STOP conditions long enough, so MPSSE_OPT_PINS is only safe if
+	// the targets on the bus tolerate the shorter hold times.
+	unsigned optimize;
+};
+
+// Configures the MPSSE device for I2C and puts the bus in the idle state.
+// Returns 0 on success and a non-0 value otherwise.
+int i2c_bus_open(struct i2c_bus *bus, struct mpsse *mpsse);
+void i2c_bus_close(struct i2c_bus *bus);
+
+// All the functions below return 0 on success and a non-0 value otherwise.
+// Similarly to mpsse_submit if any of them fails you should not expect the
+// bus to be in any particular state.
+int i2c_bus_idle(struct i2c_bus *bus);
+int i2c_bus_start(struct i2c_bus *bus);
+int i2c_bus_stop(struct i2c_bus *bus);
+
+// Sends one byte and checks that the target acknowledged it.
+int i2c_bus_send_byte(struct i2c_bus *bus, unsigned char byte);
+int i2c_bus_send_addr(struct i2c_bus *bus, unsigned char i2c_addr, int read);
+
+// Reads size bytes acknowledging all of them, but the last one.
+int i2c_bus_read_bytes(struct i2c_bus *bus, void *data, unsigned size);
+
+
+// I2C segment flags:
+//   * I2C_SEGMENT_READ - the segment reads data from the target, otherwise
+//     the segment writes data to the target;
+//   * I2C_SEGMENT_STOP - the segment ends with a STOP condition, otherwise
+//     the next segment starts with a repeated START condition.
+#define I2C_SEGMENT_READ 0x1u
+#define I2C_SEGMENT_STOP 0x2u
+
+// I2C segment describes one part of an I2C transaction: START or repeated
+// START condition, the target address, the data and optionally a STOP
+// condition.
+struct i2c_segment {
+	unsigned char addr;
+	unsigned flags;
+	// Data to write or the buffer for the data read, a read segment with
+	// len > 0 must have a buffer, buf may be NULL if len is 0.
+	void *buf;
+	unsigned len;
+	// Filled by i2c_bus_transfer: position of the first byte in the
+	// segment that the target didn't acknowledge (0 for the address byte
+	// and i + 1 for the i-th data byte) or -1 if all the bytes were
+	// acknowledged. For read segments only the address is acknowledged by
+	// the target.
+	int nack;
+};
+
+// Executes all the segments with a single mpsse_submit call. Since all the
+// commands are sent to the device at once the transfer doesn't stop on NACK,
+// the NACKs are reported after the fact in the nack field of the segments.
+//
+// Returns a negative value if the submission failed, otherwise returns the
+// number of segments that had a NACK, so 0 means complete success.
+int i2c_bus_transfer(
+	struct i2c_bus *bus, struct i2c_segment *segs, unsigned count);
+
+
+// I2C transaction template is an I2C transfer compiled into the MPSSE
+// commands once, so transactions of the same shape (the same number of
+// segments with the same flags and lengths) can be repeated without encoding
+// the commands again. Before every run only the target addresses and the
+// data written are patched into the commands.
+//
+// The template owns its MPSSE IO buffer, so it must not be copied.
+struct i2c_template {
+	struct mpsse_io_buffer io;
+	// Shape of the transfer the template was compiled for.
+	struct i2c_segment *segs;
+	unsigned count;
+	// Offsets of the address byte of every segment, each followed by the
+	// offsets of the data bytes if the segment writes.
+	unsigned *offsets;
+	unsigned patches;
+	// Bus state (the active field) before and after the transfer.
+	int active_before;
+	int active_after;
+};
+
+// Compiles the segments into a template, the data written by the segments
+// doesn't matter and buf may be NULL. The template uses the current state of
+// the bus and the optimizations enabled on the bus. Returns 0 on success and a
+// non-0 value otherwise.
+int i2c_template_compile(
+	struct i2c_bus *bus,
+	struct i2c_template *tmpl,
+	const struct i2c_segment *segs,
+	unsigned count);
+void i2c_template_release(struct i2c_template *tmpl);
+
+// Runs the template with the addresses and the data of the segments, which
+// must have the same shape as the segments the template was compiled for and
+// the bus must be in the same state. Otherwise behaves like i2c_bus_transfer.
+int i2c_template_run(
+	struct i2c_bus *bus,
+	struct i2c_template *tmpl,
+	struct i2c_segment *segs);
+
+#endif  // __I2C_H__
@@ -1,149 +1,196 @@
 // SPDX-License-Identifier: GPL-2.0
 #include <assert.h>
+#include <errno.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "ftdi.h"
+#include "i2c.h"
 #include "mpsse.h"
+#include "ring.h"
+#include "sim.h"
 
+#ifdef TRANSPORT_D2XX
 static const unsigned device_vid = 0x0005;
 static const unsigned device_pid = 0x0001;
+#endif
 
-static int i2c_setup(struct mpsse *mpsse)
+#define DEFAULT_RING_SLOTS 4096u
+
+static volatile sig_atomic_t stop;
+
+static void hexdump(FILE *output, const void *data, unsigned size)
 {
-	struct mpsse_io_buffer io;
-	int ret;
+	const unsigned char *b = data;
 
-	mpsse_io_buffer_setup(&io);
-	mpsse_disable_freq_div5(&io, NULL);
-	mpsse_disable_adaptive_clocking(&io, NULL);
-	mpsse_enable_3phase_clocking(&io, NULL);
-	mpsse_set_drive0_pins(&io, 0x7, NULL);
-	mpsse_disable_loopback(&io, NULL);
-	mpsse_set_freq_divisor(&io, 0xffff, NULL);
-	ret = mpsse_submit(mpsse, &io);
-	mpsse_io_buffer_release(&io);
-	return ret;
+	for (unsigned i = 0; i < size; ++i)
+		fprintf(output, "0x%02x ", b[i]);
 }
 
-static int i2c_idle(struct mpsse *mpsse)
+static void usage(const char *name)
 {
-	struct mpsse_io_buffer io;
-	int ret;
+	fprintf(stdout,
+		"%s -s serial -a i2c_addr -r i2c_reg -l size [-O] "
+		"[-c ring [-f hz] [-n count] [-S slots]] [-h]\n\n"
+		"\t-h           print the usage information.\n"
+		"\t-s serial    specify the FTDI serial number of the device "
+		"               used as I2C bridge, optionally prefixed "
+		"               with the transport, e.g. d2xx:serial or "
+		"               usb:serial[@vid:pid], the usb transport "
+		"               looks for 0x0005:0x0001 and then for "
+		"               0x0403:0x6014 by default.\n"
+		"\t-a i2c_addr  I2C address of the device to talk to.\n"
+		"\t-r i2c_ref   register of the I2C device to read.\n"
+		"\t-l size      amount of data to be read, it's possible "
+		"               that the device will return less than that "
+		"               in which case a warning message would be "
+		"               printed to indicate that.\n"
+		"\t-O           optimize the MPSSE commands before sending "
+		"               them to the device.\n"
+		"\t-c ring      read the registers continuously and write "
+		"               the samples to the ring in the file, "
+		"               e.g. /dev/shm/nunchuk, until interrupted, "
+		"               ring_dump prints the samples.\n"
+		"\t-f hz        sampling rate, as fast as possible by "
+		"               default.\n"
+		"\t-n count     stop after the given number of samples.\n"
+		"\t-S slots     number of samples the ring holds, a power "
+		"               of 2, 4096 by default.\n",
+		name);
+}
 
-	mpsse_io_buffer_setup(&io);
-	mpsse_set_output(&io, 0x40fb, 0xffff, NULL);
-	ret = mpsse_submit(mpsse, &io);
-	mpsse_io_buffer_release(&io);
-	return ret;
+static void on_signal(int sig)
+{
+	(void) sig;
+	stop = 1;
 }
 
-static int i2c_start(struct mpsse *mpsse)
+static uint64_t now_ns(void)
 {
-	struct mpsse_io_buffer io;
-	int ret;
+	struct timespec ts;
 
-	mpsse_io_buffer_setup(&io);
-	for (int i = 0; i < 5; ++i)
-		mpsse_set_output(&io, 0x00fb, 0x00fd, NULL);
-	for (int i = 0; i < 5; ++i)
-		mpsse_set_output(&io, 0x40fb, 0x00fc, NULL);
-	ret = mpsse_submit(mpsse, &io);
-	mpsse_io_buffer_release(&io);
-	return ret;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
 }
 
-static int i2c_stop(struct mpsse *mpsse)
+static void sleep_until(uint64_t deadline)
 {
-	struct mpsse_io_buffer io;
-	int ret;
+	struct timespec ts;
 
-	mpsse_io_buffer_setup(&io);
-	for (int i = 0; i < 5; ++i)
-		mpsse_set_output(&io, 0x00fb, 0x00fc, NULL);
-	for (int i = 0; i < 5; ++i)
-		mpsse_set_output(&io, 0x00fb, 0x00fd, NULL);
-	for (int i = 0; i < 5; ++i)
-		mpsse_set_output(&io, 0x40fb, 0xffff, NULL);
-	ret = mpsse_submit(mpsse, &io);
-	mpsse_io_buffer_release(&io);
-	return ret;
+	ts.tv_sec = deadline / 1000000000u;
+	ts.tv_nsec = deadline % 1000000000u;
+	while (!stop && clock_nanosleep(
+			CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
 }
 
-static int i2c_send_byte(struct mpsse *mpsse, unsigned char byte)
+// Samples the registers with the compiled read until stopped. Sample k is
+// due at start + k * period, a sample that can't start before the next one is
+// due is skipped and counted as missed instead of being taken late, so a
+// stall doesn't cause a burst of samples afterwards.
+static int sample(
+	struct i2c_bus *bus,
+	struct i2c_template *tmpl,
+	struct i2c_segment *segs,
+	struct ring *ring,
+	uint64_t period_ns,
+	unsigned long count)
 {
-	struct mpsse_io_buffer io;
-	struct mpsse_cmd cmd;
-	int ret;
-
-	mpsse_io_buffer_setup(&io);
-	mpsse_write_bytes(&io, &byte, sizeof(byte), NULL);
-	mpsse_set_output(&io, 0x00fb, 0x00fe, NULL);
-	mpsse_read_bits(&io, 1, &cmd);
-	ret = mpsse_submit(mpsse, &io);
-	if (ret == 0) {
-		const unsigned char *data = mpsse_data(&cmd);
+	const uint64_t first = now_ns();
+	uint64_t deadline = first;
+	unsigned long samples = 0;
+	uint64_t missed = 0;
+	uint64_t errors = 0;
+	double seconds;
+
+	while (!stop && (count == 0 || samples < count)) {
+		uint64_t start;
+		int ret;
+
+		if (period_ns) {
+			const uint64_t t = now_ns();
+
+			if (t < deadline) {
+				sleep_until(deadline);
+				if (stop)
+					break;
+			} else if (t - deadline >= period_ns) {
+				const uint64_t skip =
+					(t - deadline) / period_ns;
+
+				ring_add_missed(ring, skip);
+				missed += skip;
+				deadline += skip * period_ns;
+			}
+			deadline += period_ns;
+		}
 
-		if ((*data & 0x1) != 0x0)
-			ret = -1;
+		start = now_ns();
+		ret = i2c_template_run(bus, tmpl, segs);
+		if (ret < 0) {
+			fprintf(stderr, "Failed to read the registers\n");
+			return -1;
+		}
+		if (ret > 0) {
+			ring_add_error(ring);
+			++errors;
+		}
+		ring_push(ring, start, now_ns() - start,
+			  ret ? RING_RECORD_NACK : 0, segs[1].buf, segs[1].len);
+		++samples;
 	}
-	mpsse_io_buffer_release(&io);
-	return ret;
-}
 
-static int i2c_send_addr(struct mpsse *mpsse, unsigned char i2c_addr, int read)
-{
-	const unsigned char byte =
-		read ? ((i2c_addr << 1) | 1) : (i2c_addr << 1);
-	return i2c_send_byte(mpsse, byte);
+	seconds = (now_ns() - first) / 1e9;
+	fprintf(stdout,
+		"%lu samples in %.3f s, %.1f samples/s, %llu missed, "
+		"%llu errors\n",
+		samples, seconds, seconds > 0 ? samples / seconds : 0.0,
+		(unsigned long long)missed, (unsigned long long)errors);
+	return 0;
 }
 
-static int i2c_read_bytes(struct mpsse *mpsse, void *data, unsigned size)
+static int run_continuous(
+	struct i2c_bus *bus,
+	struct i2c_segment *segs,
+	const char *path,
+	unsigned slots,
+	unsigned hz,
+	unsigned long count)
 {
-	struct mpsse_io_buffer io;
-	struct mpsse_cmd cmd;
+	const uint64_t period_ns = hz ? 1000000000u / hz : 0;
+	struct i2c_template tmpl;
+	struct sigaction sa;
+	struct ring ring;
 	int ret;
 
-	mpsse_io_buffer_setup(&io);
-	mpsse_read_bytes(&io, 1, &cmd);
-	for (unsigned i = 1; i < size; ++i) {
-		mpsse_write_bits(&io, 0x00, 1, NULL);
-		mpsse_set_output(&io, 0x00fb, 0x00fe, NULL);
-		mpsse_read_bytes(&io, 1, NULL);
+	if (ring_create(&ring, path, slots, segs[1].len, period_ns) != 0) {
+		fprintf(stderr, "Failed to create the ring in %s\n", path);
+		return -1;
 	}
-	mpsse_write_bits(&io, 0xff, 1, NULL);
-	mpsse_set_output(&io, 0x00fb, 0x00fe, NULL);
-	ret = mpsse_submit(mpsse, &io);
-	if (ret == 0)
-		memcpy(data, mpsse_data(&cmd), size);
-	mpsse_io_buffer_release(&io);
-	return ret;
-}
 
-static void hexdump(FILE *output, const void *data, unsigned size)
-{
-	const unsigned char *b = data;
+	// The read is encoded once, every sample only resubmits it.
+	if (i2c_template_compile(bus, &tmpl, segs, 2) != 0) {
+		fprintf(stderr, "Failed to compile the read\n");
+		ring_close(&ring);
+		return -1;
+	}
 
-	for (unsigned i = 0; i < size; ++i)
-		fprintf(output, "0x%02x ", b[i]);
-}
+	// No SA_RESTART, so the signals interrupt the sleep.
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
 
-static void usage(const char *name)
-{
-	fprintf(stdout,
-		"%s -s serial -a i2c_addr -r i2c_reg -l size [-h]\n\n"
-		"\t-h           print the usage information.\n"
-		"\t-s serial    specify the FTDI serial number of the device "
-		"               used as I2C bridge.\n"
-		"\t-a i2c_addr  I2C address of the device to talk to.\n"
-		"\t-r i2c_ref   register of the I2C device to read.\n"
-		"\t-l size      amount of data to be read, it's possible "
-		"               that the device will return less than that "
-		"               in which case a warning message would be "
-		"               printed to indicate that.\n",
-		name);
+	ret = sample(bus, &tmpl, segs, &ring, period_ns, count);
+
+	i2c_template_release(&tmpl);
+	ring_close(&ring);
+	return ret;
 }
 
 int main(int argc, char **argv)
@@ -152,17 +199,28 @@ int main(int argc, char **argv)
 	const char *address = NULL;
 	const char *reg = NULL;
 	const char *len = NULL;
+	const char *ring = NULL;
+	unsigned slots = DEFAULT_RING_SLOTS;
+	unsigned long count = 0;
+	unsigned hz = 0;
 	char *endptr;
 	void *data;
 
+	unsigned char handshake1[] = {0xf0, 0x55};
+	unsigned char handshake2[] = {0xfb, 0x00};
+	struct i2c_segment handshake[2];
+	struct i2c_segment read[2];
+
 	struct mpsse mpsse;
-	struct serial s;
+	struct i2c_bus bus;
 	unsigned i2c_addr;
-	unsigned i2c_reg;
+	unsigned char i2c_reg;
 	unsigned read_size;
+	int optimize = 0;
+	int ret = 0;
 	int opt;
 
-	while ((opt = getopt(argc, argv, "s:a:r:l:h")) != -1) {
+	while ((opt = getopt(argc, argv, "s:a:r:l:Oc:f:n:S:h")) != -1) {
 		switch (opt) {
 		case 'h':
 			usage(argv[0]);
@@ -199,6 +257,40 @@ int main(int argc, char **argv)
 			}
 			len = optarg;
 			break;
+		case 'O':
+			optimize = 1;
+			break;
+		case 'c':
+			ring = optarg;
+			break;
+		case 'f':
+			hz = strtoul(optarg, &endptr, 0);
+			if (*endptr != '\0') {
+				fprintf(stderr,
+					"Failed to parse frequency %s\n",
+					optarg);
+				return 1;
+			}
+			break;
+		case 'n':
+			count = strtoul(optarg, &endptr, 0);
+			if (*endptr != '\0') {
+				fprintf(stderr,
+					"Failed to parse sample count %s\n",
+					optarg);
+				return 1;
+			}
+			break;
+		case 'S':
+			slots = strtoul(optarg, &endptr, 0);
+			if (*endptr != '\0' || slots == 0 ||
+			    (slots & (slots - 1)) != 0) {
+				fprintf(stderr,
+					"Expect a power of 2 slots, got %s\n",
+					optarg);
+				return 1;
+			}
+			break;
 		default:
 			usage(argv[0]);
 			return 1;
@@ -209,11 +301,6 @@ int main(int argc, char **argv)
 		fprintf(stderr, "Expect exactly one -s argument\n");
 		return 1;
 	}
-	if (strlen(serial) > sizeof(s.serial) - 1) {
-		fprintf(stderr, "Serial number %s is too long\n", serial);
-		return -1;
-	}
-	strncpy(s.serial, serial, sizeof(s.serial));
 
 	if (!address) {
 		fprintf(stderr, "Expect exactly one -a argument\n");
@@ -247,6 +334,7 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
+#ifdef TRANSPORT_D2XX
 	if (ftdi_register_device_id(device_vid, device_pid) != 0) {
 		fprintf(stderr,
 			"Failed to register VID:PID 0x%04x:0x%04x\n",
@@ -254,8 +342,9 @@ int main(int argc, char **argv)
 			device_pid);
 		return 1;
 	}
+#endif
 
-	if (mpsse_open(&s, &mpsse) != 0) {
+	if (mpsse_open_spec(serial, &mpsse) != 0) {
 		fprintf(stderr, "Failed to enable MPSSE on %s\n", serial);
 		return 1;
 	}
@@ -268,39 +357,54 @@ int main(int argc, char **argv)
 
 	assert((data = malloc(read_size)) != NULL);
 
-	assert(i2c_setup(&mpsse) == 0);
-	assert(i2c_idle(&mpsse) == 0);
-
-	assert(i2c_start(&mpsse) == 0);
-	assert(i2c_send_addr(&mpsse, i2c_addr, 0) == 0);
-	assert(i2c_send_byte(&mpsse, 0xf0) == 0);
-	assert(i2c_send_byte(&mpsse, 0x55) == 0);
-	assert(i2c_stop(&mpsse) == 0);
-
-	assert(i2c_start(&mpsse) == 0);
-	assert(i2c_send_addr(&mpsse, i2c_addr, 0) == 0);
-	assert(i2c_send_byte(&mpsse, 0xfb) == 0);
-	assert(i2c_send_byte(&mpsse, 0x00) == 0);
-	assert(i2c_stop(&mpsse) == 0);
-
-	assert(i2c_start(&mpsse) == 0);
-	assert(i2c_send_addr(&mpsse, i2c_addr, 0) == 0);
-	assert(i2c_send_byte(&mpsse, i2c_reg) == 0);
-	assert(i2c_idle(&mpsse) == 0);
-	assert(i2c_start(&mpsse) == 0);
-	assert(i2c_send_addr(&mpsse, i2c_addr, 1) == 0);
-	assert(i2c_read_bytes(&mpsse, data, read_size) == 0);
-	assert(i2c_stop(&mpsse) == 0);
-
-	fprintf(stdout, "Read data:\n");
-	hexdump(stdout, data, read_size);
-	fprintf(stdout, "\n");
+	// Nunchuk handshake, see https://bootlin.com/labs/doc/nunchuk.pdf.
+	handshake[0].addr = i2c_addr;
+	handshake[0].flags = I2C_SEGMENT_STOP;
+	handshake[0].buf = handshake1;
+	handshake[0].len = sizeof(handshake1);
+	handshake[1].addr = i2c_addr;
+	handshake[1].flags = I2C_SEGMENT_STOP;
+	handshake[1].buf = handshake2;
+	handshake[1].len = sizeof(handshake2);
+
+	assert(i2c_bus_open(&bus, &mpsse) == 0);
+	if (optimize)
+		bus.optimize = MPSSE_OPT_ALL;
+
+	assert(i2c_bus_transfer(&bus, handshake, 2) == 0);
+
+	read[0].addr = i2c_addr;
+	read[0].flags = 0;
+	read[0].buf = &i2c_reg;
+	read[0].len = 1;
+	read[1].addr = i2c_addr;
+	read[1].flags = I2C_SEGMENT_READ | I2C_SEGMENT_STOP;
+	read[1].buf = data;
+	read[1].len = read_size;
+	if (ring) {
+		ret = run_continuous(&bus, read, ring, slots, hz, count);
+	} else if (i2c_bus_transfer(&bus, read, 2) != 0) {
+		fprintf(stderr, "Failed to read register 0x%02x of 0x%02x\n",
+			i2c_reg, i2c_addr);
+		free(data);
+		i2c_bus_close(&bus);
+		mpsse_close(&mpsse);
+		return 1;
+	} else {
+		fprintf(stdout, "Read data:\n");
+		hexdump(stdout, data, read_size);
+		fprintf(stdout, "\n");
+	}
+
+	if (sim_is_sim(mpsse.transport))
+		sim_print_stats(mpsse.transport, stdout);
 
 	free(data);
+	i2c_bus_close(&bus);
 	if (mpsse_close(&mpsse) != 0) {
 		fprintf(stderr, "Failed to close %s\n", serial);
 		return 1;
 	}
 
-	return 0;
+	return ret == 0 ? 0 : 1;
 }
@@ -0,0 +1,270 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ftdi.h"
+#include "i2c.h"
+#include "mpsse.h"
+#include "sim.h"
+
+#ifdef TRANSPORT_D2XX
+static const unsigned device_vid = 0x0005;
+static const unsigned device_pid = 0x0001;
+#endif
+
+// Addresses below 0x08 and above 0x77 are reserved.
+#define SCAN_FIRST 0x08u
+#define SCAN_LAST 0x77u
+#define SCAN_COUNT (SCAN_LAST - SCAN_FIRST + 1)
+
+// TCA9548A style mux: the byte written selects the channels, one bit per
+// channel.
+#define MUX_CHANNELS 8u
+
+#define MAX_BUSES 16
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stdout,
+		"%s -s serial [-s serial ...] [-m mux_addr] [-h]\n\n"
+		"\t-h           print the usage information.\n"
+		"\t-s serial    specify the FTDI serial number of the device "
+		"               used as I2C bridge, optionally prefixed "
+		"               with the transport, e.g. d2xx:serial or "
+		"               usb:serial[@vid:pid], the usb transport "
+		"               looks for 0x0005:0x0001 and then for "
+		"               0x0403:0x6014 by default. May be repeated "
+		"               to scan several buses.\n"
+		"\t-m mux_addr  scan all 8 channels of the I2C mux at the "
+		"               address.\n",
+		name);
+}
+
+// Like i2cdetect, addresses where EEPROMs and write-protect registers
+// usually live are probed with a read, because a write, even without data,
+// may change the state of some of them.
+static int probe_with_read(unsigned addr)
+{
+	return (addr >= 0x30 && addr <= 0x37) || (addr >= 0x50 && addr <= 0x5f);
+}
+
+// Adds the probes of all the addresses to the segments, every probe is a
+// complete transaction with its own STOP. Returns the number of segments.
+static unsigned scan_segments(struct i2c_segment *segs, unsigned char *byte)
+{
+	for (unsigned i = 0; i < SCAN_COUNT; ++i) {
+		const unsigned addr = SCAN_FIRST + i;
+
+		segs[i].addr = addr;
+		segs[i].flags = I2C_SEGMENT_STOP;
+		segs[i].buf = byte;
+		segs[i].len = 0;
+		if (probe_with_read(addr)) {
+			segs[i].flags |= I2C_SEGMENT_READ;
+			segs[i].len = 1;
+		}
+	}
+	return SCAN_COUNT;
+}
+
+static void mux_segment(
+	struct i2c_segment *seg, unsigned mux, unsigned char *channels)
+{
+	seg->addr = mux;
+	seg->flags = I2C_SEGMENT_STOP;
+	seg->buf = channels;
+	seg->len = 1;
+}
+
+// Prints the i2cdetect style map of the probes.
+static void print_map(const struct i2c_segment *segs)
+{
+	fprintf(stdout,
+		"     0  1  2  3  4  5  6  7  8  9  a  b  c  d  e  f");
+	for (unsigned addr = 0; addr <= SCAN_LAST; ++addr) {
+		if (addr % 16 == 0)
+			fprintf(stdout, "\n%02x:", addr);
+
+		if (addr < SCAN_FIRST)
+			fprintf(stdout, "   ");
+		else if (segs[addr - SCAN_FIRST].nack < 0)
+			fprintf(stdout, " %02x", addr);
+		else
+			fprintf(stdout, " --");
+	}
+	fprintf(stdout, "\n");
+}
+
+// Scans the whole bus, or every channel of the mux if mux is not 0, with a
+// single transfer.
+static int scan(struct i2c_bus *bus, unsigned mux)
+{
+	const unsigned channels = mux ? MUX_CHANNELS : 1;
+	const unsigned per_channel = SCAN_COUNT + (mux ? 1 : 0);
+	unsigned char select[MUX_CHANNELS];
+	unsigned char deselect = 0;
+	unsigned char byte;
+	struct i2c_segment *segs;
+	unsigned count = 0;
+	double start;
+	int ret;
+
+	// Every channel takes a mux select and the probes, the mux is
+	// deselected at the end.
+	segs = calloc(channels * per_channel + 1, sizeof(*segs));
+	if (!segs)
+		return -1;
+
+	for (unsigned ch = 0; ch < channels; ++ch) {
+		if (mux) {
+			select[ch] = 1u << ch;
+			mux_segment(&segs[count++], mux, &select[ch]);
+		}
+		count += scan_segments(&segs[count], &byte);
+	}
+	if (mux)
+		mux_segment(&segs[count++], mux, &deselect);
+
+	start = now();
+	ret = i2c_bus_transfer(bus, segs, count);
+	if (ret < 0) {
+		fprintf(stderr, "Failed to scan the bus\n");
+		free(segs);
+		return -1;
+	}
+	fprintf(stdout, "Scanned %u addresses in %.3f ms\n",
+		channels * SCAN_COUNT, (now() - start) * 1e3);
+
+	for (unsigned ch = 0; ch < channels; ++ch) {
+		const struct i2c_segment *probes = &segs[ch * per_channel];
+
+		if (mux) {
+			fprintf(stdout, "\nChannel %u of the mux at 0x%02x",
+				ch, mux);
+			if (probes[0].nack >= 0)
+				fprintf(stdout, " didn't respond");
+			fprintf(stdout, ":\n");
+			++probes;
+		}
+		print_map(probes);
+	}
+
+	free(segs);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	const char *serials[MAX_BUSES];
+	unsigned buses = 0;
+	unsigned mux = 0;
+	char *endptr;
+	int ret = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:m:h")) != -1) {
+		switch (opt) {
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		case 's':
+			if (buses == MAX_BUSES) {
+				fprintf(stderr, "Expect at most %u buses\n",
+					MAX_BUSES);
+				return 1;
+			}
+			serials[buses++] = optarg;
+			break;
+		case 'm':
+			mux = strtoul(optarg, &endptr, 0);
+			if (*endptr != '\0' || mux < SCAN_FIRST ||
+			    mux > SCAN_LAST) {
+				fprintf(stderr,
+					"Failed to parse mux address %s\n",
+					optarg);
+				return 1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (buses == 0) {
+		fprintf(stderr, "Expect at least one -s argument\n");
+		return 1;
+	}
+
+#ifdef TRANSPORT_D2XX
+	if (ftdi_register_device_id(device_vid, device_pid) != 0) {
+		fprintf(stderr,
+			"Failed to register VID:PID 0x%04x:0x%04x\n",
+			device_vid,
+			device_pid);
+		return 1;
+	}
+#endif
+
+	for (unsigned i = 0; i < buses; ++i) {
+		const char *serial = serials[i];
+		struct mpsse mpsse;
+		struct i2c_bus bus;
+
+		if (i != 0)
+			fprintf(stdout, "\n");
+		fprintf(stdout, "Bus %s\n", serial);
+
+		if (mpsse_open_spec(serial, &mpsse) != 0) {
+			fprintf(stderr, "Failed to enable MPSSE on %s\n",
+				serial);
+			ret = -1;
+			continue;
+		}
+
+		if (mpsse_verify(&mpsse) != 0) {
+			fprintf(stderr, "Failed to verify MPSSE mode on %s\n",
+				serial);
+			mpsse_close(&mpsse);
+			ret = -1;
+			continue;
+		}
+
+		if (i2c_bus_open(&bus, &mpsse) != 0) {
+			fprintf(stderr, "Failed to configure I2C on %s\n",
+				serial);
+			mpsse_close(&mpsse);
+			ret = -1;
+			continue;
+		}
+
+		// Leave the setup out of the statistics, they should only
+		// show what the scan itself cost.
+		if (sim_is_sim(mpsse.transport))
+			sim_reset_stats(mpsse.transport);
+
+		if (scan(&bus, mux) != 0)
+			ret = -1;
+
+		if (sim_is_sim(mpsse.transport))
+			sim_print_stats(mpsse.transport, stdout);
+
+		i2c_bus_close(&bus);
+		if (mpsse_close(&mpsse) != 0) {
+			fprintf(stderr, "Failed to close %s\n", serial);
+			ret = -1;
+		}
+	}
+
+	return ret == 0 ? 0 : 1;
+}
@@ -0,0 +1,359 @@
+// SPDX-License-Identifier: GPL-2.0
+#include "jtag.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+// TDI and TMS change on the falling edge of TCK and TDO is sampled on the
+// rising edge, TMS commands are always LSB first.
+#define JTAG_SHIFT (MPSSE_SHIFT_OUT_NEG | MPSSE_SHIFT_LSB_FIRST)
+#define JTAG_TMS MPSSE_SHIFT_OUT_NEG
+
+// TCK, TDI and TMS are outputs, TCK idles low and TMS high.
+#define JTAG_PINMASK 0x000b
+#define JTAG_PINVALS 0x0008
+
+struct jtag_read {
+	unsigned char *dst;
+	// Position of the first bit in the destination buffer.
+	unsigned dst_bit;
+	// Position of the data in the MPSSE IO buffer data, bits are taken
+	// from the data starting from the bit shift of the first byte.
+	unsigned data_offset;
+	unsigned shift;
+	unsigned bits;
+};
+
+// Next state for TMS 0 and TMS 1.
+static const unsigned char jtag_next[JTAG_STATES][2] = {
+	[JTAG_RESET] = { JTAG_IDLE, JTAG_RESET },
+	[JTAG_IDLE] = { JTAG_IDLE, JTAG_DRSELECT },
+	[JTAG_DRSELECT] = { JTAG_DRCAPTURE, JTAG_IRSELECT },
+	[JTAG_DRCAPTURE] = { JTAG_DRSHIFT, JTAG_DREXIT1 },
+	[JTAG_DRSHIFT] = { JTAG_DRSHIFT, JTAG_DREXIT1 },
+	[JTAG_DREXIT1] = { JTAG_DRPAUSE, JTAG_DRUPDATE },
+	[JTAG_DRPAUSE] = { JTAG_DRPAUSE, JTAG_DREXIT2 },
+	[JTAG_DREXIT2] = { JTAG_DRSHIFT, JTAG_DRUPDATE },
+	[JTAG_DRUPDATE] = { JTAG_IDLE, JTAG_DRSELECT },
+	[JTAG_IRSELECT] = { JTAG_IRCAPTURE, JTAG_RESET },
+	[JTAG_IRCAPTURE] = { JTAG_IRSHIFT, JTAG_IREXIT1 },
+	[JTAG_IRSHIFT] = { JTAG_IRSHIFT, JTAG_IREXIT1 },
+	[JTAG_IREXIT1] = { JTAG_IRPAUSE, JTAG_IRUPDATE },
+	[JTAG_IRPAUSE] = { JTAG_IRPAUSE, JTAG_IREXIT2 },
+	[JTAG_IREXIT2] = { JTAG_IRSHIFT, JTAG_IRUPDATE },
+	[JTAG_IRUPDATE] = { JTAG_IDLE, JTAG_DRSELECT },
+};
+
+static const char *const jtag_names[JTAG_STATES] = {
+	[JTAG_RESET] = "RESET",
+	[JTAG_IDLE] = "IDLE",
+	[JTAG_DRSELECT] = "DRSELECT",
+	[JTAG_DRCAPTURE] = "DRCAPTURE",
+	[JTAG_DRSHIFT] = "DRSHIFT",
+	[JTAG_DREXIT1] = "DREXIT1",
+	[JTAG_DRPAUSE] = "DRPAUSE",
+	[JTAG_DREXIT2] = "DREXIT2",
+	[JTAG_DRUPDATE] = "DRUPDATE",
+	[JTAG_IRSELECT] = "IRSELECT",
+	[JTAG_IRCAPTURE] = "IRCAPTURE",
+	[JTAG_IRSHIFT] = "IRSHIFT",
+	[JTAG_IREXIT1] = "IREXIT1",
+	[JTAG_IRPAUSE] = "IRPAUSE",
+	[JTAG_IREXIT2] = "IREXIT2",
+	[JTAG_IRUPDATE] = "IRUPDATE",
+};
+
+const char *jtag_state_name(enum jtag_state state)
+{
+	return state < JTAG_STATES ? jtag_names[state] : "UNKNOWN";
+}
+
+// Finds the shortest TMS sequence from one state to another with a breadth
+// first search, the sequence is returned LSB first. All the states are
+// reachable from each other in at most 8 steps.
+static unsigned jtag_path(
+	enum jtag_state from, enum jtag_state to, unsigned *tms)
+{
+	unsigned char prev[JTAG_STATES];
+	unsigned char bit[JTAG_STATES];
+	unsigned char queue[JTAG_STATES];
+	unsigned head = 0, tail = 0;
+	unsigned len = 0;
+	int seen = 1 << from;
+
+	queue[tail++] = from;
+	while (head < tail && !(seen & (1 << to))) {
+		const unsigned state = queue[head++];
+
+		for (unsigned b = 0; b < 2; ++b) {
+			const unsigned next = jtag_next[state][b];
+
+			if (seen & (1 << next))
+				continue;
+			seen |= 1 << next;
+			prev[next] = state;
+			bit[next] = b;
+			queue[tail++] = next;
+		}
+	}
+
+	*tms = 0;
+	for (unsigned state = to; state != from; state = prev[state]) {
+		*tms = (*tms << 1) | bit[state];
+		++len;
+	}
+	return len;
+}
+
+static void jtag_add_read(
+	struct jtag *jtag,
+	void *dst,
+	unsigned dst_bit,
+	const struct mpsse_cmd *cmd,
+	unsigned shift,
+	unsigned bits)
+{
+	struct jtag_read *read;
+
+	if (jtag->nreads == jtag->capacity) {
+		const unsigned capacity = jtag->capacity ?
+			jtag->capacity * 2 : 16;
+		struct jtag_read *reads = realloc(
+			jtag->reads, capacity * sizeof(*reads));
+
+		if (!reads) {
+			jtag->error = 1;
+			return;
+		}
+		jtag->reads = reads;
+		jtag->capacity = capacity;
+	}
+
+	read = &jtag->reads[jtag->nreads++];
+	read->dst = dst;
+	read->dst_bit = dst_bit;
+	read->data_offset = cmd->data_offset;
+	read->shift = shift;
+	read->bits = bits;
+}
+
+// Clocks the TMS sequence out, a TMS command takes at most 7 bits.
+static void jtag_tms(struct jtag *jtag, unsigned tms, unsigned len, int tdi)
+{
+	while (len != 0) {
+		const unsigned n = len > 7 ? 7 : len;
+
+		mpsse_shift_tms(&jtag->io, JTAG_TMS, tms, n, tdi, NULL);
+		tms >>= n;
+		len -= n;
+	}
+}
+
+void jtag_reset(struct jtag *jtag)
+{
+	// Five TMS 1 bring the TAP to Test-Logic-Reset from any state.
+	jtag_tms(jtag, 0x1f, 5, 0);
+	jtag->state = JTAG_RESET;
+}
+
+void jtag_goto(struct jtag *jtag, enum jtag_state state)
+{
+	unsigned tms;
+	unsigned len;
+
+	if (jtag->state == state)
+		return;
+
+	len = jtag_path(jtag->state, state, &tms);
+	jtag_tms(jtag, tms, len, 0);
+	jtag->state = state;
+}
+
+void jtag_clock(struct jtag *jtag, unsigned cycles)
+{
+	mpsse_clock(&jtag->io, cycles, NULL);
+}
+
+static void jtag_shift(
+	struct jtag *jtag,
+	enum jtag_state shift,
+	const void *tdi,
+	void *tdo,
+	unsigned bits,
+	enum jtag_state end)
+{
+	const unsigned mode = JTAG_SHIFT | MPSSE_SHIFT_OUT |
+		(tdo ? MPSSE_SHIFT_IN : 0);
+	const unsigned tms_mode = JTAG_TMS | (tdo ? MPSSE_SHIFT_IN : 0);
+	const enum jtag_state exit1 =
+		shift == JTAG_DRSHIFT ? JTAG_DREXIT1 : JTAG_IREXIT1;
+	const unsigned char *in = tdi;
+	const unsigned body = bits - 1;
+	const unsigned bytes = body / 8;
+	const unsigned rem = body % 8;
+	struct mpsse_cmd cmd;
+	unsigned tms;
+	unsigned len;
+	int last;
+
+	if (bits == 0)
+		return;
+
+	jtag_goto(jtag, shift);
+
+	// All the bits but the last one are shifted in the shift state.
+	for (unsigned pos = 0; pos < bytes;) {
+		unsigned n = bytes - pos;
+
+		if (n > 0x10000)
+			n = 0x10000;
+		mpsse_shift_bytes(&jtag->io, mode, in + pos, n, &cmd);
+		if (tdo)
+			jtag_add_read(jtag, tdo, pos * 8, &cmd, 0, n * 8);
+		pos += n;
+	}
+
+	if (rem) {
+		mpsse_shift_bits(&jtag->io, mode, in[bytes], rem, &cmd);
+		if (tdo)
+			jtag_add_read(
+				jtag, tdo, bytes * 8, &cmd, 8 - rem, rem);
+	}
+
+	// The last bit is shifted together with TMS 1 that moves the TAP to
+	// Exit1, the path to the end state follows in the same TMS command.
+	last = (in[body / 8] >> (body % 8)) & 1;
+	len = jtag_path(exit1, end, &tms);
+	if (len > 6) {
+		mpsse_shift_tms(&jtag->io, tms_mode, 1, 1, last, &cmd);
+		if (tdo)
+			jtag_add_read(jtag, tdo, body, &cmd, 7, 1);
+		jtag_tms(jtag, tms, len, last);
+	} else {
+		mpsse_shift_tms(&jtag->io, tms_mode, 1 | (tms << 1), len + 1,
+				last, &cmd);
+		if (tdo)
+			jtag_add_read(jtag, tdo, body, &cmd, 7 - len, 1);
+	}
+	jtag->state = end;
+}
+
+void jtag_shift_ir(
+	struct jtag *jtag,
+	const void *tdi,
+	void *tdo,
+	unsigned bits,
+	enum jtag_state end)
+{
+	jtag_shift(jtag, JTAG_IRSHIFT, tdi, tdo, bits, end);
+}
+
+void jtag_shift_dr(
+	struct jtag *jtag,
+	const void *tdi,
+	void *tdo,
+	unsigned bits,
+	enum jtag_state end)
+{
+	jtag_shift(jtag, JTAG_DRSHIFT, tdi, tdo, bits, end);
+}
+
+unsigned jtag_pending(const struct jtag *jtag)
+{
+	return jtag->io.cmd_size;
+}
+
+static void jtag_copy(
+	const struct jtag_read *read, const unsigned char *data)
+{
+	data += read->data_offset;
+
+	// Byte shifts start at a byte boundary of the destination.
+	if (read->shift == 0 && read->dst_bit % 8 == 0 &&
+	    read->bits % 8 == 0) {
+		memcpy(read->dst + read->dst_bit / 8, data, read->bits / 8);
+		return;
+	}
+
+	for (unsigned i = 0; i < read->bits; ++i) {
+		const unsigned src = read->shift + i;
+		const unsigned dst = read->dst_bit + i;
+		const int bit = (data[src / 8] >> (src % 8)) & 1;
+
+		if (bit)
+			read->dst[dst / 8] |= 1 << (dst % 8);
+		else
+			read->dst[dst / 8] &= ~(1 << (dst % 8));
+	}
+}
+
+int jtag_flush(struct jtag *jtag)
+{
+	int ret = -1;
+
+	if (!jtag->error && mpsse_submit(jtag->mpsse, &jtag->io) == 0) {
+		for (unsigned i = 0; i < jtag->nreads; ++i)
+			jtag_copy(&jtag->reads[i], jtag->io.data);
+		ret = 0;
+	}
+
+	mpsse_io_buffer_reset(&jtag->io);
+	jtag->nreads = 0;
+	jtag->error = 0;
+	return ret;
+}
+
+static int jtag_setup(struct jtag *jtag, unsigned divisor)
+{
+	struct mpsse_io_buffer *io = &jtag->io;
+
+	mpsse_disable_freq_div5(io, NULL);
+	mpsse_disable_adaptive_clocking(io, NULL);
+	mpsse_disable_3phase_clocking(io, NULL);
+	mpsse_set_drive0_pins(io, 0, NULL);
+	mpsse_disable_loopback(io, NULL);
+	mpsse_set_freq_divisor(io, divisor, NULL);
+	mpsse_set_output(io, JTAG_PINMASK, JTAG_PINVALS, NULL);
+	jtag_reset(jtag);
+	return jtag_flush(jtag);
+}
+
+int jtag_open(struct jtag *jtag, struct mpsse *mpsse, unsigned hz)
+{
+	unsigned divisor;
+
+	if (hz == 0)
+		return -1;
+
+	// TCK is 30MHz / (1 + divisor).
+	divisor = (JTAG_MAX_HZ + hz - 1) / hz - 1;
+	if (divisor > 0xffff)
+		divisor = 0xffff;
+
+	jtag->mpsse = mpsse;
+	jtag->hz = JTAG_MAX_HZ / (1 + divisor);
+	jtag->state = JTAG_RESET;
+	jtag->reads = NULL;
+	jtag->nreads = 0;
+	jtag->capacity = 0;
+	jtag->error = 0;
+	mpsse_io_buffer_setup(&jtag->io);
+
+	if (jtag_setup(jtag, divisor) != 0) {
+		jtag_close(jtag);
+		return -1;
+	}
+
+	return 0;
+}
+
+void jtag_close(struct jtag *jtag)
+{
+	mpsse_io_buffer_release(&jtag->io);
+	free(jtag->reads);
+	jtag->reads = NULL;
+	jtag->nreads = 0;
+	jtag->capacity = 0;
+	jtag->mpsse = NULL;
+}
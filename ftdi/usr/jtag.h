@@ -0,0 +1,105 @@
+// SPDX-License-Identifier: GPL-2.0
+#ifndef __JTAG_H__
+#define __JTAG_H__
+
+#include "mpsse.h"
+
+// JTAG TAP controller on top of an MPSSE device: ADBUS0 is TCK, ADBUS1 is
+// TDI, ADBUS2 is TDO and ADBUS3 is TMS.
+//
+// The functions that change the TAP state or shift data only add MPSSE
+// commands to the MPSSE IO buffer of the JTAG structure, nothing is sent to
+// the device until jtag_flush. So any number of shifts can be batched into a
+// single submission and the data read by the shifts is copied to the
+// caller's buffers only once the submission completes.
+enum jtag_state {
+	JTAG_RESET,
+	JTAG_IDLE,
+	JTAG_DRSELECT,
+	JTAG_DRCAPTURE,
+	JTAG_DRSHIFT,
+	JTAG_DREXIT1,
+	JTAG_DRPAUSE,
+	JTAG_DREXIT2,
+	JTAG_DRUPDATE,
+	JTAG_IRSELECT,
+	JTAG_IRCAPTURE,
+	JTAG_IRSHIFT,
+	JTAG_IREXIT1,
+	JTAG_IRPAUSE,
+	JTAG_IREXIT2,
+	JTAG_IRUPDATE,
+	JTAG_STATES,
+};
+
+// With the divide by 5 disabled the MPSSE clock is 60MHz and TCK is at most
+// half of that.
+#define JTAG_MAX_HZ 30000000u
+
+// Data read by a shift that has to be copied to the caller's buffer once the
+// commands complete.
+struct jtag_read;
+
+struct jtag {
+	struct mpsse *mpsse;
+	struct mpsse_io_buffer io;
+	unsigned hz;
+	// TAP state after all the commands added so far.
+	enum jtag_state state;
+	struct jtag_read *reads;
+	unsigned nreads;
+	unsigned capacity;
+	// Non-0 if we failed to allocate memory for one of the reads, in this
+	// case jtag_flush fails.
+	int error;
+};
+
+// Configures the MPSSE device for JTAG with the given TCK frequency, the
+// actual frequency is the highest one the MPSSE can generate that is not
+// above the requested one, and resets the TAP. Returns 0 on success and a
+// non-0 value otherwise.
+int jtag_open(struct jtag *jtag, struct mpsse *mpsse, unsigned hz);
+void jtag_close(struct jtag *jtag);
+
+// Returns the name of the state as used in SVF files.
+const char *jtag_state_name(enum jtag_state state);
+
+// Moves the TAP to the Test-Logic-Reset state regardless of the current
+// state of the TAP.
+void jtag_reset(struct jtag *jtag);
+
+// Moves the TAP to the given state using the shortest TMS sequence.
+void jtag_goto(struct jtag *jtag, enum jtag_state state);
+
+// Generates the given number of TCK cycles in the current state, only makes
+// sense in the stable states: Test-Logic-Reset, Run-Test/Idle and the pause
+// states.
+void jtag_clock(struct jtag *jtag, unsigned cycles);
+
+// Shifts bits through the instruction or data register and then moves the TAP
+// to the end state. Bit i of the data is bit (i % 8) of the byte i / 8 and
+// bit 0 is shifted first. If tdo is not NULL it receives the bits shifted out
+// during jtag_flush, so it must stay valid until then.
+void jtag_shift_ir(
+	struct jtag *jtag,
+	const void *tdi,
+	void *tdo,
+	unsigned bits,
+	enum jtag_state end);
+void jtag_shift_dr(
+	struct jtag *jtag,
+	const void *tdi,
+	void *tdo,
+	unsigned bits,
+	enum jtag_state end);
+
+// Returns the amount of commands waiting for jtag_flush in bytes, callers
+// that queue a lot of commands may use it to decide when to flush.
+unsigned jtag_pending(const struct jtag *jtag);
+
+// Sends all the commands added so far to the device and copies the data they
+// read to the tdo buffers. Returns 0 on success and a non-0 value otherwise,
+// in which case the TAP state is unknown and should be reset.
+int jtag_flush(struct jtag *jtag);
+
+#endif  // __JTAG_H__
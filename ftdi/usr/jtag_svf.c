@@ -0,0 +1,793 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "jtag.h"
+#include "mpsse.h"
+
+// The commands are sent to the device in batches of about that size, the
+// TDO checks of a batch are done once the batch completes.
+#define SVF_BATCH_SIZE (1u << 20)
+
+// Longest chain the IDCODE scan looks at.
+#define SVF_MAX_DEVICES 32
+
+enum svf_token_kind {
+	SVF_WORD,
+	SVF_HEX,
+	SVF_END,
+	SVF_EOF,
+	SVF_ERROR,
+};
+
+struct svf_token {
+	enum svf_token_kind kind;
+	char *text;
+	size_t len;
+	size_t capacity;
+};
+
+// Pattern of one of the scan commands, the values persist between the
+// commands of the same kind as the SVF specification requires.
+struct svf_scan {
+	unsigned bits;
+	unsigned char *tdi;
+	unsigned char *tdo;
+	unsigned char *mask;
+};
+
+// TDO values to compare with the expected ones once the batch completes.
+struct svf_check {
+	unsigned line;
+	unsigned bits;
+	// The data part of the scan starts at this bit of the TDO data.
+	unsigned offset;
+	unsigned char *tdo;
+	unsigned char *expected;
+	unsigned char *mask;
+};
+
+struct svf {
+	struct jtag *jtag;
+	const char *p;
+	const char *end;
+	unsigned line;
+	// Line where the current statement starts.
+	unsigned statement;
+	struct svf_token token;
+
+	struct svf_scan sir, sdr, hir, hdr, tir, tdr;
+	enum jtag_state endir;
+	enum jtag_state enddr;
+	enum jtag_state run_state;
+	enum jtag_state run_end;
+
+	struct svf_check *checks;
+	unsigned nchecks;
+	unsigned capacity;
+	unsigned statements;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stdout,
+		"%s -s serial [-f hz] [-i] [file.svf] [-h]\n\n"
+		"\t-h           print the usage information.\n"
+		"\t-s serial    specify the FTDI serial number of the device "
+		"               used as JTAG adapter, optionally prefixed "
+		"               with the transport, e.g. d2xx:serial or "
+		"               usb:serial[@vid:pid], the usb transport "
+		"               looks for 0x0005:0x0001 and then for "
+		"               0x0403:0x6014 by default.\n"
+		"\t-f hz        TCK frequency, 30MHz by default.\n"
+		"\t-i           reset the chain and print the IDCODEs of the "
+		"               devices on it.\n"
+		"\tfile.svf     SVF file to play.\n",
+		name);
+}
+
+static int svf_token_append(struct svf_token *token, char c)
+{
+	if (token->len + 1 >= token->capacity) {
+		const size_t capacity = token->capacity ?
+			token->capacity * 2 : 64;
+		char *text = realloc(token->text, capacity);
+
+		if (!text)
+			return -1;
+		token->text = text;
+		token->capacity = capacity;
+	}
+
+	token->text[token->len++] = c;
+	token->text[token->len] = '\0';
+	return 0;
+}
+
+// Reads the next token: a word, a hex value in parentheses with all the
+// whitespace removed or the end of a statement. Comments start with // or !
+// and go to the end of the line.
+static enum svf_token_kind svf_next(struct svf *svf)
+{
+	struct svf_token *token = &svf->token;
+
+	token->len = 0;
+
+	while (svf->p < svf->end) {
+		const char c = *svf->p;
+
+		if (c == '\n')
+			svf->line++;
+		if (isspace((unsigned char)c)) {
+			svf->p++;
+			continue;
+		}
+		if (c == '!' || (c == '/' && svf->p + 1 < svf->end &&
+				 svf->p[1] == '/')) {
+			while (svf->p < svf->end && *svf->p != '\n')
+				svf->p++;
+			continue;
+		}
+		break;
+	}
+
+	if (svf->p == svf->end)
+		return token->kind = SVF_EOF;
+
+	if (*svf->p == ';') {
+		svf->p++;
+		return token->kind = SVF_END;
+	}
+
+	if (*svf->p == '(') {
+		for (svf->p++; svf->p < svf->end && *svf->p != ')'; svf->p++) {
+			if (*svf->p == '\n')
+				svf->line++;
+			if (isspace((unsigned char)*svf->p))
+				continue;
+			if (svf_token_append(token, *svf->p) != 0)
+				return token->kind = SVF_ERROR;
+		}
+		if (svf->p == svf->end || token->len == 0)
+			return token->kind = SVF_ERROR;
+		svf->p++;
+		return token->kind = SVF_HEX;
+	}
+
+	while (svf->p < svf->end && !isspace((unsigned char)*svf->p) &&
+	       *svf->p != ';' && *svf->p != '(') {
+		if (svf_token_append(token, *svf->p++) != 0)
+			return token->kind = SVF_ERROR;
+	}
+	return token->kind = SVF_WORD;
+}
+
+static int svf_word(struct svf *svf, const char *word)
+{
+	return svf->token.kind == SVF_WORD &&
+	       strcasecmp(svf->token.text, word) == 0;
+}
+
+static int svf_state(const char *name, enum jtag_state *state)
+{
+	for (unsigned i = 0; i < JTAG_STATES; ++i) {
+		if (strcasecmp(name, jtag_state_name(i)) == 0) {
+			*state = i;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static int svf_stable(enum jtag_state state)
+{
+	return state == JTAG_RESET || state == JTAG_IDLE ||
+	       state == JTAG_DRPAUSE || state == JTAG_IRPAUSE;
+}
+
+// Parses hex value of the given length, the last digit holds the bits shifted
+// first.
+static int svf_hex(const char *hex, unsigned bits, unsigned char *buf)
+{
+	const size_t len = strlen(hex);
+
+	memset(buf, 0, (bits + 7) / 8);
+	for (size_t i = 0; i < len; ++i) {
+		const char c = hex[len - 1 - i];
+		unsigned digit;
+
+		if (!isxdigit((unsigned char)c))
+			return -1;
+		digit = isdigit((unsigned char)c) ?
+			c - '0' : tolower((unsigned char)c) - 'a' + 10;
+		for (unsigned b = 0; b < 4; ++b) {
+			const unsigned bit = i * 4 + b;
+
+			if (!(digit & (1u << b)))
+				continue;
+			if (bit >= bits)
+				return -1;
+			buf[bit / 8] |= 1u << (bit % 8);
+		}
+	}
+	return 0;
+}
+
+static void svf_copy_bits(
+	unsigned char *dst,
+	unsigned dst_bit,
+	const unsigned char *src,
+	unsigned src_bit,
+	unsigned bits)
+{
+	for (unsigned i = 0; i < bits; ++i) {
+		const unsigned s = src_bit + i;
+		const unsigned d = dst_bit + i;
+
+		if ((src[s / 8] >> (s % 8)) & 1)
+			dst[d / 8] |= 1u << (d % 8);
+		else
+			dst[d / 8] &= ~(1u << (d % 8));
+	}
+}
+
+static int svf_scan_resize(struct svf_scan *scan, unsigned bits)
+{
+	const size_t size = (bits + 7) / 8 + 1;
+	unsigned char *tdi = calloc(1, size);
+	unsigned char *tdo = calloc(1, size);
+	unsigned char *mask = malloc(size);
+
+	if (!tdi || !tdo || !mask) {
+		free(tdi);
+		free(tdo);
+		free(mask);
+		return -1;
+	}
+
+	// A new length resets the mask to compare all the bits.
+	memset(mask, 0xff, size);
+	free(scan->tdi);
+	free(scan->tdo);
+	free(scan->mask);
+	scan->tdi = tdi;
+	scan->tdo = tdo;
+	scan->mask = mask;
+	scan->bits = bits;
+	return 0;
+}
+
+static void svf_scan_release(struct svf_scan *scan)
+{
+	free(scan->tdi);
+	free(scan->tdo);
+	free(scan->mask);
+	memset(scan, 0, sizeof(*scan));
+}
+
+// Parses the rest of SIR, SDR, HIR, HDR, TIR or TDR statement, sets check to
+// non-0 if the statement has the TDO value to compare with.
+static int svf_parse_scan(struct svf *svf, struct svf_scan *scan, int *check)
+{
+	unsigned char *dst;
+	unsigned long bits;
+	char *endptr;
+
+	*check = 0;
+	if (svf_next(svf) != SVF_WORD)
+		return -1;
+	bits = strtoul(svf->token.text, &endptr, 10);
+	if (*endptr != '\0' || bits > (1ul << 28))
+		return -1;
+	if ((bits != scan->bits || !scan->tdi) &&
+	    svf_scan_resize(scan, bits) != 0)
+		return -1;
+
+	while (svf_next(svf) == SVF_WORD) {
+		if (svf_word(svf, "TDI")) {
+			dst = scan->tdi;
+		} else if (svf_word(svf, "TDO")) {
+			dst = scan->tdo;
+			*check = 1;
+		} else if (svf_word(svf, "MASK")) {
+			dst = scan->mask;
+		} else if (svf_word(svf, "SMASK")) {
+			dst = NULL;
+		} else {
+			return -1;
+		}
+
+		if (svf_next(svf) != SVF_HEX)
+			return -1;
+		// SMASK only says which TDI bits matter, all of them are sent
+		// anyway.
+		if (dst && svf_hex(svf->token.text, bits, dst) != 0)
+			return -1;
+	}
+
+	return svf->token.kind == SVF_END ? 0 : -1;
+}
+
+static int svf_verify(struct svf *svf)
+{
+	int ret = 0;
+
+	for (unsigned i = 0; i < svf->nchecks; ++i) {
+		struct svf_check *check = &svf->checks[i];
+
+		for (unsigned b = 0; b < check->bits && ret == 0; ++b) {
+			const unsigned t = check->offset + b;
+			const unsigned char bit = 1u << (b % 8);
+			const int mask = (check->mask[b / 8] & bit) != 0;
+			const int want = (check->expected[b / 8] & bit) != 0;
+			const int got = (check->tdo[t / 8] >> (t % 8)) & 1;
+
+			if (mask && want != got) {
+				fprintf(stderr,
+					"TDO mismatch at line %u, bit %u\n",
+					check->line, b);
+				ret = -1;
+			}
+		}
+
+		free(check->tdo);
+		free(check->expected);
+		free(check->mask);
+	}
+
+	svf->nchecks = 0;
+	return ret;
+}
+
+static int svf_flush(struct svf *svf)
+{
+	if (jtag_flush(svf->jtag) != 0) {
+		fprintf(stderr, "Failed to execute JTAG commands\n");
+		svf_verify(svf);
+		return -1;
+	}
+	return svf_verify(svf);
+}
+
+// Shifts the header, the data and the trailer patterns as one scan, the
+// header goes first, so it ends up in the devices closest to TDO.
+static int svf_shift(struct svf *svf, int ir, int check)
+{
+	const struct svf_scan *header = ir ? &svf->hir : &svf->hdr;
+	const struct svf_scan *data = ir ? &svf->sir : &svf->sdr;
+	const struct svf_scan *trailer = ir ? &svf->tir : &svf->tdr;
+	const unsigned bits = header->bits + data->bits + trailer->bits;
+	const size_t size = (bits + 7) / 8;
+	const size_t data_size = (data->bits + 7) / 8;
+	struct svf_check *c = NULL;
+	unsigned char *tdi;
+
+	if (bits == 0)
+		return 0;
+
+	tdi = calloc(1, size);
+	if (!tdi)
+		return -1;
+	svf_copy_bits(tdi, 0, header->tdi, 0, header->bits);
+	svf_copy_bits(tdi, header->bits, data->tdi, 0, data->bits);
+	svf_copy_bits(tdi, header->bits + data->bits,
+		      trailer->tdi, 0, trailer->bits);
+
+	if (check && data->bits != 0) {
+		if (svf->nchecks == svf->capacity) {
+			const unsigned capacity = svf->capacity ?
+				svf->capacity * 2 : 64;
+			struct svf_check *checks = realloc(
+				svf->checks, capacity * sizeof(*checks));
+
+			if (!checks) {
+				free(tdi);
+				return -1;
+			}
+			svf->checks = checks;
+			svf->capacity = capacity;
+		}
+
+		c = &svf->checks[svf->nchecks];
+		c->line = svf->statement;
+		c->bits = data->bits;
+		c->offset = header->bits;
+		c->tdo = calloc(1, size);
+		c->expected = malloc(data_size);
+		c->mask = malloc(data_size);
+		if (!c->tdo || !c->expected || !c->mask) {
+			free(c->tdo);
+			free(c->expected);
+			free(c->mask);
+			free(tdi);
+			return -1;
+		}
+		memcpy(c->expected, data->tdo, data_size);
+		memcpy(c->mask, data->mask, data_size);
+		svf->nchecks++;
+	}
+
+	// The JTAG layer copies TDI into the commands right away, only TDO
+	// has to wait for the batch to complete.
+	if (ir)
+		jtag_shift_ir(svf->jtag, tdi, c ? c->tdo : NULL, bits,
+			      svf->endir);
+	else
+		jtag_shift_dr(svf->jtag, tdi, c ? c->tdo : NULL, bits,
+			      svf->enddr);
+	free(tdi);
+
+	if (jtag_pending(svf->jtag) >= SVF_BATCH_SIZE)
+		return svf_flush(svf);
+	return 0;
+}
+
+static int svf_parse_end_state(struct svf *svf, enum jtag_state *state)
+{
+	if (svf_next(svf) != SVF_WORD || svf_state(svf->token.text, state))
+		return -1;
+	if (!svf_stable(*state))
+		return -1;
+	return svf_next(svf) == SVF_END ? 0 : -1;
+}
+
+static void svf_goto(struct svf *svf, enum jtag_state state)
+{
+	if (state == JTAG_RESET)
+		jtag_reset(svf->jtag);
+	else
+		jtag_goto(svf->jtag, state);
+}
+
+static int svf_parse_state(struct svf *svf)
+{
+	enum jtag_state state;
+
+	while (svf_next(svf) == SVF_WORD) {
+		if (svf_state(svf->token.text, &state) != 0)
+			return -1;
+		svf_goto(svf, state);
+	}
+	return svf->token.kind == SVF_END ? 0 : -1;
+}
+
+// RUNTEST [run_state] [run_count TCK|SCK]
+//         [min_time SEC [MAXIMUM max_time SEC]] [ENDSTATE end_state];
+// The minimal time is converted to TCK cycles, so there is no need to stop
+// and wait for the device.
+static int svf_parse_runtest(struct svf *svf)
+{
+	unsigned long long cycles = 0;
+	double value = 0;
+	int have_value = 0;
+	enum jtag_state state;
+	char *endptr;
+
+	while (svf_next(svf) == SVF_WORD) {
+		if (!have_value &&
+		    svf_state(svf->token.text, &state) == 0) {
+			if (!svf_stable(state))
+				return -1;
+			svf->run_state = state;
+			svf->run_end = state;
+			continue;
+		}
+
+		if (svf_word(svf, "TCK") || svf_word(svf, "SCK")) {
+			if (!have_value)
+				return -1;
+			if ((unsigned long long)value > cycles)
+				cycles = value;
+			have_value = 0;
+			continue;
+		}
+
+		if (svf_word(svf, "SEC")) {
+			const double hz = svf->jtag->hz;
+
+			if (!have_value)
+				return -1;
+			if ((unsigned long long)ceil(value * hz) > cycles)
+				cycles = ceil(value * hz);
+			have_value = 0;
+			continue;
+		}
+
+		// The maximum time is only a limit, we always take the
+		// minimum.
+		if (svf_word(svf, "MAXIMUM")) {
+			if (svf_next(svf) != SVF_WORD ||
+			    svf_next(svf) != SVF_WORD)
+				return -1;
+			continue;
+		}
+
+		if (svf_word(svf, "ENDSTATE")) {
+			if (svf_next(svf) != SVF_WORD ||
+			    svf_state(svf->token.text, &state) != 0 ||
+			    !svf_stable(state))
+				return -1;
+			svf->run_end = state;
+			continue;
+		}
+
+		value = strtod(svf->token.text, &endptr);
+		if (*endptr != '\0' || value < 0)
+			return -1;
+		have_value = 1;
+	}
+
+	if (svf->token.kind != SVF_END || have_value)
+		return -1;
+
+	svf_goto(svf, svf->run_state);
+	while (cycles != 0) {
+		const unsigned n = cycles > 0x40000000 ? 0x40000000 : cycles;
+
+		jtag_clock(svf->jtag, n);
+		cycles -= n;
+	}
+	svf_goto(svf, svf->run_end);
+	return 0;
+}
+
+static int svf_skip(struct svf *svf)
+{
+	while (svf_next(svf) == SVF_WORD || svf->token.kind == SVF_HEX)
+		;
+	return svf->token.kind == SVF_END ? 0 : -1;
+}
+
+static int svf_statement(struct svf *svf)
+{
+	int check;
+
+	if (svf_word(svf, "SIR") || svf_word(svf, "SDR")) {
+		const int ir = svf_word(svf, "SIR");
+
+		if (svf_parse_scan(svf, ir ? &svf->sir : &svf->sdr,
+				   &check) != 0)
+			return -1;
+		return svf_shift(svf, ir, check);
+	}
+	if (svf_word(svf, "HIR"))
+		return svf_parse_scan(svf, &svf->hir, &check);
+	if (svf_word(svf, "HDR"))
+		return svf_parse_scan(svf, &svf->hdr, &check);
+	if (svf_word(svf, "TIR"))
+		return svf_parse_scan(svf, &svf->tir, &check);
+	if (svf_word(svf, "TDR"))
+		return svf_parse_scan(svf, &svf->tdr, &check);
+	if (svf_word(svf, "ENDIR"))
+		return svf_parse_end_state(svf, &svf->endir);
+	if (svf_word(svf, "ENDDR"))
+		return svf_parse_end_state(svf, &svf->enddr);
+	if (svf_word(svf, "STATE"))
+		return svf_parse_state(svf);
+	if (svf_word(svf, "RUNTEST"))
+		return svf_parse_runtest(svf);
+	// The adapter has no TRST pin and runs at the frequency given on the
+	// command line.
+	if (svf_word(svf, "TRST") || svf_word(svf, "FREQUENCY"))
+		return svf_skip(svf);
+	return -1;
+}
+
+static int svf_play(struct jtag *jtag, const char *data, size_t size)
+{
+	struct svf svf;
+	int ret = 0;
+
+	memset(&svf, 0, sizeof(svf));
+	svf.jtag = jtag;
+	svf.p = data;
+	svf.end = data + size;
+	svf.line = 1;
+	svf.endir = JTAG_IDLE;
+	svf.enddr = JTAG_IDLE;
+	svf.run_state = JTAG_IDLE;
+	svf.run_end = JTAG_IDLE;
+
+	while (ret == 0 && svf_next(&svf) != SVF_EOF) {
+		svf.statement = svf.line;
+		if (svf.token.kind == SVF_END)
+			continue;
+		if (svf.token.kind != SVF_WORD || svf_statement(&svf) != 0) {
+			fprintf(stderr, "Failed to execute statement at line "
+				"%u\n", svf.statement);
+			ret = -1;
+			break;
+		}
+		svf.statements++;
+	}
+
+	if (svf_flush(&svf) != 0)
+		ret = -1;
+	if (ret == 0)
+		fprintf(stdout, "Played %u statements\n", svf.statements);
+
+	free(svf.token.text);
+	free(svf.checks);
+	svf_scan_release(&svf.sir);
+	svf_scan_release(&svf.sdr);
+	svf_scan_release(&svf.hir);
+	svf_scan_release(&svf.hdr);
+	svf_scan_release(&svf.tir);
+	svf_scan_release(&svf.tdr);
+	return ret;
+}
+
+static int play_file(struct jtag *jtag, const char *name)
+{
+	double start;
+	char *data;
+	long size;
+	FILE *file;
+	int ret;
+
+	file = fopen(name, "rb");
+	if (!file) {
+		fprintf(stderr, "Failed to open %s\n", name);
+		return -1;
+	}
+
+	if (fseek(file, 0, SEEK_END) != 0 || (size = ftell(file)) < 0 ||
+	    fseek(file, 0, SEEK_SET) != 0) {
+		fprintf(stderr, "Failed to find the size of %s\n", name);
+		fclose(file);
+		return -1;
+	}
+
+	data = malloc(size + 1);
+	if (!data || fread(data, 1, size, file) != (size_t)size) {
+		fprintf(stderr, "Failed to read %s\n", name);
+		free(data);
+		fclose(file);
+		return -1;
+	}
+	fclose(file);
+
+	start = now();
+	ret = svf_play(jtag, data, size);
+	if (ret == 0)
+		fprintf(stdout, "%s played in %.3f s\n", name, now() - start);
+	free(data);
+	return ret;
+}
+
+// After reset every device has either IDCODE or BYPASS instruction selected,
+// IDCODE starts with 1 and BYPASS is a single 0. Shifting ones in we know we
+// reached the end of the chain once we read back all ones.
+static int scan_chain(struct jtag *jtag)
+{
+	unsigned char tdi[SVF_MAX_DEVICES * 4 + 4];
+	unsigned char tdo[sizeof(tdi)];
+	const unsigned bits = sizeof(tdi) * 8;
+	unsigned devices = 0;
+	unsigned pos = 0;
+
+	memset(tdi, 0xff, sizeof(tdi));
+	jtag_reset(jtag);
+	jtag_shift_dr(jtag, tdi, tdo, bits, JTAG_IDLE);
+	if (jtag_flush(jtag) != 0) {
+		fprintf(stderr, "Failed to scan the chain\n");
+		return -1;
+	}
+
+	while (pos + 32 <= bits && devices < SVF_MAX_DEVICES) {
+		unsigned id = 0;
+
+		if (!((tdo[pos / 8] >> (pos % 8)) & 1)) {
+			fprintf(stdout, "Device %u: BYPASS\n", devices++);
+			pos++;
+			continue;
+		}
+
+		for (unsigned i = 0; i < 32; ++i, ++pos)
+			id |= (unsigned)((tdo[pos / 8] >> (pos % 8)) & 1) << i;
+		if (id == 0xffffffff)
+			break;
+		fprintf(stdout, "Device %u: IDCODE 0x%08x\n", devices++, id);
+	}
+
+	if (devices == 0)
+		fprintf(stdout, "No devices found\n");
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	const char *serial = NULL;
+	const char *file = NULL;
+	unsigned hz = JTAG_MAX_HZ;
+	int idcode = 0;
+	char *endptr;
+
+	struct mpsse mpsse;
+	struct jtag jtag;
+	int ret = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:f:ih")) != -1) {
+		switch (opt) {
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		case 's':
+			serial = optarg;
+			break;
+		case 'f':
+			hz = strtoul(optarg, &endptr, 0);
+			if (*endptr != '\0' || hz == 0) {
+				fprintf(stderr,
+					"Failed to parse frequency %s\n",
+					optarg);
+				return 1;
+			}
+			break;
+		case 'i':
+			idcode = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (!serial) {
+		fprintf(stderr, "Expect exactly one -s argument\n");
+		return 1;
+	}
+
+	if (optind < argc)
+		file = argv[optind];
+	if (!file && !idcode) {
+		fprintf(stderr, "Expect an SVF file or -i\n");
+		return 1;
+	}
+
+	if (mpsse_open_spec(serial, &mpsse) != 0) {
+		fprintf(stderr, "Failed to enable MPSSE on %s\n", serial);
+		return 1;
+	}
+
+	if (mpsse_verify(&mpsse) != 0) {
+		fprintf(stderr, "Failed to verify MPSSE mode on %s\n", serial);
+		mpsse_close(&mpsse);
+		return 1;
+	}
+
+	if (jtag_open(&jtag, &mpsse, hz) != 0) {
+		fprintf(stderr, "Failed to configure JTAG on %s\n", serial);
+		mpsse_close(&mpsse);
+		return 1;
+	}
+	fprintf(stdout, "TCK: %u Hz\n", jtag.hz);
+
+	if (idcode)
+		ret = scan_chain(&jtag);
+	if (ret == 0 && file)
+		ret = play_file(&jtag, file);
+
+	jtag_close(&jtag);
+	if (mpsse_close(&mpsse) != 0) {
+		fprintf(stderr, "Failed to close %s\n", serial);
+		return 1;
+	}
+
+	return ret == 0 ? 0 : 1;
+}
@@ -2,30 +2,84 @@
 #include "mpsse.h"
 
 #include <assert.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 
 
 void mpsse_io_buffer_setup(struct mpsse_io_buffer *io)
 {
-	io->cmd = NULL;
+	io->arena = io->storage;
+	io->cmd = io->arena;
 	io->cmd_size = 0;
-	io->cmd_capacity = 0;
-	io->data = NULL;
+	io->cmd_capacity = MPSSE_IO_INLINE_CMD_SIZE;
+	io->data = io->arena + io->cmd_capacity;
 	io->data_size = 0;
-	io->data_capacity = 0;
+	io->data_capacity = MPSSE_IO_INLINE_DATA_SIZE;
+	io->sinks = NULL;
+	io->sink_count = 0;
+	io->sink_capacity = 0;
+	io->sink_size = 0;
+	io->error = 0;
 }
 
 void mpsse_io_buffer_reset(struct mpsse_io_buffer *io)
 {
 	io->cmd_size = 0;
 	io->data_size = 0;
+	io->sink_count = 0;
+	io->sink_size = 0;
+	io->error = 0;
 }
 
 void mpsse_io_buffer_release(struct mpsse_io_buffer *io)
 {
-	free(io->cmd);
-	free(io->data);
+	if (io->arena != io->storage)
+		free(io->arena);
+	free(io->sinks);
+	mpsse_io_buffer_setup(io);
+}
+
+static unsigned mpsse_grow(unsigned capacity, unsigned size)
+{
+	while (capacity < size) {
+		if (capacity > UINT_MAX / 2)
+			return size;
+		capacity *= 2;
+	}
+	return capacity;
+}
+
+int mpsse_io_buffer_reserve(
+	struct mpsse_io_buffer *io, unsigned cmd_size, unsigned data_size)
+{
+	unsigned char *arena;
+
+	if (cmd_size <= io->cmd_capacity && data_size <= io->data_capacity)
+		return 0;
+
+	if (cmd_size < io->cmd_capacity)
+		cmd_size = io->cmd_capacity;
+	if (data_size < io->data_capacity)
+		data_size = io->data_capacity;
+	if (cmd_size > UINT_MAX - data_size)
+		return -1;
+
+	arena = malloc(cmd_size + data_size);
+	if (!arena)
+		return -1;
+
+	memcpy(arena, io->cmd, io->cmd_size);
+	memcpy(arena + cmd_size, io->data, io->data_size);
+	if (io->arena != io->storage)
+		free(io->arena);
+
+	io->arena = arena;
+	io->cmd = arena;
+	io->cmd_capacity = cmd_size;
+	io->data = arena + cmd_size;
+	io->data_capacity = data_size;
+	return 0;
 }
 
 void *mpsse_cmd(struct mpsse_cmd *cmd)
@@ -44,56 +98,118 @@ void *mpsse_data(struct mpsse_cmd *cmd)
 	return (unsigned char *)cmd->io->data + cmd->data_offset;
 }
 
-static unsigned mpsse_io_buffer_reserve_cmd(
-	struct mpsse_io_buffer *io, unsigned size)
+// Reserves space for a command and its data at the end of the MPSSE IO buffer.
+// The capacity grows geometrically, so building a batch of N commands takes
+// O(log N) allocations at most.
+static int mpsse_io_buffer_append(
+	struct mpsse_io_buffer *io,
+	unsigned cmd_size,
+	unsigned data_size,
+	unsigned *cmd_offset,
+	unsigned *data_offset)
 {
-	const unsigned offset = io->cmd_size;
+	if (io->error)
+		return -1;
 
-	if (io->cmd_size + size > io->cmd_capacity) {
-		unsigned new_capacity = 2 * io->cmd_capacity / 3;
-		void *new_cmd;
+	if (cmd_size > UINT_MAX - io->cmd_size ||
+	    data_size > UINT_MAX - io->data_size)
+		goto err;
 
-		if (new_capacity < io->cmd_size + size)
-			new_capacity = io->cmd_size + size;
+	if (mpsse_io_buffer_reserve(
+			io,
+			mpsse_grow(io->cmd_capacity, io->cmd_size + cmd_size),
+			mpsse_grow(io->data_capacity,
+				   io->data_size + data_size)) != 0)
+		goto err;
 
-		assert((new_cmd = realloc(io->cmd, new_capacity)) != NULL);
-		io->cmd = new_cmd;
-		io->cmd_capacity = new_capacity;
-	}
+	*cmd_offset = io->cmd_size;
+	*data_offset = io->data_size;
+	io->cmd_size += cmd_size;
+	io->data_size += data_size;
+	return 0;
 
-	io->cmd_size += size;
-	return offset;
+err:
+	io->error = 1;
+	return -1;
 }
 
-static unsigned mpsse_io_buffer_reserve_data(
-	struct mpsse_io_buffer *io, unsigned size)
+// Directs the next size bytes of data returned by the device to buf. Reads
+// into adjacent memory, e.g. a long read split into several commands, end
+// up in a single sink.
+static int mpsse_io_buffer_sink(
+	struct mpsse_io_buffer *io, void *buf, unsigned size)
 {
-	const unsigned offset = io->data_size;
+	const unsigned offset = io->data_size + io->sink_size;
+	struct mpsse_sink *sink;
+
+	if (io->error)
+		return -1;
+
+	if (offset > UINT_MAX - size)
+		goto err;
 
-	if (io->data_size + size > io->data_capacity) {
-		unsigned new_capacity = 2 * io->data_capacity / 3;
-		void *new_data;
+	if (io->sink_count != 0) {
+		sink = &io->sinks[io->sink_count - 1];
+		if (sink->offset + sink->size == offset &&
+		    (unsigned char *)sink->buf + sink->size == buf) {
+			sink->size += size;
+			io->sink_size += size;
+			return 0;
+		}
+	}
 
-		if (new_capacity < io->data_size + size)
-			new_capacity = io->data_size + size;
+	if (io->sink_count == io->sink_capacity) {
+		const unsigned capacity =
+			io->sink_capacity ? io->sink_capacity * 2 : 8;
 
-		assert((new_data = realloc(io->data, new_capacity)) != NULL);
-		io->data = new_data;
-		io->data_capacity = new_capacity;
+		sink = realloc(io->sinks, capacity * sizeof(*sink));
+		if (!sink)
+			goto err;
+		io->sinks = sink;
+		io->sink_capacity = capacity;
 	}
 
-	io->data_size += size;
-	return offset;
+	sink = &io->sinks[io->sink_count++];
+	sink->offset = offset;
+	sink->buf = buf;
+	sink->size = size;
+	io->sink_size += size;
+	return 0;
+
+err:
+	io->error = 1;
+	return -1;
 }
 
+#ifdef TRANSPORT_D2XX
 int mpsse_open(const struct serial *serial, struct mpsse *mpsse)
 {
-	FT_HANDLE handle;
+	struct transport *transport;
+
+	if (ftdi_transport_open(serial, &transport) != 0)
+		return -1;
+	return mpsse_open_transport(transport, mpsse);
+}
+#endif
+
+int mpsse_open_spec(const char *spec, struct mpsse *mpsse)
+{
+	struct transport *transport;
 
-	if (ftdi_open(serial, &handle) != 0)
+	if (transport_open(spec, &transport) != 0)
 		return -1;
+	return mpsse_open_transport(transport, mpsse);
+}
 
-	mpsse->handle = handle;
+int mpsse_open_transport(struct transport *transport, struct mpsse *mpsse)
+{
+	mpsse->transport = transport;
+	mpsse->spin = 0;
+	mpsse->head = NULL;
+	mpsse->tail = NULL;
+	mpsse->pending = NULL;
+	mpsse->in_flight = 0;
+	mpsse->flushed = 1;
 	if (mpsse_reset(mpsse) != 0) {
 		mpsse_close(mpsse);
 		return -1;
@@ -102,9 +218,36 @@ int mpsse_open(const struct serial *serial, struct mpsse *mpsse)
 	return 0;
 }
 
+static void mpsse_complete(
+	struct mpsse *mpsse, struct mpsse_request *req, int status)
+{
+	mpsse->head = req->next;
+	if (!mpsse->head)
+		mpsse->tail = NULL;
+
+	req->next = NULL;
+	req->status = status;
+	req->done = 1;
+	if (req->callback)
+		req->callback(req, status, req->arg);
+}
+
+// Completes all the requests in flight with an error.
+static void mpsse_fail(struct mpsse *mpsse)
+{
+	mpsse->pending = NULL;
+	mpsse->in_flight = 0;
+	mpsse->flushed = 1;
+	while (mpsse->head)
+		mpsse_complete(mpsse, mpsse->head, -1);
+}
+
 int mpsse_close(struct mpsse *mpsse)
 {
-	int ret = ftdi_close(mpsse->handle);
+	int ret;
+
+	mpsse_fail(mpsse);
+	ret = transport_close(mpsse->transport);
 
 	memset(mpsse, 0, sizeof(*mpsse));
 	return ret;
@@ -112,43 +255,62 @@ int mpsse_close(struct mpsse *mpsse)
 
 int mpsse_reset(struct mpsse *mpsse)
 {
-	if (ftdi_reset(mpsse->handle) != 0)
+	mpsse_fail(mpsse);
+
+	if (transport_reset(mpsse->transport) != 0)
 		return -1;
 
-	if (ftdi_drain(mpsse->handle) != 0)
+	if (transport_drain(mpsse->transport) != 0)
 		return -1;
 
-	if (ftdi_disable_special_chars(mpsse->handle) != 0)
+	if (transport_disable_special_chars(mpsse->transport) != 0)
 		return -1;
 
-	if (ftdi_set_bit_mode(mpsse->handle, FTDI_BIT_MODE_RESET) != 0)
+	if (transport_set_bit_mode(
+			mpsse->transport, FTDI_BIT_MODE_RESET) != 0)
 		return -1;
 
-	if (ftdi_set_bit_mode(mpsse->handle, FTDI_BIT_MODE_MPSSE) != 0)
+	if (transport_set_bit_mode(
+			mpsse->transport, FTDI_BIT_MODE_MPSSE) != 0)
 		return -1;
 
 	return 0;
 }
 
-static void mpsse_cmd_prepare(
+// Reserves space for a new command in the MPSSE IO buffer. On failure the
+// command is set up as an empty command and, if out is not NULL, it's
+// copied to out, so the caller can just return.
+static int mpsse_cmd_prepare(
 	struct mpsse_io_buffer *io,
 	struct mpsse_cmd *cmd,
 	unsigned cmd_size,
-	unsigned data_size)
+	unsigned data_size,
+	struct mpsse_cmd *out)
 {
 	cmd->io = io;
-	cmd->cmd_offset = mpsse_io_buffer_reserve_cmd(io, cmd_size);
+	if (mpsse_io_buffer_append(io, cmd_size, data_size,
+				   &cmd->cmd_offset, &cmd->data_offset) != 0) {
+		cmd->cmd_offset = 0;
+		cmd->cmd_size = 0;
+		cmd->data_offset = 0;
+		cmd->data_size = 0;
+		if (out)
+			*out = *cmd;
+		return -1;
+	}
+
 	cmd->cmd_size = cmd_size;
-	cmd->data_offset = mpsse_io_buffer_reserve_data(io, data_size);
 	cmd->data_size = data_size;
+	return 0;
 }
 
-static void mpsse_incorrect_command(
+void mpsse_echo(
 	struct mpsse_io_buffer *io, unsigned char op, struct mpsse_cmd *out)
 {
 	struct mpsse_cmd cmd;
 
-	mpsse_cmd_prepare(io, &cmd, 1, 2);
+	if (mpsse_cmd_prepare(io, &cmd, 1, 2, out) != 0)
+		return;
 	*((unsigned char *)mpsse_cmd(&cmd)) = op;
 	if (out)
 		*out = cmd;
@@ -161,7 +323,7 @@ int mpsse_verify(struct mpsse *mpsse)
 	unsigned char *data;
 
 	mpsse_io_buffer_setup(&io);
-	mpsse_incorrect_command(&io, 0xaa, &cmd);
+	mpsse_echo(&io, 0xaa, &cmd);
 	if (mpsse_submit(mpsse, &io) != 0)
 		goto err;
 
@@ -170,7 +332,7 @@ int mpsse_verify(struct mpsse *mpsse)
 		goto err;
 
 	mpsse_io_buffer_reset(&io);
-	mpsse_incorrect_command(&io, 0xab, &cmd);
+	mpsse_echo(&io, 0xab, &cmd);
 	if (mpsse_submit(mpsse, &io) != 0)
 		goto err;
 
@@ -178,6 +340,7 @@ int mpsse_verify(struct mpsse *mpsse)
 	if (data[0] != 0xfa || data[1] != 0xab)
 		goto err;
 
+	mpsse_io_buffer_release(&io);
 	return 0;
 
 err:
@@ -187,24 +350,352 @@ err:
 
 int mpsse_submit(struct mpsse *mpsse, struct mpsse_io_buffer *io)
 {
-	if (io->cmd_size != 0 &&
-	    ftdi_write_exactly(mpsse->handle, io->cmd, io->cmd_size) < 0)
+	struct mpsse_request req;
+
+	if (mpsse_submit_async(mpsse, io, &req, NULL, NULL) != 0)
+		return -1;
+	return mpsse_wait(mpsse, &req);
+}
+
+// Finds the size of the MPSSE command at the beginning of the buffer and the
+// amount of data the MPSSE returns in response to the command. Opcodes the
+// MPSSE doesn't know are answered with 0xfa followed by the opcode.
+static void mpsse_decode(
+	const unsigned char *cmd,
+	unsigned size,
+	unsigned *cmd_size,
+	unsigned *data_size)
+{
+	const unsigned char op = cmd[0];
+	unsigned len = 0;
+
+	*cmd_size = 1;
+	*data_size = 0;
+
+	if (op & 0x80) {
+		switch (op) {
+		case 0x80:
+		case 0x82:
+		case 0x86:
+		case 0x8f:
+		case 0x9c:
+		case 0x9d:
+		case 0x9e:
+			*cmd_size = 3;
+			break;
+		case 0x8e:
+			*cmd_size = 2;
+			break;
+		case 0x81:
+		case 0x83:
+			*data_size = 1;
+			break;
+		case 0x84:
+		case 0x85:
+		case 0x87:
+		case 0x88:
+		case 0x89:
+		case 0x8a:
+		case 0x8b:
+		case 0x8c:
+		case 0x8d:
+		case 0x94:
+		case 0x95:
+		case 0x96:
+		case 0x97:
+			break;
+		default:
+			*data_size = 2;
+			break;
+		}
+	} else if (op & 0x40) {
+		// TMS commands always take the number of bits and one byte of
+		// data, even though the write bit is not set.
+		*cmd_size = 3;
+		*data_size = op & 0x20 ? 1 : 0;
+	} else if (!(op & 0x30)) {
+		// Data shifting command that neither writes nor reads.
+		*data_size = 2;
+	} else if (op & 0x02) {
+		// Bit mode commands take the number of bits and, if they
+		// write, one byte of data.
+		*cmd_size = op & 0x10 ? 3 : 2;
+		*data_size = op & 0x20 ? 1 : 0;
+	} else {
+		if (size >= 3)
+			len = ((unsigned)cmd[1] | ((unsigned)cmd[2] << 8)) + 1;
+		*cmd_size = op & 0x10 ? 3 + len : 3;
+		*data_size = op & 0x20 ? len : 0;
+	}
+
+	if (*cmd_size > size)
+		*cmd_size = size;
+}
+
+// Sends the commands of the pending requests to the device as long as the
+// responses fit into the RX FIFO. Returns a negative value if the
+// communication with the device failed and 0 otherwise.
+static int mpsse_send(struct mpsse *mpsse)
+{
+	struct mpsse_request *req;
+
+	while ((req = mpsse->pending)) {
+		struct mpsse_io_buffer *io = req->io;
+		const unsigned char *cmd = io->cmd;
+		const unsigned total = io->data_size + io->sink_size;
+		unsigned begin = req->written;
+		unsigned end = begin;
+		unsigned expected = 0;
+		unsigned char last = 0;
+
+		while (end < io->cmd_size && end - begin < MPSSE_CHUNK_SIZE) {
+			unsigned cmd_size, data_size;
+
+			mpsse_decode(cmd + end, io->cmd_size - end,
+				     &cmd_size, &data_size);
+			// A single command that returns more than the RX FIFO
+			// holds is fine as long as nothing else is in flight,
+			// since we start reading right after sending it.
+			if (mpsse->in_flight + expected + data_size >
+					MPSSE_RX_WINDOW &&
+			    (end != begin || mpsse->in_flight != 0))
+				break;
+
+			last = cmd[end];
+			end += cmd_size;
+			expected += data_size;
+		}
+
+		if (end != begin &&
+		    transport_write(mpsse->transport, cmd + begin,
+				    end - begin) < 0)
+			return -1;
+
+		if (expected != 0)
+			mpsse->flushed = 0;
+		if (end != begin && last == 0x87)
+			mpsse->flushed = 1;
+
+		// The decoded amount of data must agree with the MPSSE IO
+		// buffer, unless somebody put garbage into the commands.
+		if (expected > total - req->expected)
+			expected = total - req->expected;
+		if (end == io->cmd_size)
+			expected = total - req->expected;
+
+		req->written = end;
+		req->expected += expected;
+		mpsse->in_flight += expected;
+
+		if (end != io->cmd_size)
+			break;
+		mpsse->pending = req->next;
+	}
+
+	return 0;
+}
+
+// Asks the device to send back the responses it holds, so we don't have to
+// wait for the latency timer to expire.
+static int mpsse_flush(struct mpsse *mpsse)
+{
+	const unsigned char op = 0x87;
+
+	if (mpsse->flushed)
+		return 0;
+
+	if (transport_write(mpsse->transport, &op, sizeof(op)) < 0)
 		return -1;
+	mpsse->flushed = 1;
+	return 0;
+}
 
-	// Basically no error handling here. YOLO!
-	if (io->data_size != 0 &&
-	    ftdi_read_exactly(mpsse->handle, io->data, io->data_size) < 0)
+int mpsse_submit_async(
+	struct mpsse *mpsse,
+	struct mpsse_io_buffer *io,
+	struct mpsse_request *req,
+	mpsse_callback callback,
+	void *arg)
+{
+	if (io->error)
+		return -1;
+
+	req->io = io;
+	req->callback = callback;
+	req->arg = arg;
+	req->written = 0;
+	req->expected = 0;
+	req->received = 0;
+	req->sink = 0;
+	req->sunk = 0;
+	req->done = 0;
+	req->status = 0;
+	req->next = NULL;
+	if (mpsse->tail)
+		mpsse->tail->next = req;
+	else
+		mpsse->head = req;
+	mpsse->tail = req;
+	if (!mpsse->pending)
+		mpsse->pending = req;
+
+	if (mpsse_send(mpsse) != 0) {
+		// We don't know how much of the commands the device got, so
+		// the responses of the requests in flight can't be trusted.
+		req->callback = NULL;
+		mpsse_fail(mpsse);
 		return -1;
+	}
 
 	return 0;
 }
 
+// Finds where the data at the current position of the request goes, either
+// a sink or the data area, and limits the size to the data that goes there.
+static unsigned char *mpsse_destination(
+	struct mpsse_request *req, unsigned *size)
+{
+	const struct mpsse_io_buffer *io = req->io;
+	const struct mpsse_sink *sink = NULL;
+
+	if (req->sink < io->sink_count)
+		sink = &io->sinks[req->sink];
+
+	if (sink && sink->offset <= req->received) {
+		const unsigned pos = req->received - sink->offset;
+
+		if (*size > sink->size - pos)
+			*size = sink->size - pos;
+		return (unsigned char *)sink->buf + pos;
+	}
+
+	if (sink && *size > sink->offset - req->received)
+		*size = sink->offset - req->received;
+	return (unsigned char *)io->data + req->received - req->sunk;
+}
+
+// Accounts for size bytes of data that arrived at the current position of
+// the request.
+static void mpsse_advance(struct mpsse_request *req, unsigned size)
+{
+	const struct mpsse_io_buffer *io = req->io;
+
+	if (req->sink < io->sink_count &&
+	    io->sinks[req->sink].offset <= req->received) {
+		const struct mpsse_sink *sink = &io->sinks[req->sink];
+
+		req->sunk += size;
+		if (req->received + size == sink->offset + sink->size)
+			++req->sink;
+	}
+	req->received += size;
+}
+
+// Receives the data for the request at the head of the queue sending more
+// commands as the responses arrive. If block is 0 takes only the data that
+// already arrived, otherwise waits for all the data of the request. Returns 1
+// if the request completed, 0 if it's still in flight and a negative value if
+// the communication with the device failed.
+static int mpsse_receive(struct mpsse *mpsse, int block)
+{
+	struct mpsse_request *req = mpsse->head;
+	struct mpsse_io_buffer *io = req->io;
+	const unsigned total = io->data_size + io->sink_size;
+	int ret;
+
+	while (req->received < total) {
+		unsigned char *data;
+		unsigned size;
+
+		if (mpsse_send(mpsse) != 0)
+			return -1;
+
+		// Read at most half of the window at a time, so the device has
+		// the commands to work on while we are waiting for the rest.
+		size = req->expected - req->received;
+		if (size > MPSSE_RX_WINDOW / 2)
+			size = MPSSE_RX_WINDOW / 2;
+		data = mpsse_destination(req, &size);
+
+		if (block) {
+			if (mpsse_flush(mpsse) != 0)
+				return -1;
+			ret = transport_read_exactly(
+				mpsse->transport, data, size, mpsse->spin);
+		} else {
+			ret = transport_read(mpsse->transport, data, size);
+		}
+		if (ret < 0)
+			return -1;
+		if (ret == 0)
+			break;
+		mpsse_advance(req, ret);
+		mpsse->in_flight -= ret;
+	}
+
+	if (req->received < total)
+		return 0;
+
+	// Commands that don't return anything may follow the last response.
+	while (req->written < io->cmd_size) {
+		if (mpsse_send(mpsse) != 0)
+			return -1;
+	}
+
+	mpsse_complete(mpsse, req, 0);
+	return 1;
+}
+
+int mpsse_poll(struct mpsse *mpsse)
+{
+	int completed = 0;
+
+	while (mpsse->head) {
+		const int ret = mpsse_receive(mpsse, 0);
+
+		if (ret < 0) {
+			mpsse_fail(mpsse);
+			return -1;
+		}
+
+		if (ret == 0)
+			break;
+		++completed;
+	}
+
+	return completed;
+}
+
+int mpsse_wait(struct mpsse *mpsse, struct mpsse_request *req)
+{
+	while (!req->done) {
+		// The request has never been submitted.
+		if (!mpsse->head)
+			return -1;
+
+		if (mpsse_receive(mpsse, 1) < 0)
+			mpsse_fail(mpsse);
+	}
+
+	return req->status;
+}
+
+int mpsse_fd(struct mpsse *mpsse)
+{
+	return transport_fd(mpsse->transport);
+}
+
+void mpsse_set_spin(struct mpsse *mpsse, unsigned spin)
+{
+	mpsse->spin = spin;
+}
 
 void mpsse_disable_freq_div5(struct mpsse_io_buffer *io, struct mpsse_cmd *out)
 {
 	struct mpsse_cmd cmd;
 
-	mpsse_cmd_prepare(io, &cmd, 1, 0);
+	if (mpsse_cmd_prepare(io, &cmd, 1, 0, out) != 0)
+		return;
 	*((unsigned char *)mpsse_cmd(&cmd)) = 0x8a;
 	if (out)
 		*out = cmd;
@@ -216,17 +707,30 @@ void mpsse_disable_adaptive_clocking(
 {
 	struct mpsse_cmd cmd;
 
-	mpsse_cmd_prepare(io, &cmd, 1, 0);
+	if (mpsse_cmd_prepare(io, &cmd, 1, 0, out) != 0)
+		return;
 	*((unsigned char *)mpsse_cmd(&cmd)) = 0x97;
 	if (out)
 		*out = cmd;
 }
 
+void mpsse_enable_loopback(struct mpsse_io_buffer *io, struct mpsse_cmd *out)
+{
+	struct mpsse_cmd cmd;
+
+	if (mpsse_cmd_prepare(io, &cmd, 1, 0, out) != 0)
+		return;
+	*((unsigned char *)mpsse_cmd(&cmd)) = 0x84;
+	if (out)
+		*out = cmd;
+}
+
 void mpsse_disable_loopback(struct mpsse_io_buffer *io, struct mpsse_cmd *out)
 {
 	struct mpsse_cmd cmd;
 
-	mpsse_cmd_prepare(io, &cmd, 1, 0);
+	if (mpsse_cmd_prepare(io, &cmd, 1, 0, out) != 0)
+		return;
 	*((unsigned char *)mpsse_cmd(&cmd)) = 0x85;
 	if (out)
 		*out = cmd;
@@ -237,19 +741,33 @@ void mpsse_enable_3phase_clocking(
 {
 	struct mpsse_cmd cmd;
 
-	mpsse_cmd_prepare(io, &cmd, 1, 0);
+	if (mpsse_cmd_prepare(io, &cmd, 1, 0, out) != 0)
+		return;
 	*((unsigned char *)mpsse_cmd(&cmd)) = 0x8c;
 	if (out)
 		*out = cmd;
 }
 
+void mpsse_disable_3phase_clocking(
+	struct mpsse_io_buffer *io, struct mpsse_cmd *out)
+{
+	struct mpsse_cmd cmd;
+
+	if (mpsse_cmd_prepare(io, &cmd, 1, 0, out) != 0)
+		return;
+	*((unsigned char *)mpsse_cmd(&cmd)) = 0x8d;
+	if (out)
+		*out = cmd;
+}
+
 void mpsse_set_drive0_pins(
 	struct mpsse_io_buffer *io, unsigned pinmask, struct mpsse_cmd *out)
 {
 	struct mpsse_cmd cmd;
 	unsigned char *buf;
 
-	mpsse_cmd_prepare(io, &cmd, 3, 0);
+	if (mpsse_cmd_prepare(io, &cmd, 3, 0, out) != 0)
+		return;
 	buf = mpsse_cmd(&cmd);
 	buf[0] = 0x9e;
 	buf[1] = pinmask & 0xff;
@@ -265,7 +783,8 @@ void mpsse_set_freq_divisor(
 	unsigned char *buf;
 
 	assert(divisor <= 0xffff);
-	mpsse_cmd_prepare(io, &cmd, 3, 0);
+	if (mpsse_cmd_prepare(io, &cmd, 3, 0, out) != 0)
+		return;
 	buf = mpsse_cmd(&cmd);
 	buf[0] = 0x86;
 	buf[1] = divisor & 0xff;
@@ -283,7 +802,8 @@ void mpsse_set_output(
 	struct mpsse_cmd cmd;
 	unsigned char *buf;
 
-	mpsse_cmd_prepare(io, &cmd, 6, 0);
+	if (mpsse_cmd_prepare(io, &cmd, 6, 0, out) != 0)
+		return;
 	buf = mpsse_cmd(&cmd);
 	buf[0] = 0x80;
 	buf[1] = pinvals & 0xff;
@@ -305,12 +825,13 @@ void mpsse_write_bytes(
 	unsigned char *buf;
 
 	if (size == 0) {
-		if (out) mpsse_cmd_prepare(io, out, 0, 0);
+		if (out) mpsse_cmd_prepare(io, out, 0, 0, NULL);
 		return;
 	}
 
 	assert(size <= 0xffff);
-	mpsse_cmd_prepare(io, &cmd, 3 + size, 0);
+	if (mpsse_cmd_prepare(io, &cmd, 3 + size, 0, out) != 0)
+		return;
 	buf = mpsse_cmd(&cmd);
 	buf[0] = 0x11;
 	buf[1] = (size - 1) & 0xff;
@@ -327,12 +848,13 @@ void mpsse_read_bytes(
 	unsigned char *buf;
 
 	if (size == 0) {
-		if (out) mpsse_cmd_prepare(io, out, 0, 0);
+		if (out) mpsse_cmd_prepare(io, out, 0, 0, NULL);
 		return;
 	}
 
 	assert(size <= 0xffff);
-	mpsse_cmd_prepare(io, &cmd, 4, size);
+	if (mpsse_cmd_prepare(io, &cmd, 4, size, out) != 0)
+		return;
 	buf = mpsse_cmd(&cmd);
 	buf[0] = 0x20;
 	buf[1] = (size - 1) & 0xff;
@@ -342,6 +864,198 @@ void mpsse_read_bytes(
 		*out = cmd;
 }
 
+void mpsse_read_iov(
+	struct mpsse_io_buffer *io,
+	const struct iovec *iov,
+	unsigned iovcnt,
+	struct mpsse_cmd *out)
+{
+	const unsigned cmd_offset = io->cmd_size;
+	unsigned size = 0;
+	struct mpsse_cmd cmd;
+
+	for (unsigned i = 0; i < iovcnt; ++i) {
+		unsigned char *dst = iov[i].iov_base;
+		size_t left = iov[i].iov_len;
+
+		while (left != 0) {
+			const unsigned n = left < 0x10000 ? left : 0x10000;
+
+			mpsse_shift_bytes_to(
+				io, MPSSE_SHIFT_IN, NULL, dst, n, NULL);
+			dst += n;
+			left -= n;
+			size += n;
+		}
+	}
+
+	if (size == 0) {
+		if (out) mpsse_cmd_prepare(io, out, 0, 0, NULL);
+		return;
+	}
+
+	if (mpsse_cmd_prepare(io, &cmd, 1, 0, out) != 0)
+		return;
+	*((unsigned char *)mpsse_cmd(&cmd)) = 0x87;
+
+	// The command covers all the shifts and the send immediate.
+	cmd.cmd_offset = cmd_offset;
+	cmd.cmd_size = io->cmd_size - cmd_offset;
+	if (out)
+		*out = cmd;
+}
+
+static void mpsse_shift(
+	struct mpsse_io_buffer *io,
+	unsigned mode,
+	const void *data,
+	void *dst,
+	unsigned size,
+	struct mpsse_cmd *out)
+{
+	const int write = (mode & MPSSE_SHIFT_OUT) != 0;
+	const int read = (mode & MPSSE_SHIFT_IN) != 0;
+	struct mpsse_cmd cmd;
+	unsigned char *buf;
+
+	if (size == 0) {
+		if (out) mpsse_cmd_prepare(io, out, 0, 0, NULL);
+		return;
+	}
+
+	assert(size <= 0x10000);
+	assert((mode & ~MPSSE_SHIFT_MASK) == 0 && (write || read));
+	if (mpsse_cmd_prepare(io, &cmd, write ? 3 + size : 3,
+			      read && !dst ? size : 0, out) != 0)
+		return;
+	if (dst && mpsse_io_buffer_sink(io, dst, size) != 0) {
+		if (out) mpsse_cmd_prepare(io, out, 0, 0, NULL);
+		return;
+	}
+	buf = mpsse_cmd(&cmd);
+	buf[0] = mode;
+	buf[1] = (size - 1) & 0xff;
+	buf[2] = ((size - 1) >> 8) & 0xff;
+	if (write)
+		memcpy(&buf[3], data, size);
+	if (out)
+		*out = cmd;
+}
+
+void mpsse_shift_bytes(
+	struct mpsse_io_buffer *io,
+	unsigned mode,
+	const void *data,
+	unsigned size,
+	struct mpsse_cmd *out)
+{
+	mpsse_shift(io, mode, data, NULL, size, out);
+}
+
+void mpsse_shift_bytes_to(
+	struct mpsse_io_buffer *io,
+	unsigned mode,
+	const void *data,
+	void *dst,
+	unsigned size,
+	struct mpsse_cmd *out)
+{
+	assert(mode & MPSSE_SHIFT_IN);
+	mpsse_shift(io, mode, data, dst, size, out);
+}
+
+void mpsse_shift_bits(
+	struct mpsse_io_buffer *io,
+	unsigned mode,
+	unsigned char data,
+	unsigned bits,
+	struct mpsse_cmd *out)
+{
+	const int write = (mode & MPSSE_SHIFT_OUT) != 0;
+	const int read = (mode & MPSSE_SHIFT_IN) != 0;
+	struct mpsse_cmd cmd;
+	unsigned char *buf;
+
+	if (bits == 0) {
+		if (out) mpsse_cmd_prepare(io, out, 0, 0, NULL);
+		return;
+	}
+
+	assert(bits <= 8);
+	assert((mode & ~MPSSE_SHIFT_MASK) == 0 && (write || read));
+	if (mpsse_cmd_prepare(io, &cmd, write ? 3 : 2, read ? 1 : 0, out) != 0)
+		return;
+	buf = mpsse_cmd(&cmd);
+	buf[0] = mode | 0x02;
+	buf[1] = (bits - 1) & 0xff;
+	if (write)
+		buf[2] = data;
+	if (out)
+		*out = cmd;
+}
+
+void mpsse_shift_tms(
+	struct mpsse_io_buffer *io,
+	unsigned mode,
+	unsigned char tms,
+	unsigned bits,
+	int tdi,
+	struct mpsse_cmd *out)
+{
+	const int read = (mode & MPSSE_SHIFT_IN) != 0;
+	struct mpsse_cmd cmd;
+	unsigned char *buf;
+
+	if (bits == 0) {
+		if (out) mpsse_cmd_prepare(io, out, 0, 0, NULL);
+		return;
+	}
+
+	assert(bits <= 7);
+	assert((mode & ~(MPSSE_SHIFT_OUT_NEG | MPSSE_SHIFT_IN_NEG |
+			 MPSSE_SHIFT_IN)) == 0);
+	if (mpsse_cmd_prepare(io, &cmd, 3, read ? 1 : 0, out) != 0)
+		return;
+	buf = mpsse_cmd(&cmd);
+	buf[0] = 0x4a | mode;
+	buf[1] = (bits - 1) & 0xff;
+	buf[2] = (tms & 0x7f) | (tdi ? 0x80 : 0x00);
+	if (out)
+		*out = cmd;
+}
+
+void mpsse_clock(
+	struct mpsse_io_buffer *io, unsigned cycles, struct mpsse_cmd *out)
+{
+	struct mpsse_cmd cmd;
+	unsigned char *buf;
+
+	if (out) mpsse_cmd_prepare(io, out, 0, 0, NULL);
+
+	// 0x8f clocks multiples of 8 cycles and 0x8e clocks up to 8 cycles.
+	while (cycles >= 8) {
+		unsigned bytes = cycles / 8;
+
+		if (bytes > 0x10000)
+			bytes = 0x10000;
+		if (mpsse_cmd_prepare(io, &cmd, 3, 0, NULL) != 0)
+			return;
+		buf = mpsse_cmd(&cmd);
+		buf[0] = 0x8f;
+		buf[1] = (bytes - 1) & 0xff;
+		buf[2] = ((bytes - 1) >> 8) & 0xff;
+		cycles -= bytes * 8;
+	}
+
+	if (cycles == 0)
+		return;
+	if (mpsse_cmd_prepare(io, &cmd, 2, 0, NULL) != 0)
+		return;
+	buf = mpsse_cmd(&cmd);
+	buf[0] = 0x8e;
+	buf[1] = (cycles - 1) & 0xff;
+}
+
 void mpsse_write_bits(
 	struct mpsse_io_buffer *io,
 	unsigned char data,
@@ -352,12 +1066,13 @@ void mpsse_write_bits(
 	unsigned char *buf;
 
 	if (bits == 0) {
-		if (out) mpsse_cmd_prepare(io, out, 0, 0);
+		if (out) mpsse_cmd_prepare(io, out, 0, 0, NULL);
 		return;
 	}
 
 	assert(bits <= 8);
-	mpsse_cmd_prepare(io, &cmd, 3, 0);
+	if (mpsse_cmd_prepare(io, &cmd, 3, 0, out) != 0)
+		return;
 	buf = mpsse_cmd(&cmd);
 	buf[0] = 0x13;
 	buf[1] = (bits - 1) & 0xff;
@@ -373,12 +1088,13 @@ void mpsse_read_bits(
 	unsigned char *buf;
 
 	if (bits == 0) {
-		if (out) mpsse_cmd_prepare(io, out, 0, 0);
+		if (out) mpsse_cmd_prepare(io, out, 0, 0, NULL);
 		return;
 	}
 
 	assert(bits <= 8);
-	mpsse_cmd_prepare(io, &cmd, 3, 1);
+	if (mpsse_cmd_prepare(io, &cmd, 3, 1, out) != 0)
+		return;
 	buf = mpsse_cmd(&cmd);
 	buf[0] = 0x22;
 	buf[1] = (bits - 1) & 0xff;
@@ -387,3 +1103,174 @@ void mpsse_read_bits(
 		*out = cmd;
 }
 
+
+// State of the pins according to the pin writes seen so far.
+struct mpsse_pins {
+	int known;
+	unsigned char val;
+	unsigned char dir;
+};
+
+static void mpsse_track_pins(struct mpsse_pins *pins, const unsigned char *cmd)
+{
+	const unsigned char op = cmd[0];
+
+	switch (op) {
+	case 0x80:
+	case 0x82:
+		pins[op == 0x82].known = 1;
+		pins[op == 0x82].val = cmd[1];
+		pins[op == 0x82].dir = cmd[2];
+		break;
+	case 0x8e:
+	case 0x8f:
+	case 0x9c:
+	case 0x9d:
+		pins[0].known = 0;
+		break;
+	case 0x9e:
+		pins[0].known = 0;
+		pins[1].known = 0;
+		break;
+	default:
+		// Data shifting commands move the clock and data pins.
+		if (!(op & 0x80))
+			pins[0].known = 0;
+		break;
+	}
+}
+
+static int mpsse_pins_noop(
+	const struct mpsse_pins *pins, const unsigned char *cmd)
+{
+	const struct mpsse_pins *p = &pins[cmd[0] == 0x82];
+
+	return p->known && p->val == cmd[1] && p->dir == cmd[2];
+}
+
+// Byte shifting commands that don't use TMS can be merged together.
+static int mpsse_mergeable(unsigned char op)
+{
+	return !(op & 0x80) && !(op & 0x42) && (op & 0x30);
+}
+
+static unsigned mpsse_shift_len(const unsigned char *cmd)
+{
+	return ((unsigned)cmd[1] | ((unsigned)cmd[2] << 8)) + 1;
+}
+
+// Returns non-0 if the byte shifting command isn't cut short by the end of
+// the buffer.
+static int mpsse_shift_complete(const unsigned char *cmd, unsigned cmd_size)
+{
+	if (cmd_size < 3)
+		return 0;
+	return cmd_size == (cmd[0] & 0x10 ? 3 + mpsse_shift_len(cmd) : 3);
+}
+
+static void mpsse_remap(
+	const unsigned *offsets,
+	unsigned *mapped,
+	unsigned count,
+	unsigned begin,
+	unsigned end,
+	unsigned to)
+{
+	for (unsigned i = 0; i < count; ++i) {
+		if (offsets[i] < begin || offsets[i] >= end)
+			continue;
+		mapped[i] = to == UINT_MAX ? UINT_MAX : to + offsets[i] - begin;
+	}
+}
+
+int mpsse_optimize(
+	struct mpsse_io_buffer *io,
+	unsigned flags,
+	unsigned *offsets,
+	unsigned count)
+{
+	struct mpsse_pins pins[2] = {{0, 0, 0}, {0, 0, 0}};
+	unsigned char *cmd = io->cmd;
+	unsigned in = 0, out = 0;
+	// Offset of the last command we kept if it can be merged with the next
+	// one and UINT_MAX otherwise.
+	unsigned last = UINT_MAX;
+	unsigned *mapped = NULL;
+	int flush = 0;
+
+	if (io->error)
+		return -1;
+
+	if (count != 0) {
+		mapped = malloc(count * sizeof(*mapped));
+		if (!mapped)
+			return -1;
+		for (unsigned i = 0; i < count; ++i)
+			mapped[i] = UINT_MAX;
+	}
+
+	// The commands only get shorter, so we can rewrite them in place.
+	while (in < io->cmd_size) {
+		const unsigned char op = cmd[in];
+		unsigned cmd_size, data_size;
+
+		mpsse_decode(
+			cmd + in, io->cmd_size - in, &cmd_size, &data_size);
+
+		if ((flags & MPSSE_OPT_FLUSH) && op == 0x87) {
+			flush = 1;
+			in += cmd_size;
+			continue;
+		}
+
+		if ((flags & MPSSE_OPT_PINS) && (op == 0x80 || op == 0x82) &&
+		    cmd_size == 3 && mpsse_pins_noop(pins, cmd + in)) {
+			in += cmd_size;
+			continue;
+		}
+
+		mpsse_track_pins(pins, cmd + in);
+
+		if ((flags & MPSSE_OPT_MERGE) && last != UINT_MAX &&
+		    cmd[last] == op &&
+		    mpsse_shift_complete(cmd + in, cmd_size) &&
+		    mpsse_shift_len(cmd + last) + mpsse_shift_len(cmd + in) <=
+				0x10000) {
+			const unsigned len = mpsse_shift_len(cmd + last) +
+					     mpsse_shift_len(cmd + in);
+			const unsigned payload = cmd_size - 3;
+
+			// The last command we kept ends right where the output
+			// ends, so the data of this one just follows it.
+			memmove(cmd + out, cmd + in + 3, payload);
+			mpsse_remap(
+				offsets, mapped, count, in, in + 3, UINT_MAX);
+			mpsse_remap(offsets, mapped, count,
+				    in + 3, in + cmd_size, out);
+			cmd[last + 1] = (len - 1) & 0xff;
+			cmd[last + 2] = ((len - 1) >> 8) & 0xff;
+			out += payload;
+			in += cmd_size;
+			continue;
+		}
+
+		memmove(cmd + out, cmd + in, cmd_size);
+		mpsse_remap(offsets, mapped, count, in, in + cmd_size, out);
+		last = UINT_MAX;
+		if (mpsse_mergeable(op) &&
+		    mpsse_shift_complete(cmd + out, cmd_size))
+			last = out;
+		out += cmd_size;
+		in += cmd_size;
+	}
+
+	// We dropped at least one byte, so there is space for it.
+	if (flush)
+		cmd[out++] = 0x87;
+	io->cmd_size = out;
+
+	for (unsigned i = 0; i < count; ++i)
+		offsets[i] = mapped[i];
+	free(mapped);
+	return 0;
+}
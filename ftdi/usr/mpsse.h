@@ -2,13 +2,34 @@
 #ifndef __MPSSE_H__
 #define __MPSSE_H__
 
+#include <sys/uio.h>
+
 #include "ftdi.h"
+#include "transport.h"
 
 // MPSSE IO buffer just manages memory for the commands we want to send to
 // the MPSSE and for the expected results.
 // 
 // One way to look at the MPSSE IO buffer is that it's a collection of commands
 // that we want to send to the MPSSE in one batch.
+//
+// The commands and the data share one arena that grows geometrically, typical
+// small batches fit into the inline storage and don't touch the heap at all.
+// Reset keeps the memory, so an MPSSE IO buffer reused across submissions
+// stops allocating once it reached the size of the largest batch. Since the
+// arena may point to the inline storage MPSSE IO buffer must not be copied.
+#define MPSSE_IO_INLINE_CMD_SIZE 224
+#define MPSSE_IO_INLINE_DATA_SIZE 32
+
+// Part of the data returned by the device that goes straight to the caller
+// memory instead of the data area of the MPSSE IO buffer, offset is the
+// position of the part in the data returned by all the commands.
+struct mpsse_sink {
+	unsigned offset;
+	void *buf;
+	unsigned size;
+};
+
 struct mpsse_io_buffer {
 	void *cmd;
 	unsigned cmd_size;
@@ -17,18 +38,78 @@ struct mpsse_io_buffer {
 	void *data;
 	unsigned data_size;
 	unsigned data_capacity;
+
+	// The commands occupy the first cmd_capacity bytes of the arena and the
+	// data occupy the following data_capacity bytes.
+	unsigned char *arena;
+	// Sinks in the order of their offsets and the amount of data they
+	// take, the data area only holds the rest of the data.
+	struct mpsse_sink *sinks;
+	unsigned sink_count;
+	unsigned sink_capacity;
+	unsigned sink_size;
+	// Non-0 if we failed to allocate memory for one of the commands, such
+	// MPSSE IO buffer cannot be submitted until it's reset.
+	int error;
+	unsigned char storage[
+		MPSSE_IO_INLINE_CMD_SIZE + MPSSE_IO_INLINE_DATA_SIZE];
 };
 
 void mpsse_io_buffer_setup(struct mpsse_io_buffer *io);
 void mpsse_io_buffer_reset(struct mpsse_io_buffer *io);
 void mpsse_io_buffer_release(struct mpsse_io_buffer *io);
 
+// Makes sure that the MPSSE IO buffer can hold at least cmd_size bytes of
+// commands and data_size bytes of data without further allocations. Returns
+// 0 on success and a non-0 value otherwise.
+int mpsse_io_buffer_reserve(
+	struct mpsse_io_buffer *io, unsigned cmd_size, unsigned data_size);
+
+
+struct mpsse_request;
+
+// The MPSSE stops executing commands once its RX FIFO is full and nobody reads
+// the responses. If at that point the host is still busy writing the
+// commands, and not reading, neither side can make progress. To avoid that
+// the commands are sent in chunks split at the command boundaries and the
+// responses to the commands sent, but not yet received, never exceed the size
+// of the FT232H RX FIFO, the rest of the commands are sent as the responses
+// arrive. MPSSE_CHUNK_SIZE limits the size of a single write, so we get a
+// chance to read the responses while sending a long batch.
+#define MPSSE_RX_WINDOW 1024
+#define MPSSE_CHUNK_SIZE 4096
 
 struct mpsse {
-	FT_HANDLE handle;
+	struct transport *transport;
+	// How many times to check for the responses before going to sleep.
+	unsigned spin;
+	// Requests that have been sent to the device, but haven't completed
+	// yet, in the order they were sent. The device executes the commands
+	// in order, so the responses arrive in the same order.
+	struct mpsse_request *head;
+	struct mpsse_request *tail;
+	// The first request which commands haven't been completely sent to
+	// the device yet, all the following requests haven't been sent at all.
+	struct mpsse_request *pending;
+	// Amount of data the device owes us for the commands sent so far.
+	unsigned in_flight;
+	// 0 if the device might hold the responses in its buffer waiting for
+	// more, in that case we have to ask the device to send them before
+	// waiting for them.
+	int flushed;
 };
 
+#ifdef TRANSPORT_D2XX
+// Opens the device with the given serial number through the D2XX driver.
 int mpsse_open(const struct serial *serial, struct mpsse *mpsse);
+#endif
+// Opens the device through the transport described by the spec, see
+// transport_open for the format of the spec.
+int mpsse_open_spec(const char *spec, struct mpsse *mpsse);
+// Switches the device behind the transport into the MPSSE mode. On success
+// MPSSE takes ownership of the transport, on failure the transport is
+// closed.
+int mpsse_open_transport(struct transport *transport, struct mpsse *mpsse);
 int mpsse_close(struct mpsse *mpsse);
 
 // Reset will reset the device to it's initial state and drain all the device
@@ -42,11 +123,82 @@ int mpsse_verify(struct mpsse *mpsse);
 
 // Executes the commands described by the MPSSE IO buffer. If the function
 // completes successfully it returns 0, otherwise a non-0 value is returned.
+// Submitting an MPSSE IO buffer that failed to allocate memory for one of the
+// commands fails without sending anything to the device.
 // If the execution fails you should not expect that the device will be in
 // any particular state, so if you want to continue using it you should reset.
 int mpsse_submit(struct mpsse *mpsse, struct mpsse_io_buffer *io);
 
 
+// Callback that is called when an asynchronously submitted MPSSE IO buffer
+// completes. status is 0 on success and a non-0 value otherwise.
+typedef void (*mpsse_callback)(
+	struct mpsse_request *req, int status, void *arg);
+
+// MPSSE request tracks an MPSSE IO buffer submitted with mpsse_submit_async.
+// The memory for the request is provided by the caller and it, as well as
+// the MPSSE IO buffer, must not be touched until the request completes.
+struct mpsse_request {
+	struct mpsse_io_buffer *io;
+	mpsse_callback callback;
+	void *arg;
+	// Amount of commands sent to the device so far and the amount of data
+	// these commands return.
+	unsigned written;
+	unsigned expected;
+	// Amount of data received for the request so far, the sink the data
+	// goes to next and the amount of data that went to the sinks.
+	unsigned received;
+	unsigned sink;
+	unsigned sunk;
+	// Non-0 once the request completed, status is only valid after that.
+	int done;
+	int status;
+	struct mpsse_request *next;
+};
+
+// Sends the commands described by the MPSSE IO buffer to the device and
+// returns without waiting for the response. Multiple requests may be in
+// flight at the same time, this way the caller can prepare the next batch
+// of commands while the device executes the previous one.
+//
+// Only as many commands as the device can respond to without stalling are
+// sent right away, the rest are sent from mpsse_poll and mpsse_wait as the
+// responses arrive, so there is no limit on the size of the batch.
+//
+// The requests complete in the order they were submitted from mpsse_poll or
+// mpsse_wait, the callback, if not NULL, is called at that point.
+//
+// If the function fails the request is not submitted, and the callback will
+// not be called. Returns 0 on success and a non-0 value otherwise.
+int mpsse_submit_async(
+	struct mpsse *mpsse,
+	struct mpsse_io_buffer *io,
+	struct mpsse_request *req,
+	mpsse_callback callback,
+	void *arg);
+
+// Completes all the requests which data has already arrived without
+// blocking. Returns the number of completed requests or a negative value if
+// the communication with the device failed, in which case all the requests in
+// flight complete with an error.
+int mpsse_poll(struct mpsse *mpsse);
+
+// Waits until the request and all the requests submitted before it complete.
+// Returns the status of the request.
+int mpsse_wait(struct mpsse *mpsse, struct mpsse_request *req);
+
+// Returns a file descriptor that can be used with poll/epoll to find out when
+// there are responses to process, this way one thread can serve many MPSSE
+// devices. When the file descriptor becomes readable call mpsse_poll.
+// Returns a negative value on error or if the transport doesn't support it.
+int mpsse_fd(struct mpsse *mpsse);
+
+// Sets how many times mpsse_wait checks for the responses before going to
+// sleep, 0 by default.
+void mpsse_set_spin(struct mpsse *mpsse, unsigned spin);
+
+
 // MPSSE command is a handler that allows access to the command data itself
 // as well as the data that was read from the device if any after the command
 // has been executed.
@@ -67,6 +219,37 @@ struct mpsse_cmd {
 void *mpsse_cmd(struct mpsse_cmd *cmd);
 void *mpsse_data(struct mpsse_cmd *cmd);
 
+
+// Optimizations mpsse_optimize can apply:
+//   * MPSSE_OPT_PINS - drop the pin writes that set the pins to the state
+//     they already have according to the previous pin writes in the same
+//     MPSSE IO buffer, note that pin writes repeated to hold the pins for
+//     longer are dropped as well;
+//   * MPSSE_OPT_MERGE - merge adjacent byte shifting commands with the same
+//     opcode into one command;
+//   * MPSSE_OPT_FLUSH - drop all the send immediate commands, but add one at
+//     the end of the MPSSE IO buffer.
+#define MPSSE_OPT_PINS 0x1u
+#define MPSSE_OPT_MERGE 0x2u
+#define MPSSE_OPT_FLUSH 0x4u
+#define MPSSE_OPT_ALL (MPSSE_OPT_PINS | MPSSE_OPT_MERGE | MPSSE_OPT_FLUSH)
+
+// Rewrites the commands in the MPSSE IO buffer into a shorter equivalent
+// sequence. The commands produce exactly the same data as before, so the
+// data of the MPSSE commands stays valid, but the commands themselves move,
+// so mpsse_cmd must not be used after the optimization.
+//
+// If the caller needs to patch some bytes of the commands later, it can
+// pass their offsets in the offsets array, the function replaces them with
+// the new offsets of the same bytes or UINT_MAX if the byte was dropped.
+// Returns 0 on success and a non-0 value otherwise, in which case the MPSSE
+// IO buffer is not modified.
+int mpsse_optimize(
+	struct mpsse_io_buffer *io,
+	unsigned flags,
+	unsigned *offsets,
+	unsigned count);
+
 // Most of these functions are direct or almost direct wrappers around the
 // MPSSE command set. You can get familiar with the list of the available
 // commands and their meaning through the documentation for MPSSE command
@@ -76,6 +259,9 @@ void *mpsse_data(struct mpsse_cmd *cmd);
 // the provided MPSSE IO buffer. To actually execute the commands you should
 // call mpsse_submit function with the MPSSE IO buffer.
 //
+// If a function fails to allocate memory for the command, it marks the MPSSE
+// IO buffer as failed, so the error is reported by mpsse_submit.
+//
 // All of the function take a pointer to MPSSE command structure as the last
 // argument. The pointer may be NULL, but in this case you will not have access
 // to any data read as part of executing the command. If you actually want to
@@ -86,10 +272,16 @@ void mpsse_disable_freq_div5(
 	struct mpsse_io_buffer *io, struct mpsse_cmd *cmd);
 void mpsse_disable_adaptive_clocking(
 	struct mpsse_io_buffer *io, struct mpsse_cmd *cmd);
+// In the loopback mode the data out pin is internally connected to the data
+// in pin, so the data written is read back without any wiring.
+void mpsse_enable_loopback(
+	struct mpsse_io_buffer *io, struct mpsse_cmd *cmd);
 void mpsse_disable_loopback(
 	struct mpsse_io_buffer *io, struct mpsse_cmd *cmd);
 void mpsse_enable_3phase_clocking(
 	struct mpsse_io_buffer *io, struct mpsse_cmd *cmd);
+void mpsse_disable_3phase_clocking(
+	struct mpsse_io_buffer *io, struct mpsse_cmd *cmd);
 void mpsse_set_drive0_pins(
 	struct mpsse_io_buffer *io, unsigned pinmask, struct mpsse_cmd *cmd);
 void mpsse_set_freq_divisor(
@@ -106,6 +298,91 @@ void mpsse_write_bytes(
 	struct mpsse_cmd *cmd);
 void mpsse_read_bytes(
 	struct mpsse_io_buffer *io, unsigned size, struct mpsse_cmd *cmd);
+
+// Like mpsse_read_bytes, but reads as many bytes as the iovecs take, and
+// the data goes straight from the transport to the iovecs without being
+// copied through the MPSSE IO buffer, so the command has no data of its own.
+// The memory of the iovecs must stay valid until the MPSSE IO buffer is
+// submitted and completes.
+void mpsse_read_iov(
+	struct mpsse_io_buffer *io,
+	const struct iovec *iov,
+	unsigned iovcnt,
+	struct mpsse_cmd *cmd);
+
+// Adds an opcode the MPSSE doesn't know, op must be one of them (e.g. 0xaa or
+// 0xab). The device answers with 0xfa followed by the opcode and does nothing
+// else, which makes the shortest possible round trip. The answer is the 2
+// bytes of data of the command.
+void mpsse_echo(
+	struct mpsse_io_buffer *io, unsigned char op, struct mpsse_cmd *cmd);
+
+// Data shifting modes of mpsse_shift_bytes, the values match the bits of the
+// MPSSE data shifting opcodes:
+//   * MPSSE_SHIFT_OUT_NEG - data is written on the falling edge of the clock,
+//     otherwise on the rising edge;
+//   * MPSSE_SHIFT_IN_NEG - data is read on the falling edge of the clock,
+//     otherwise on the rising edge;
+//   * MPSSE_SHIFT_LSB_FIRST - data is shifted LSB first, otherwise MSB first;
+//   * MPSSE_SHIFT_OUT - data is written, at least one of MPSSE_SHIFT_OUT and
+//     MPSSE_SHIFT_IN must be present;
+//   * MPSSE_SHIFT_IN - data is read.
+#define MPSSE_SHIFT_OUT_NEG 0x01u
+#define MPSSE_SHIFT_IN_NEG 0x04u
+#define MPSSE_SHIFT_LSB_FIRST 0x08u
+#define MPSSE_SHIFT_OUT 0x10u
+#define MPSSE_SHIFT_IN 0x20u
+#define MPSSE_SHIFT_MASK 0x3du
+
+// Generic byte shifting command, data is only used with MPSSE_SHIFT_OUT and
+// the command reads size bytes with MPSSE_SHIFT_IN. Unlike mpsse_read_bytes
+// it doesn't ask the device to send the data immediately, mpsse_submit takes
+// care of that when it actually waits for the data. Takes up to 65536 bytes.
+void mpsse_shift_bytes(
+	struct mpsse_io_buffer *io,
+	unsigned mode,
+	const void *data,
+	unsigned size,
+	struct mpsse_cmd *cmd);
+
+// Same as mpsse_shift_bytes with MPSSE_SHIFT_IN, but the data read goes
+// straight to dst like with mpsse_read_iov.
+void mpsse_shift_bytes_to(
+	struct mpsse_io_buffer *io,
+	unsigned mode,
+	const void *data,
+	void *dst,
+	unsigned size,
+	struct mpsse_cmd *cmd);
+
+// Generic bit shifting command, shifts from 1 to 8 bits, the mode is the same
+// as for mpsse_shift_bytes. The bits read are shifted into the byte of data
+// from the top in LSB first mode and from the bottom in MSB first mode.
+void mpsse_shift_bits(
+	struct mpsse_io_buffer *io,
+	unsigned mode,
+	unsigned char data,
+	unsigned bits,
+	struct mpsse_cmd *cmd);
+
+// Clocks from 1 to 7 bits of tms out on the TMS pin LSB first, holding the
+// data out pin at tdi. The mode may contain MPSSE_SHIFT_OUT_NEG,
+// MPSSE_SHIFT_IN_NEG and MPSSE_SHIFT_IN, in the last case the command reads
+// one byte of data with the bits read shifted in from the top.
+void mpsse_shift_tms(
+	struct mpsse_io_buffer *io,
+	unsigned mode,
+	unsigned char tms,
+	unsigned bits,
+	int tdi,
+	struct mpsse_cmd *cmd);
+
+// Generates the given number of clock cycles without transferring any data.
+// The command may consist of several MPSSE commands, so the MPSSE command
+// returned is empty.
+void mpsse_clock(
+	struct mpsse_io_buffer *io, unsigned cycles, struct mpsse_cmd *cmd);
+
 void mpsse_write_bits(
 	struct mpsse_io_buffer *io,
 	unsigned char data,
@@ -0,0 +1,656 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "i2c.h"
+#include "mpsse.h"
+#include "sim.h"
+
+// Every case runs for at least the time budget and at least the minimal
+// number of iterations, so the large batches still give a few samples, but
+// never more than the maximal number of iterations.
+#define BENCH_BUDGET_MS 200u
+#define BENCH_MIN_ITERATIONS 5u
+#define BENCH_MAX_ITERATIONS 1000000u
+#define BENCH_MAX_SIZE (1u << 20)
+
+// Largest single data shifting command.
+#define BENCH_CHUNK 65536u
+
+#define BENCH_I2C_ADDR 0x50u
+// The number of transactions batched into one transfer by the batched I2C
+// shapes.
+#define BENCH_I2C_BATCH 16u
+
+struct bench {
+	struct mpsse *mpsse;
+	double budget;
+	unsigned max_size;
+	// Latency of every iteration of the current case in microseconds.
+	double *samples;
+	unsigned nsamples;
+	unsigned capacity;
+	FILE *json;
+	unsigned results;
+	// Non-0 when running on the simulator, the cases then also report
+	// what the simulator counted.
+	int sim;
+	unsigned char pattern[BENCH_CHUNK];
+};
+
+typedef int (*bench_step)(struct bench *bench, void *arg);
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// User and system time the process consumed so far in seconds.
+static double cpu_time(void)
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+		usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stdout,
+		"%s -s serial [-t ms] [-m size] [-a i2c_addr] [-j file] "
+		"[-h]\n\n"
+		"\t-h           print the usage information.\n"
+		"\t-s serial    specify the FTDI serial number of the device "
+		"               to benchmark, optionally prefixed "
+		"               with the transport, e.g. d2xx:serial, "
+		"               usb:serial[@vid:pid] or sim: for the "
+		"               simulator, the usb transport looks for "
+		"               0x0005:0x0001 and then for 0x0403:0x6014 "
+		"               by default.\n"
+		"\t-t ms        time to spend on every case, 200ms by "
+		"               default.\n"
+		"\t-m size      largest batch size of the bulk transfers, "
+		"               1MiB by default.\n"
+		"\t-a i2c_addr  I2C address of the target used by the I2C "
+		"               cases, 0x50 by default.\n"
+		"\t-j file      also write the results to the file in JSON.\n",
+		name);
+}
+
+static int compare_samples(const void *l, const void *r)
+{
+	const double a = *(const double *)l;
+	const double b = *(const double *)r;
+
+	return (a > b) - (a < b);
+}
+
+// Nearest rank percentile of the sorted samples.
+static double percentile(const double *samples, unsigned count, double p)
+{
+	unsigned rank = (unsigned)(p * count + 0.999999);
+
+	if (rank == 0)
+		rank = 1;
+	if (rank > count)
+		rank = count;
+	return samples[rank - 1];
+}
+
+static int bench_sample(struct bench *bench, double us)
+{
+	if (bench->nsamples == bench->capacity) {
+		const unsigned capacity = bench->capacity ?
+			bench->capacity * 2 : 1024;
+		double *samples = realloc(
+			bench->samples, capacity * sizeof(*samples));
+
+		if (!samples)
+			return -1;
+		bench->samples = samples;
+		bench->capacity = capacity;
+	}
+
+	bench->samples[bench->nsamples++] = us;
+	return 0;
+}
+
+static void bench_header(const struct bench *bench, const char *title)
+{
+	fprintf(stdout, "\n%s\n", title);
+	fprintf(stdout, "%-13s %-10s %8s %8s %9s %10s %9s %9s %9s %5s",
+		"test", "shape", "size", "iters", "MB/s", "ops/s",
+		"p50 us", "p99 us", "p999 us", "cpu%");
+	if (bench->sim)
+		fprintf(stdout, " %10s %7s %7s",
+			"bus us/it", "out/it", "in/it");
+	fprintf(stdout, "\n");
+}
+
+// Runs one case: calls step until the time budget is spent and reports the
+// latency of the steps and the rate of the bytes and the operations, bytes
+// and ops are the amounts a single step transfers. On the simulator the
+// text also shows the bus time, the USB out transfers and the USB in
+// packets per step, the JSON has the totals of the case.
+static int bench_run(
+	struct bench *bench,
+	const char *test,
+	const char *shape,
+	unsigned size,
+	double bytes,
+	double ops,
+	bench_step step,
+	void *arg)
+{
+	const double cpu_start = cpu_time();
+	const double start = now();
+	struct sim_stats stats;
+	double seconds;
+	double cpu;
+	double p50, p99, p999;
+	unsigned n;
+
+	if (bench->sim)
+		sim_reset_stats(bench->mpsse->transport);
+
+	bench->nsamples = 0;
+	for (;;) {
+		const double t = now();
+		double end;
+
+		if (step(bench, arg) != 0) {
+			fprintf(stderr, "%s %s %u failed\n", test, shape, size);
+			return -1;
+		}
+		end = now();
+		if (bench_sample(bench, (end - t) * 1e6) != 0)
+			return -1;
+
+		if (bench->nsamples >= BENCH_MAX_ITERATIONS)
+			break;
+		if (bench->nsamples >= BENCH_MIN_ITERATIONS &&
+		    end - start >= bench->budget)
+			break;
+	}
+	seconds = now() - start;
+	cpu = cpu_time() - cpu_start;
+
+	n = bench->nsamples;
+	qsort(bench->samples, n, sizeof(*bench->samples), compare_samples);
+	p50 = percentile(bench->samples, n, 0.5);
+	p99 = percentile(bench->samples, n, 0.99);
+	p999 = percentile(bench->samples, n, 0.999);
+
+	fprintf(stdout,
+		"%-13s %-10s %8u %8u %9.3f %10.1f %9.1f %9.1f %9.1f %5.0f",
+		test, shape, size, n, bytes * n / seconds / 1e6,
+		ops * n / seconds, p50, p99, p999, cpu / seconds * 100);
+	if (bench->sim) {
+		sim_stats(bench->mpsse->transport, &stats);
+		fprintf(stdout, " %10.1f %7.1f %7.1f",
+			stats.bus_ns / 1e3 / n,
+			(double)stats.usb_out_transfers / n,
+			(double)stats.usb_in_packets / n);
+	}
+	fprintf(stdout, "\n");
+
+	if (bench->json) {
+		fprintf(bench->json,
+			"%s\n    {\"test\": \"%s\", \"shape\": \"%s\", "
+			"\"size\": %u, \"iterations\": %u, "
+			"\"seconds\": %.6f, \"cpu_seconds\": %.6f, "
+			"\"mb_per_s\": %.6f, \"ops_per_s\": %.3f, "
+			"\"p50_us\": %.3f, \"p99_us\": %.3f, "
+			"\"p999_us\": %.3f",
+			bench->results ? "," : "", test, shape, size, n,
+			seconds, cpu, bytes * n / seconds / 1e6,
+			ops * n / seconds, p50, p99, p999);
+		if (bench->sim)
+			fprintf(bench->json,
+				", \"bus_ns\": %llu, "
+				"\"usb_out_transfers\": %llu, "
+				"\"usb_in_packets\": %llu",
+				stats.bus_ns, stats.usb_out_transfers,
+				stats.usb_in_packets);
+		fprintf(bench->json, "}");
+	}
+	bench->results++;
+	return 0;
+}
+
+
+// The echo is the shortest round trip the MPSSE can do: one bad opcode and
+// two bytes of the response.
+struct bench_echo {
+	struct mpsse_io_buffer io;
+	struct mpsse_cmd cmd;
+};
+
+static int bench_echo_step(struct bench *bench, void *arg)
+{
+	struct bench_echo *echo = arg;
+	const unsigned char *data;
+
+	if (mpsse_submit(bench->mpsse, &echo->io) != 0)
+		return -1;
+
+	data = mpsse_data(&echo->cmd);
+	return data[0] == 0xfa && data[1] == 0xaa ? 0 : -1;
+}
+
+static int bench_latency(struct bench *bench)
+{
+	struct bench_echo echo;
+	int ret;
+
+	bench_header(bench, "Round trip latency");
+	mpsse_io_buffer_setup(&echo.io);
+	mpsse_echo(&echo.io, 0xaa, &echo.cmd);
+	ret = bench_run(bench, "echo", "-", 0, 0, 1, bench_echo_step, &echo);
+	mpsse_io_buffer_release(&echo.io);
+	return ret;
+}
+
+
+// Bulk transfers of the given size split into the largest commands the
+// MPSSE takes. Writes don't return anything, so the batch ends with an echo
+// to find out when it completes. If dst is not NULL the data read goes
+// straight to it instead of the MPSSE IO buffer.
+struct bench_bulk {
+	struct mpsse_io_buffer io;
+	unsigned size;
+	int verify;
+	struct mpsse_cmd echo;
+};
+
+static int bench_bulk_step(struct bench *bench, void *arg)
+{
+	struct bench_bulk *bulk = arg;
+	const unsigned char *data;
+
+	if (mpsse_submit(bench->mpsse, &bulk->io) != 0)
+		return -1;
+
+	data = mpsse_data(&bulk->echo);
+	if (data[0] != 0xfa || data[1] != 0xaa)
+		return -1;
+
+	if (!bulk->verify)
+		return 0;
+
+	// In the loopback mode the data read must match the data written.
+	data = bulk->io.data;
+	for (unsigned pos = 0; pos < bulk->size; pos += BENCH_CHUNK) {
+		const unsigned n = bulk->size - pos < BENCH_CHUNK ?
+			bulk->size - pos : BENCH_CHUNK;
+
+		if (memcmp(data + pos, bench->pattern, n) != 0) {
+			fprintf(stderr, "Loopback data mismatch\n");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int bench_bulk(
+	struct bench *bench,
+	const char *test,
+	unsigned mode,
+	int verify,
+	unsigned char *dst)
+{
+	struct bench_bulk bulk;
+	int ret = 0;
+
+	mpsse_io_buffer_setup(&bulk.io);
+	for (unsigned size = 1; size <= bench->max_size && ret == 0;
+	     size *= 4) {
+		mpsse_io_buffer_reset(&bulk.io);
+		for (unsigned pos = 0; pos < size; pos += BENCH_CHUNK) {
+			const unsigned n = size - pos < BENCH_CHUNK ?
+				size - pos : BENCH_CHUNK;
+
+			if (dst)
+				mpsse_shift_bytes_to(&bulk.io, mode,
+						     bench->pattern, dst + pos,
+						     n, NULL);
+			else
+				mpsse_shift_bytes(&bulk.io, mode,
+						  bench->pattern, n, NULL);
+		}
+		mpsse_echo(&bulk.io, 0xaa, &bulk.echo);
+		bulk.size = size;
+		bulk.verify = verify;
+		ret = bench_run(bench, test, "-", size, size, 1,
+				bench_bulk_step, &bulk);
+	}
+	mpsse_io_buffer_release(&bulk.io);
+	return ret;
+}
+
+static int bench_configure(struct bench *bench, int loopback)
+{
+	struct mpsse_io_buffer io;
+	int ret;
+
+	// The fastest clock: 60MHz without the divide by 5 and the divisor of
+	// 0 give 30MHz. Clock and data out are outputs, both low.
+	mpsse_io_buffer_setup(&io);
+	mpsse_disable_freq_div5(&io, NULL);
+	mpsse_disable_adaptive_clocking(&io, NULL);
+	mpsse_disable_3phase_clocking(&io, NULL);
+	mpsse_set_drive0_pins(&io, 0, NULL);
+	if (loopback)
+		mpsse_enable_loopback(&io, NULL);
+	else
+		mpsse_disable_loopback(&io, NULL);
+	mpsse_set_freq_divisor(&io, 0, NULL);
+	mpsse_set_output(&io, 0x0003, 0x0000, NULL);
+	ret = mpsse_submit(bench->mpsse, &io);
+	mpsse_io_buffer_release(&io);
+	return ret;
+}
+
+static int bench_throughput(struct bench *bench)
+{
+	// Data changes on the falling edge and is sampled on the rising edge,
+	// MSB first.
+	const unsigned out = MPSSE_SHIFT_OUT_NEG | MPSSE_SHIFT_OUT;
+	const unsigned in = MPSSE_SHIFT_IN;
+	unsigned char *dst;
+	int ret;
+
+	bench_header(bench, "Bulk throughput");
+	if (bench_configure(bench, 0) != 0)
+		return -1;
+	if (bench_bulk(bench, "write", out, 0, NULL) != 0)
+		return -1;
+	if (bench_bulk(bench, "read", in, 0, NULL) != 0)
+		return -1;
+
+	// The same reads, but without going through the MPSSE IO buffer.
+	dst = malloc(bench->max_size);
+	if (!dst)
+		return -1;
+	ret = bench_bulk(bench, "read-direct", in, 0, dst);
+	free(dst);
+	if (ret != 0)
+		return -1;
+
+	if (bench_configure(bench, 1) != 0)
+		return -1;
+	if (bench_bulk(bench, "loopback", out | in, 1, NULL) != 0)
+		return -1;
+	return bench_configure(bench, 0);
+}
+
+
+// I2C transaction shapes, every shape is a transaction or a few of them
+// repeated in one transfer.
+struct bench_shape {
+	const char *name;
+	unsigned write;
+	unsigned read;
+	unsigned repeat;
+};
+
+static const struct bench_shape bench_shapes[] = {
+	// Address only, e.g. a bus scan.
+	{ "probe", 0, 0, 1 },
+	// Sets the register pointer.
+	{ "w1", 1, 0, 1 },
+	// Register read: write the register, repeated START and read.
+	{ "w1r6", 1, 6, 1 },
+	// Block read from the current register pointer.
+	{ "r32", 0, 32, 1 },
+	// Many register reads in one transfer.
+	{ "16xw1r6", 1, 6, BENCH_I2C_BATCH },
+};
+
+struct bench_i2c {
+	struct i2c_bus *bus;
+	struct i2c_segment *segs;
+	unsigned count;
+	// NULL to encode the transfer every time with i2c_bus_transfer.
+	struct i2c_template *tmpl;
+	unsigned nacks;
+};
+
+static int bench_i2c_step(struct bench *bench, void *arg)
+{
+	struct bench_i2c *i2c = arg;
+	int ret;
+
+	(void) bench;
+	if (i2c->tmpl)
+		ret = i2c_template_run(i2c->bus, i2c->tmpl, i2c->segs);
+	else
+		ret = i2c_bus_transfer(i2c->bus, i2c->segs, i2c->count);
+
+	if (ret < 0)
+		return -1;
+	i2c->nacks += ret;
+	return 0;
+}
+
+// Builds the segments of the shape, returns the number of segments.
+static unsigned bench_i2c_segments(
+	const struct bench_shape *shape,
+	unsigned addr,
+	unsigned char *wbuf,
+	unsigned char *rbuf,
+	struct i2c_segment *segs)
+{
+	unsigned count = 0;
+
+	for (unsigned i = 0; i < shape->repeat; ++i) {
+		if (shape->write || !shape->read) {
+			segs[count].addr = addr;
+			segs[count].flags = shape->read ? 0 : I2C_SEGMENT_STOP;
+			segs[count].buf = wbuf;
+			segs[count].len = shape->write;
+			++count;
+		}
+		if (shape->read) {
+			segs[count].addr = addr;
+			segs[count].flags = I2C_SEGMENT_READ |
+				I2C_SEGMENT_STOP;
+			segs[count].buf = rbuf + i * shape->read;
+			segs[count].len = shape->read;
+			++count;
+		}
+	}
+	return count;
+}
+
+static int bench_i2c_shape(
+	struct bench *bench,
+	struct i2c_bus *bus,
+	const struct bench_shape *shape,
+	unsigned addr)
+{
+	struct i2c_segment segs[2 * BENCH_I2C_BATCH];
+	unsigned char rbuf[32 * BENCH_I2C_BATCH];
+	unsigned char wbuf[1] = { 0 };
+	const unsigned bytes = (shape->write + shape->read) * shape->repeat;
+	struct i2c_template tmpl;
+	struct bench_i2c i2c;
+
+	i2c.bus = bus;
+	i2c.segs = segs;
+	i2c.count = bench_i2c_segments(shape, addr, wbuf, rbuf, segs);
+	i2c.tmpl = NULL;
+	i2c.nacks = 0;
+	if (bench_run(bench, "i2c-transfer", shape->name, bytes, bytes,
+		      shape->repeat, bench_i2c_step, &i2c) != 0)
+		return -1;
+
+	if (i2c_template_compile(bus, &tmpl, segs, i2c.count) != 0) {
+		fprintf(stderr, "Failed to compile I2C template %s\n",
+			shape->name);
+		return -1;
+	}
+	i2c.tmpl = &tmpl;
+	if (bench_run(bench, "i2c-template", shape->name, bytes, bytes,
+		      shape->repeat, bench_i2c_step, &i2c) != 0) {
+		i2c_template_release(&tmpl);
+		return -1;
+	}
+	i2c_template_release(&tmpl);
+
+	if (i2c.nacks)
+		fprintf(stderr, "%u NACKs from 0x%02x in %s\n",
+			i2c.nacks, addr, shape->name);
+	return 0;
+}
+
+static int bench_i2c(struct bench *bench, unsigned addr)
+{
+	const unsigned shapes = sizeof(bench_shapes) / sizeof(bench_shapes[0]);
+	struct i2c_bus bus;
+	int ret = 0;
+
+	bench_header(bench, "I2C transactions, ops/s are transactions/s");
+	if (i2c_bus_open(&bus, bench->mpsse) != 0) {
+		fprintf(stderr, "Failed to configure I2C\n");
+		return -1;
+	}
+
+	for (unsigned i = 0; i < shapes && ret == 0; ++i)
+		ret = bench_i2c_shape(bench, &bus, &bench_shapes[i], addr);
+
+	i2c_bus_close(&bus);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	const char *serial = NULL;
+	const char *json = NULL;
+	unsigned budget_ms = BENCH_BUDGET_MS;
+	unsigned addr = BENCH_I2C_ADDR;
+	char *endptr;
+
+	struct mpsse mpsse;
+	struct bench *bench;
+	int ret = -1;
+	int opt;
+
+	bench = calloc(1, sizeof(*bench));
+	if (!bench)
+		return 1;
+	bench->max_size = BENCH_MAX_SIZE;
+
+	while ((opt = getopt(argc, argv, "s:t:m:a:j:h")) != -1) {
+		switch (opt) {
+		case 'h':
+			usage(argv[0]);
+			free(bench);
+			return 0;
+		case 's':
+			serial = optarg;
+			break;
+		case 't':
+			budget_ms = strtoul(optarg, &endptr, 0);
+			if (*endptr != '\0') {
+				fprintf(stderr, "Failed to parse time %s\n",
+					optarg);
+				free(bench);
+				return 1;
+			}
+			break;
+		case 'm':
+			bench->max_size = strtoul(optarg, &endptr, 0);
+			if (*endptr != '\0' || bench->max_size == 0 ||
+			    bench->max_size > (1u << 30)) {
+				fprintf(stderr, "Failed to parse size %s\n",
+					optarg);
+				free(bench);
+				return 1;
+			}
+			break;
+		case 'a':
+			addr = strtoul(optarg, &endptr, 0);
+			if (*endptr != '\0' || addr > 0x7f) {
+				fprintf(stderr,
+					"Failed to parse I2C address %s\n",
+					optarg);
+				free(bench);
+				return 1;
+			}
+			break;
+		case 'j':
+			json = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			free(bench);
+			return 1;
+		}
+	}
+
+	if (!serial) {
+		fprintf(stderr, "Expect exactly one -s argument\n");
+		free(bench);
+		return 1;
+	}
+
+	bench->budget = budget_ms / 1e3;
+	for (unsigned i = 0; i < BENCH_CHUNK; ++i)
+		bench->pattern[i] = (i * 7 + (i >> 8)) & 0xff;
+
+	if (json) {
+		bench->json = fopen(json, "w");
+		if (!bench->json) {
+			fprintf(stderr, "Failed to create %s\n", json);
+			free(bench);
+			return 1;
+		}
+		fprintf(bench->json, "{\n  \"device\": \"%s\",\n"
+			"  \"results\": [", serial);
+	}
+
+	if (mpsse_open_spec(serial, &mpsse) != 0) {
+		fprintf(stderr, "Failed to enable MPSSE on %s\n", serial);
+		goto out;
+	}
+
+	if (mpsse_verify(&mpsse) != 0) {
+		fprintf(stderr, "Failed to verify MPSSE mode on %s\n", serial);
+		mpsse_close(&mpsse);
+		goto out;
+	}
+
+	bench->mpsse = &mpsse;
+	bench->sim = sim_is_sim(mpsse.transport);
+	ret = bench_latency(bench);
+	if (ret == 0)
+		ret = bench_throughput(bench);
+	if (ret == 0)
+		ret = bench_i2c(bench, addr);
+
+	if (mpsse_close(&mpsse) != 0) {
+		fprintf(stderr, "Failed to close %s\n", serial);
+		ret = -1;
+	}
+
+out:
+	if (bench->json) {
+		fprintf(bench->json, "\n  ]\n}\n");
+		if (fclose(bench->json) != 0) {
+			fprintf(stderr, "Failed to write %s\n", json);
+			ret = -1;
+		}
+	}
+	free(bench->samples);
+	free(bench);
+	return ret == 0 ? 0 : 1;
+}
@@ -0,0 +1,214 @@
+// SPDX-License-Identifier: GPL-2.0
+#include "ring.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+// The records start at the first cache line after the header.
+#define RING_RECORDS_OFFSET \
+	((sizeof(struct ring_header) + 63) / 64 * 64)
+
+static struct ring_record *ring_slot(const struct ring *ring, uint64_t pos)
+{
+	const struct ring_header *header = ring->header;
+
+	return (struct ring_record *)(ring->records +
+		(pos & (header->slots - 1)) * header->record_size);
+}
+
+int ring_create(
+	struct ring *ring,
+	const char *path,
+	unsigned slots,
+	unsigned data_size,
+	uint64_t period_ns)
+{
+	const unsigned record_size =
+		(sizeof(struct ring_record) + data_size + 7) / 8 * 8;
+	unsigned long size;
+	void *map;
+	int fd;
+
+	if (slots == 0 || (slots & (slots - 1)) != 0 || data_size > 0xffff)
+		return -1;
+	size = RING_RECORDS_OFFSET + (unsigned long)slots * record_size;
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+
+	if (ftruncate(fd, size) != 0) {
+		close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+
+	// The file was just truncated, so everything else is 0 already and
+	// the records are all invalid.
+	ring->header = map;
+	ring->records = (unsigned char *)map + RING_RECORDS_OFFSET;
+	ring->size = size;
+	ring->pos = 0;
+	ring->header->version = RING_VERSION;
+	ring->header->slots = slots;
+	ring->header->record_size = record_size;
+	ring->header->period_ns = period_ns;
+	ring->header->data_size = data_size;
+
+	// Consumers check the magic first, so it goes last.
+	atomic_thread_fence(memory_order_release);
+	ring->header->magic = RING_MAGIC;
+	return 0;
+}
+
+int ring_open(struct ring *ring, const char *path)
+{
+	const struct ring_header *header;
+	struct stat st;
+	uint64_t head;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st) != 0 ||
+	    (unsigned long)st.st_size < RING_RECORDS_OFFSET) {
+		close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+
+	header = map;
+	if (header->magic != RING_MAGIC || header->version != RING_VERSION ||
+	    header->slots == 0 || (header->slots & (header->slots - 1)) ||
+	    header->record_size < sizeof(struct ring_record) +
+	    header->data_size ||
+	    RING_RECORDS_OFFSET + (unsigned long)header->slots *
+	    header->record_size > (unsigned long)st.st_size) {
+		munmap(map, st.st_size);
+		return -1;
+	}
+	atomic_thread_fence(memory_order_acquire);
+
+	ring->header = map;
+	ring->records = (unsigned char *)map + RING_RECORDS_OFFSET;
+	ring->size = st.st_size;
+
+	head = atomic_load_explicit(&ring->header->head, memory_order_acquire);
+	ring->pos = head > header->slots ? head - header->slots : 0;
+	return 0;
+}
+
+void ring_close(struct ring *ring)
+{
+	if (ring->header)
+		munmap(ring->header, ring->size);
+	ring->header = NULL;
+	ring->records = NULL;
+	ring->size = 0;
+	ring->pos = 0;
+}
+
+void ring_push(
+	struct ring *ring,
+	uint64_t timestamp_ns,
+	uint32_t latency_ns,
+	unsigned flags,
+	const void *data,
+	unsigned len)
+{
+	struct ring_record *rec = ring_slot(ring, ring->pos);
+
+	if (len > ring->header->data_size)
+		len = ring->header->data_size;
+
+	// Invalidate the record before touching it, so the consumers reading
+	// the old contents notice.
+	atomic_store_explicit(&rec->seq, 0, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	rec->timestamp_ns = timestamp_ns;
+	rec->latency_ns = latency_ns;
+	rec->flags = flags;
+	rec->len = len;
+	memcpy(rec->data, data, len);
+
+	++ring->pos;
+	atomic_store_explicit(&rec->seq, ring->pos, memory_order_release);
+	atomic_store_explicit(
+		&ring->header->head, ring->pos, memory_order_release);
+}
+
+void ring_add_missed(struct ring *ring, uint64_t count)
+{
+	atomic_fetch_add_explicit(
+		&ring->header->missed, count, memory_order_relaxed);
+}
+
+void ring_add_error(struct ring *ring)
+{
+	atomic_fetch_add_explicit(
+		&ring->header->errors, 1, memory_order_relaxed);
+}
+
+int ring_next(struct ring *ring, struct ring_record *rec, uint64_t *lost)
+{
+	const struct ring_header *header = ring->header;
+	const uint64_t head =
+		atomic_load_explicit(&ring->header->head, memory_order_acquire);
+
+	while (ring->pos != head) {
+		const struct ring_record *slot;
+		uint64_t seq;
+
+		// The records more than the ring size behind are gone.
+		if (head - ring->pos > header->slots) {
+			if (lost)
+				*lost += head - header->slots - ring->pos;
+			ring->pos = head - header->slots;
+		}
+
+		slot = ring_slot(ring, ring->pos);
+		seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		if (seq == ring->pos + 1) {
+			rec->timestamp_ns = slot->timestamp_ns;
+			rec->latency_ns = slot->latency_ns;
+			rec->flags = slot->flags;
+			rec->len = slot->len <= header->data_size ?
+				slot->len : header->data_size;
+			memcpy(rec->data, slot->data, rec->len);
+
+			// The copy is only valid if the producer didn't
+			// start to overwrite the record meanwhile.
+			atomic_thread_fence(memory_order_acquire);
+			if (atomic_load_explicit(
+				&slot->seq, memory_order_relaxed) == seq) {
+				atomic_store_explicit(
+					&rec->seq, seq, memory_order_relaxed);
+				++ring->pos;
+				return 1;
+			}
+		}
+
+		// The producer overwrote the record before we got to it.
+		if (lost)
+			++*lost;
+		++ring->pos;
+	}
+
+	return 0;
+}
@@ -0,0 +1,105 @@
+// SPDX-License-Identifier: GPL-2.0
+#ifndef __RING_H__
+#define __RING_H__
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+// Ring of timestamped samples in a shared memory file (e.g. in /dev/shm).
+// There is exactly one producer that never waits for the consumers, once the
+// ring is full the oldest records are overwritten. Any number of consumers
+// map the same file read-only and follow the producer at their own pace,
+// consumers that fall behind by more than the ring size lose the records
+// that were overwritten and are told how many.
+//
+// Every record carries the sequence number it was written with, the producer
+// clears it before writing the record and sets it once the record is
+// complete, so a consumer that copied a record and still sees the same
+// sequence number knows the copy wasn't torn by the producer.
+#define RING_MAGIC 0x474e4952u
+#define RING_VERSION 1u
+
+// Record flags:
+//   * RING_RECORD_NACK - the target didn't acknowledge the read, the data
+//     is not valid.
+#define RING_RECORD_NACK 0x1u
+
+struct ring_header {
+	uint32_t magic;
+	uint32_t version;
+	// Number of records in the ring, a power of 2, and the size of every
+	// record in bytes including the record header.
+	uint32_t slots;
+	uint32_t record_size;
+	// Sampling period in nanoseconds or 0 if the producer samples as fast
+	// as it can.
+	uint64_t period_ns;
+	uint32_t data_size;
+	uint32_t reserved;
+	// Counters updated by the producer only, they live on their own cache
+	// line: the number of records written so far, the number of samples
+	// taken later than scheduled and the number of failed samples.
+	alignas(64) _Atomic uint64_t head;
+	_Atomic uint64_t missed;
+	_Atomic uint64_t errors;
+};
+
+struct ring_record {
+	// 0 while the record is being written, otherwise the position of the
+	// record in the stream plus 1.
+	_Atomic uint64_t seq;
+	// CLOCK_MONOTONIC time when the sample was requested and how long it
+	// took to get it.
+	uint64_t timestamp_ns;
+	uint32_t latency_ns;
+	uint16_t flags;
+	uint16_t len;
+	unsigned char data[];
+};
+
+struct ring {
+	struct ring_header *header;
+	unsigned char *records;
+	unsigned long size;
+	// Producer: position of the next record.
+	// Consumer: position of the next record to read.
+	uint64_t pos;
+};
+
+// Creates or truncates the file and sets up an empty ring with the given
+// number of slots (a power of 2) for data_size bytes of data per sample.
+// Returns 0 on success and a non-0 value otherwise.
+int ring_create(
+	struct ring *ring,
+	const char *path,
+	unsigned slots,
+	unsigned data_size,
+	uint64_t period_ns);
+
+// Maps an existing ring for reading, the consumer starts from the oldest
+// record still in the ring. Returns 0 on success and a non-0 value otherwise.
+int ring_open(struct ring *ring, const char *path);
+
+void ring_close(struct ring *ring);
+
+// Producer: appends a record, len must not exceed the data size of the ring.
+void ring_push(
+	struct ring *ring,
+	uint64_t timestamp_ns,
+	uint32_t latency_ns,
+	unsigned flags,
+	const void *data,
+	unsigned len);
+
+// Producer: counts a missed deadline or a failed sample.
+void ring_add_missed(struct ring *ring, uint64_t count);
+void ring_add_error(struct ring *ring);
+
+// Consumer: copies the next record into rec, which must have room for the
+// data size of the ring. Returns 1 if a record was copied, 0 if there are no
+// new records. If lost is not NULL it's incremented by the number of records
+// the consumer missed because they were overwritten.
+int ring_next(struct ring *ring, struct ring_record *rec, uint64_t *lost);
+
+#endif  // __RING_H__
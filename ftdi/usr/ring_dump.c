@@ -0,0 +1,133 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ring.h"
+
+// How long the follow mode sleeps when the producer has nothing new.
+#define FOLLOW_POLL_NS 1000000l
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+	(void) sig;
+	stop = 1;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stdout,
+		"%s [-f] [-q] [-h] ring\n\n"
+		"\t-h  print the usage information.\n"
+		"\t-f  keep following the producer until interrupted "
+		"      instead of stopping at the newest record.\n"
+		"\t-q  don't print the records, only the summary.\n",
+		name);
+}
+
+static void dump_record(const struct ring_record *rec)
+{
+	fprintf(stdout, "%llu %llu.%09llu %.1f %s",
+		(unsigned long long)(atomic_load_explicit(
+			&rec->seq, memory_order_relaxed) - 1),
+		(unsigned long long)(rec->timestamp_ns / 1000000000u),
+		(unsigned long long)(rec->timestamp_ns % 1000000000u),
+		rec->latency_ns / 1e3,
+		rec->flags & RING_RECORD_NACK ? "nack" : "ok");
+	for (unsigned i = 0; i < rec->len; ++i)
+		fprintf(stdout, " 0x%02x", rec->data[i]);
+	fprintf(stdout, "\n");
+}
+
+static int dump(struct ring *ring, int follow, int quiet)
+{
+	const struct timespec poll = { 0, FOLLOW_POLL_NS };
+	struct ring_header *header = ring->header;
+	struct ring_record *rec;
+	unsigned long records = 0;
+	uint64_t lost = 0;
+
+	rec = malloc(sizeof(*rec) + header->data_size);
+	if (!rec) {
+		fprintf(stderr, "Failed to allocate a record\n");
+		return -1;
+	}
+
+	fprintf(stdout, "Ring of %u slots, %u bytes of data, period %llu ns\n",
+		header->slots, header->data_size,
+		(unsigned long long)header->period_ns);
+
+	while (!stop) {
+		if (ring_next(ring, rec, &lost)) {
+			if (!quiet)
+				dump_record(rec);
+			++records;
+		} else if (follow) {
+			nanosleep(&poll, NULL);
+		} else {
+			break;
+		}
+	}
+
+	fprintf(stdout,
+		"%lu records, %llu lost, %llu missed, %llu errors\n",
+		records, (unsigned long long)lost,
+		(unsigned long long)atomic_load(&header->missed),
+		(unsigned long long)atomic_load(&header->errors));
+	free(rec);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct sigaction sa;
+	struct ring ring;
+	int follow = 0;
+	int quiet = 0;
+	int opt;
+	int ret;
+
+	while ((opt = getopt(argc, argv, "fqh")) != -1) {
+		switch (opt) {
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		case 'f':
+			follow = 1;
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind + 1 != argc) {
+		fprintf(stderr, "Expect exactly one ring\n");
+		return 1;
+	}
+
+	if (ring_open(&ring, argv[optind]) != 0) {
+		fprintf(stderr, "Failed to open the ring in %s\n",
+			argv[optind]);
+		return 1;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	ret = dump(&ring, follow, quiet);
+	ring_close(&ring);
+	return ret == 0 ? 0 : 1;
+}
@@ -0,0 +1,899 @@
+// SPDX-License-Identifier: GPL-2.0
+#include "sim.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "ftdi.h"
+
+// Pins of the low byte, SCL is the MPSSE clock, SDA is driven by the MPSSE
+// data out pin and sampled through the data in pin, TMS is only used by the
+// TMS commands.
+#define SIM_PIN_SCL 0x1u
+#define SIM_PIN_DO 0x2u
+#define SIM_PIN_DI 0x4u
+#define SIM_PIN_TMS 0x8u
+
+// The FT232H sends a packet as soon as it collected a full packet of data,
+// the first two bytes of every packet are status bytes.
+#define SIM_PACKET_DATA_SIZE 510
+
+// MPSSE base clock with and without the divide by 5 in picoseconds.
+static const unsigned long long SIM_CLOCK_PS = 1000000ull / 60;
+static const unsigned long long SIM_CLOCK_DIV5_PS = 1000000ull / 12;
+
+struct sim_queue {
+	unsigned char *data;
+	size_t head;
+	size_t tail;
+	size_t capacity;
+};
+
+enum sim_i2c_state {
+	// Waiting for START, either because nobody addressed yet or because
+	// the addressed target NACKed.
+	SIM_I2C_IDLE,
+	SIM_I2C_ADDR,
+	SIM_I2C_WRITE,
+	SIM_I2C_READ,
+	// The target ACKs (or NACKs) the byte it received.
+	SIM_I2C_ACK,
+	// The master ACKs (or NACKs) the byte it read.
+	SIM_I2C_MASTER_ACK,
+};
+
+struct sim {
+	// Must be the first member, the transport operations convert the
+	// pointer to the transport back to the pointer to sim.
+	struct transport transport;
+	int mpsse;
+
+	// MPSSE state, the pins are 16 bit, the low byte is ADBUS and the high
+	// byte is ACBUS.
+	unsigned pins_val;
+	unsigned pins_dir;
+	unsigned drive0;
+	unsigned divisor;
+	int div5;
+	int three_phase;
+	int loopback;
+
+	// I2C bus state as seen by the targets.
+	int scl;
+	int sda;
+	int master_sda;
+	int target_sda;
+	enum sim_i2c_state state;
+	unsigned bits;
+	unsigned char byte;
+	int ack;
+	int ack_driven;
+	int read;
+	struct sim_target *selected;
+	struct sim_target *targets;
+
+	// Commands the host sent that we haven't executed yet, because they
+	// haven't arrived completely, the responses the device hasn't sent
+	// yet and the responses the host received.
+	struct sim_queue cmd;
+	struct sim_queue dev;
+	struct sim_queue host;
+
+	// The bus time never goes back, otherwise the targets waiting for
+	// some time to pass, e.g. EEPROM write cycle, would wait longer.
+	// Resetting the statistics moves stats_ps, the start of the bus time
+	// in the statistics, instead.
+	unsigned long long now_ps;
+	unsigned long long stats_ps;
+	struct sim_stats stats;
+	int fd;
+};
+
+static struct sim *sim(struct transport *transport)
+{
+	return (struct sim *)transport;
+}
+
+static size_t sim_queue_size(const struct sim_queue *queue)
+{
+	return queue->tail - queue->head;
+}
+
+static int sim_queue_push(
+	struct sim_queue *queue, const void *data, size_t size)
+{
+	if (queue->tail + size > queue->capacity) {
+		size_t used = sim_queue_size(queue);
+		size_t capacity = queue->capacity ? queue->capacity : 256;
+		unsigned char *buf;
+
+		if (used != 0)
+			memmove(queue->data, queue->data + queue->head, used);
+		queue->head = 0;
+		queue->tail = used;
+
+		while (capacity < used + size)
+			capacity *= 2;
+
+		if (capacity > queue->capacity) {
+			buf = realloc(queue->data, capacity);
+			if (!buf)
+				return -1;
+			queue->data = buf;
+			queue->capacity = capacity;
+		}
+	}
+
+	memcpy(queue->data + queue->tail, data, size);
+	queue->tail += size;
+	return 0;
+}
+
+static size_t sim_queue_pop(struct sim_queue *queue, void *data, size_t size)
+{
+	const size_t used = sim_queue_size(queue);
+
+	if (size > used)
+		size = used;
+	if (data)
+		memcpy(data, queue->data + queue->head, size);
+	queue->head += size;
+	if (queue->head == queue->tail) {
+		queue->head = 0;
+		queue->tail = 0;
+	}
+	return size;
+}
+
+static void sim_queue_release(struct sim_queue *queue)
+{
+	free(queue->data);
+	memset(queue, 0, sizeof(*queue));
+}
+
+// Moves size bytes of the responses to the host in one packet.
+static int sim_send_packet(struct sim *sim, size_t size)
+{
+	unsigned char buf[SIM_PACKET_DATA_SIZE];
+
+	size = sim_queue_pop(&sim->dev, buf, size);
+	if (size == 0)
+		return 0;
+
+	if (sim_queue_push(&sim->host, buf, size) != 0)
+		return -1;
+	sim->stats.usb_in_packets++;
+	sim->stats.usb_in_bytes += size;
+	return 0;
+}
+
+static int sim_flush(struct sim *sim)
+{
+	while (sim_queue_size(&sim->dev) != 0) {
+		if (sim_send_packet(sim, SIM_PACKET_DATA_SIZE) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int sim_respond(struct sim *sim, const void *data, size_t size)
+{
+	unsigned long long unread;
+
+	if (sim_queue_push(&sim->dev, data, size) != 0)
+		return -1;
+
+	unread = sim_queue_size(&sim->dev) + sim_queue_size(&sim->host);
+	if (unread > sim->stats.max_unread)
+		sim->stats.max_unread = unread;
+
+	while (sim_queue_size(&sim->dev) >= SIM_PACKET_DATA_SIZE) {
+		if (sim_send_packet(sim, SIM_PACKET_DATA_SIZE) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+static unsigned long long sim_period_ps(const struct sim *sim)
+{
+	const unsigned long long clock =
+		sim->div5 ? SIM_CLOCK_DIV5_PS : SIM_CLOCK_PS;
+	const unsigned long long period = (1ull + sim->divisor) * 2 * clock;
+
+	return sim->three_phase ? period * 3 / 2 : period;
+}
+
+static void sim_tick(struct sim *sim, unsigned long long ps)
+{
+	sim->now_ps += ps;
+	sim->stats.bus_ns = (sim->now_ps - sim->stats_ps) / 1000;
+}
+
+static unsigned long long sim_now(const struct sim *sim)
+{
+	return sim->now_ps / 1000;
+}
+
+// Returns the level the master drives the pin to, 1 if it doesn't drive it.
+static int sim_master(const struct sim *sim, unsigned pin)
+{
+	if (!(sim->pins_dir & pin))
+		return 1;
+	return (sim->pins_val & pin) != 0;
+}
+
+static void sim_i2c_reset(struct sim *sim)
+{
+	sim->state = SIM_I2C_IDLE;
+	sim->bits = 0;
+	sim->byte = 0;
+	sim->ack = 0;
+	sim->ack_driven = 0;
+	sim->target_sda = 1;
+}
+
+static void sim_i2c_start(struct sim *sim)
+{
+	sim_i2c_reset(sim);
+	sim->selected = NULL;
+	sim->state = SIM_I2C_ADDR;
+}
+
+static void sim_i2c_stop(struct sim *sim)
+{
+	struct sim_target *target = sim->selected;
+
+	sim_i2c_reset(sim);
+	sim->selected = NULL;
+	if (target && target->ops->stop)
+		target->ops->stop(target, sim_now(sim));
+}
+
+static void sim_i2c_received(struct sim *sim)
+{
+	struct sim_target *target;
+
+	sim->ack = 0;
+	if (sim->state == SIM_I2C_WRITE) {
+		sim->ack = sim->selected->ops->write(sim->selected, sim->byte);
+		sim->state = SIM_I2C_ACK;
+		return;
+	}
+
+	sim->read = sim->byte & 1;
+	for (target = sim->targets; target; target = target->next) {
+		if (target->addr != (unsigned)(sim->byte >> 1))
+			continue;
+		if (target->ops->start(target, sim->read, sim_now(sim))) {
+			sim->selected = target;
+			sim->ack = 1;
+		}
+		break;
+	}
+	sim->state = SIM_I2C_ACK;
+}
+
+static void sim_i2c_rise(struct sim *sim)
+{
+	switch (sim->state) {
+	case SIM_I2C_ADDR:
+	case SIM_I2C_WRITE:
+		sim->byte = (sim->byte << 1) | (sim->sda ? 1 : 0);
+		if (++sim->bits == 8)
+			sim_i2c_received(sim);
+		break;
+	case SIM_I2C_READ:
+		++sim->bits;
+		break;
+	case SIM_I2C_MASTER_ACK:
+		sim->ack = !sim->sda;
+		break;
+	default:
+		break;
+	}
+}
+
+static void sim_i2c_load(struct sim *sim)
+{
+	sim->byte = sim->selected->ops->read(sim->selected);
+	sim->bits = 0;
+	sim->state = SIM_I2C_READ;
+	sim->target_sda = (sim->byte >> 7) & 1;
+}
+
+static void sim_i2c_fall(struct sim *sim)
+{
+	switch (sim->state) {
+	case SIM_I2C_ACK:
+		if (!sim->ack_driven) {
+			sim->ack_driven = 1;
+			sim->target_sda = !sim->ack;
+			break;
+		}
+
+		sim->ack_driven = 0;
+		sim->target_sda = 1;
+		sim->bits = 0;
+		sim->byte = 0;
+		if (!sim->ack)
+			sim->state = SIM_I2C_IDLE;
+		else if (sim->read)
+			sim_i2c_load(sim);
+		else
+			sim->state = SIM_I2C_WRITE;
+		break;
+	case SIM_I2C_READ:
+		if (sim->bits < 8) {
+			sim->target_sda = (sim->byte >> (7 - sim->bits)) & 1;
+			break;
+		}
+		sim->target_sda = 1;
+		sim->state = SIM_I2C_MASTER_ACK;
+		break;
+	case SIM_I2C_MASTER_ACK:
+		if (sim->ack)
+			sim_i2c_load(sim);
+		else
+			sim->state = SIM_I2C_IDLE;
+		break;
+	default:
+		break;
+	}
+}
+
+// Moves the bus to the new state, the targets see the change of SCL and SDA
+// as a START or STOP condition or as an edge of the clock. master_sda is the
+// level the master drives SDA to, the targets may pull it down.
+static void sim_bus_set(struct sim *sim, int scl, int master_sda)
+{
+	const int old_scl = sim->scl;
+	const int old_sda = sim->sda;
+	const int sda = master_sda && sim->target_sda;
+
+	sim->scl = scl;
+	sim->sda = sda;
+	sim->master_sda = master_sda;
+	if (old_scl && scl && old_sda && !sda)
+		sim_i2c_start(sim);
+	else if (old_scl && scl && !old_sda && sda)
+		sim_i2c_stop(sim);
+	else if (!old_scl && scl)
+		sim_i2c_rise(sim);
+	else if (old_scl && !scl)
+		sim_i2c_fall(sim);
+	sim->sda = master_sda && sim->target_sda;
+}
+
+// Propagates the pins of the master to the bus. When both lines change at
+// the same time we assume that the data line changes while the clock is
+// low, the way any sane I2C master would do.
+static void sim_bus_update(struct sim *sim)
+{
+	const int scl = sim_master(sim, SIM_PIN_SCL);
+	const int sda = sim_master(sim, SIM_PIN_DO);
+
+	if (scl && !sim->scl) {
+		sim_bus_set(sim, sim->scl, sda);
+		sim_bus_set(sim, scl, sda);
+	} else {
+		sim_bus_set(sim, scl, sim->master_sda);
+		sim_bus_set(sim, scl, sda);
+	}
+}
+
+static int sim_data_in(const struct sim *sim)
+{
+	if (sim->loopback)
+		return (sim->pins_val & SIM_PIN_DO) != 0;
+	return sim->sda;
+}
+
+static void sim_set_pin(struct sim *sim, unsigned pin, int value)
+{
+	if (value)
+		sim->pins_val |= pin;
+	else
+		sim->pins_val &= ~pin;
+}
+
+// Clocks one bit, out is the value of the data out pin for the bit, the
+// function returns the value of the data in pin sampled on the edge
+// requested by the command.
+static int sim_clock(struct sim *sim, int out, int read_neg)
+{
+	const int idle = (sim->pins_val & SIM_PIN_SCL) != 0;
+	int in_pos = 0, in_neg = 0;
+
+	sim_set_pin(sim, SIM_PIN_DO, out);
+	sim_bus_update(sim);
+
+	sim_set_pin(sim, SIM_PIN_SCL, !idle);
+	if (idle)
+		in_neg = sim_data_in(sim);
+	sim_bus_update(sim);
+	if (!idle)
+		in_pos = sim_data_in(sim);
+
+	sim_set_pin(sim, SIM_PIN_SCL, idle);
+	if (!idle)
+		in_neg = sim_data_in(sim);
+	sim_bus_update(sim);
+	if (idle)
+		in_pos = sim_data_in(sim);
+
+	sim_tick(sim, sim_period_ps(sim));
+	return read_neg ? in_neg : in_pos;
+}
+
+// Executes a data shifting command, op is the opcode, len is the number of
+// bytes or bits and data points to the data the command writes if any.
+static int sim_shift(
+	struct sim *sim,
+	unsigned char op,
+	unsigned len,
+	const unsigned char *data)
+{
+	const int read_neg = (op & 0x04) != 0;
+	const int lsb = (op & 0x08) != 0;
+	const int tms = (op & 0x40) != 0;
+	const int write = (op & 0x10) != 0 || tms;
+	const int read = (op & 0x20) != 0;
+	const int bits = (op & 0x02) != 0 || tms;
+	const unsigned bytes = bits ? 1 : len;
+	const unsigned count = bits ? len : 8;
+	const int out_idle = (sim->pins_val & SIM_PIN_DO) != 0;
+
+	for (unsigned i = 0; i < bytes; ++i) {
+		const unsigned char b = write ? data[i] : 0;
+		unsigned char in = 0;
+
+		for (unsigned j = 0; j < count; ++j) {
+			const unsigned shift = lsb ? j : 7 - j;
+			int out = write ? (b >> shift) & 1 : out_idle;
+			int bit;
+
+			// TMS commands clock the data out to TMS and hold
+			// the bit 7 of the byte on the data out pin.
+			if (tms) {
+				sim_set_pin(sim, SIM_PIN_TMS, (b >> j) & 1);
+				out = (b >> 7) & 1;
+			}
+
+			bit = sim_clock(sim, out, read_neg);
+			if (lsb || tms)
+				in = (in >> 1) | (bit << 7);
+			else
+				in = (in << 1) | bit;
+		}
+
+		if (read && sim_respond(sim, &in, 1) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+static void sim_set_pins(struct sim *sim, int high, unsigned val, unsigned dir)
+{
+	const unsigned shift = high ? 8 : 0;
+	const unsigned mask = 0xffu << shift;
+
+	sim->pins_val = (sim->pins_val & ~mask) | ((val & 0xff) << shift);
+	sim->pins_dir = (sim->pins_dir & ~mask) | ((dir & 0xff) << shift);
+	sim_bus_update(sim);
+	sim_tick(sim, sim_period_ps(sim) / 2);
+}
+
+static unsigned char sim_read_pins(struct sim *sim, int high)
+{
+	unsigned pins = sim->pins_val;
+
+	sim_tick(sim, sim_period_ps(sim) / 2);
+	if (high)
+		return (pins >> 8) & 0xff;
+
+	pins &= ~(SIM_PIN_SCL | SIM_PIN_DO | SIM_PIN_DI);
+	if (sim->scl)
+		pins |= SIM_PIN_SCL;
+	if (sim->sda)
+		pins |= SIM_PIN_DO | SIM_PIN_DI;
+	return pins & 0xff;
+}
+
+// Returns the size of the command at the beginning of the buffer, or 0 if
+// the command hasn't arrived completely.
+static size_t sim_cmd_size(const unsigned char *cmd, size_t size)
+{
+	const unsigned char op = cmd[0];
+
+	if (op & 0x80) {
+		switch (op) {
+		case 0x80:
+		case 0x82:
+		case 0x86:
+		case 0x8f:
+		case 0x9c:
+		case 0x9d:
+		case 0x9e:
+			return size >= 3 ? 3 : 0;
+		case 0x8e:
+			return size >= 2 ? 2 : 0;
+		default:
+			return 1;
+		}
+	}
+
+	// TMS commands always carry a byte of data.
+	if (op & 0x40)
+		return size >= 3 ? 3 : 0;
+
+	if (!(op & 0x30))
+		return 1;
+
+	if (op & 0x02) {
+		const size_t len = op & 0x10 ? 3 : 2;
+
+		return size >= len ? len : 0;
+	}
+
+	if (size < 3)
+		return 0;
+
+	if (!(op & 0x10))
+		return 3;
+
+	{
+		const size_t len = 4 + ((size_t)cmd[1] | ((size_t)cmd[2] << 8));
+
+		return size >= len ? len : 0;
+	}
+}
+
+static int sim_execute(struct sim *sim, const unsigned char *cmd)
+{
+	const unsigned char op = cmd[0];
+	unsigned char buf[2];
+
+	sim->stats.commands++;
+	if (!(op & 0x80) && (op & 0x70)) {
+		unsigned len;
+
+		if (op & 0x42) {
+			len = cmd[1] + 1;
+			if (len > 8)
+				len = 8;
+			return sim_shift(sim, op, len, &cmd[2]);
+		}
+
+		len = ((unsigned)cmd[1] | ((unsigned)cmd[2] << 8)) + 1;
+		return sim_shift(sim, op, len, &cmd[3]);
+	}
+
+	switch (op) {
+	case 0x80:
+	case 0x82:
+		sim_set_pins(sim, op == 0x82, cmd[1], cmd[2]);
+		return 0;
+	case 0x81:
+	case 0x83:
+		buf[0] = sim_read_pins(sim, op == 0x83);
+		return sim_respond(sim, buf, 1);
+	case 0x84:
+	case 0x85:
+		sim->loopback = op == 0x84;
+		return 0;
+	case 0x86:
+		sim->divisor = (unsigned)cmd[1] | ((unsigned)cmd[2] << 8);
+		return 0;
+	case 0x87:
+		return sim_flush(sim);
+	case 0x8a:
+	case 0x8b:
+		sim->div5 = op == 0x8b;
+		return 0;
+	case 0x8c:
+	case 0x8d:
+		sim->three_phase = op == 0x8c;
+		return 0;
+	case 0x96:
+	case 0x97:
+		return 0;
+	case 0x9e:
+		sim->drive0 = (unsigned)cmd[1] | ((unsigned)cmd[2] << 8);
+		return 0;
+	default:
+		sim->stats.bad_commands++;
+		buf[0] = 0xfa;
+		buf[1] = op;
+		return sim_respond(sim, buf, 2);
+	}
+}
+
+static void sim_mpsse_reset(struct sim *sim)
+{
+	sim->pins_val = 0;
+	sim->pins_dir = 0;
+	sim->drive0 = 0;
+	sim->divisor = 0;
+	sim->div5 = 1;
+	sim->three_phase = 0;
+	sim->loopback = 0;
+	sim->scl = 1;
+	sim->sda = 1;
+	sim->master_sda = 1;
+	sim->selected = NULL;
+	sim_i2c_reset(sim);
+}
+
+static int sim_close(struct transport *transport)
+{
+	struct sim *s = sim(transport);
+
+	while (s->targets) {
+		struct sim_target *target = s->targets;
+
+		s->targets = target->next;
+		target->ops->release(target);
+	}
+
+	if (s->fd >= 0)
+		close(s->fd);
+
+	sim_queue_release(&s->cmd);
+	sim_queue_release(&s->dev);
+	sim_queue_release(&s->host);
+	free(s);
+	return 0;
+}
+
+static int sim_drain(struct transport *transport)
+{
+	struct sim *s = sim(transport);
+
+	sim_queue_pop(&s->cmd, NULL, sim_queue_size(&s->cmd));
+	sim_queue_pop(&s->dev, NULL, sim_queue_size(&s->dev));
+	sim_queue_pop(&s->host, NULL, sim_queue_size(&s->host));
+	return 0;
+}
+
+static int sim_reset(struct transport *transport)
+{
+	struct sim *s = sim(transport);
+
+	s->mpsse = 0;
+	sim_mpsse_reset(s);
+	return sim_drain(transport);
+}
+
+static int sim_disable_special_chars(struct transport *transport)
+{
+	(void) transport;
+	return 0;
+}
+
+static int sim_set_bit_mode(struct transport *transport, unsigned mode)
+{
+	struct sim *s = sim(transport);
+
+	s->mpsse = mode == FTDI_BIT_MODE_MPSSE;
+	if (s->mpsse)
+		sim_mpsse_reset(s);
+	return 0;
+}
+
+static void sim_notify(struct sim *sim)
+{
+	const uint64_t one = 1;
+
+	if (sim->fd < 0)
+		return;
+	if (sim_queue_size(&sim->dev) == 0 && sim_queue_size(&sim->host) == 0)
+		return;
+	if (write(sim->fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		return;
+}
+
+static int sim_write(
+	struct transport *transport, const void *buf, unsigned size)
+{
+	struct sim *s = sim(transport);
+
+	s->stats.usb_out_transfers++;
+	s->stats.usb_out_bytes += size;
+
+	// Outside of the MPSSE mode there is nobody to interpret the data.
+	if (!s->mpsse)
+		return size;
+
+	if (sim_queue_push(&s->cmd, buf, size) != 0)
+		return -1;
+
+	while (sim_queue_size(&s->cmd) != 0) {
+		const unsigned char *cmd = s->cmd.data + s->cmd.head;
+		const size_t len = sim_cmd_size(cmd, sim_queue_size(&s->cmd));
+
+		if (len == 0)
+			break;
+		if (sim_execute(s, cmd) != 0)
+			return -1;
+		sim_queue_pop(&s->cmd, NULL, len);
+	}
+
+	sim_notify(s);
+	return size;
+}
+
+static int sim_read(struct transport *transport, void *buf, unsigned size)
+{
+	struct sim *s = sim(transport);
+	uint64_t counter;
+
+	if (s->fd >= 0 &&
+	    read(s->fd, &counter, sizeof(counter)) < 0 && errno != EAGAIN)
+		return -1;
+
+	// The device sends incomplete packets when the latency timer expires,
+	// so if the host waits for the data it gets them eventually.
+	if (sim_queue_size(&s->host) == 0 && sim_queue_size(&s->dev) != 0) {
+		s->stats.latency_flushes++;
+		if (sim_flush(s) != 0)
+			return -1;
+	}
+
+	return sim_queue_pop(&s->host, buf, size);
+}
+
+static int sim_wait(struct transport *transport, int timeout)
+{
+	struct sim *s = sim(transport);
+
+	(void) timeout;
+	// Nothing happens in the simulator behind our back, so if there is
+	// no data now, there will never be, waiting for it would hang.
+	if (sim_queue_size(&s->host) == 0 && sim_queue_size(&s->dev) == 0)
+		return -1;
+	return 1;
+}
+
+static int sim_fd(struct transport *transport)
+{
+	struct sim *s = sim(transport);
+
+	if (s->fd >= 0)
+		return s->fd;
+
+	s->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (s->fd < 0)
+		return -1;
+	sim_notify(s);
+	return s->fd;
+}
+
+static const struct transport_ops sim_ops = {
+	.close = sim_close,
+	.reset = sim_reset,
+	.drain = sim_drain,
+	.disable_special_chars = sim_disable_special_chars,
+	.set_bit_mode = sim_set_bit_mode,
+	.write = sim_write,
+	.read = sim_read,
+	.wait = sim_wait,
+	.fd = sim_fd,
+};
+
+int sim_is_sim(struct transport *transport)
+{
+	return transport->ops == &sim_ops;
+}
+
+int sim_attach(struct transport *transport, struct sim_target *target)
+{
+	struct sim *s = sim(transport);
+	struct sim_target **last = &s->targets;
+
+	while (*last)
+		last = &(*last)->next;
+	target->next = NULL;
+	*last = target;
+	return 0;
+}
+
+void sim_stats(struct transport *transport, struct sim_stats *stats)
+{
+	*stats = sim(transport)->stats;
+}
+
+void sim_reset_stats(struct transport *transport)
+{
+	struct sim *s = sim(transport);
+
+	memset(&s->stats, 0, sizeof(s->stats));
+	s->stats_ps = s->now_ps;
+}
+
+void sim_print_stats(struct transport *transport, FILE *out)
+{
+	const struct sim_stats *stats = &sim(transport)->stats;
+
+	fprintf(out, "Simulated bus time %.3f ms, %llu commands (%llu bad)\n",
+		stats->bus_ns / 1e6, stats->commands, stats->bad_commands);
+	fprintf(out, "USB out %llu transfers, %llu bytes\n",
+		stats->usb_out_transfers, stats->usb_out_bytes);
+	fprintf(out, "USB in %llu packets, %llu bytes, %llu latency flushes, "
+		"%llu bytes max unread\n",
+		stats->usb_in_packets, stats->usb_in_bytes,
+		stats->latency_flushes, stats->max_unread);
+}
+
+// Parses one target in format name[@addr] and attaches it to the simulator.
+static int sim_parse_target(struct sim *sim, const char *spec, size_t len)
+{
+	char name[32];
+	const char *at = memchr(spec, '@', len);
+	const size_t name_len = at ? (size_t)(at - spec) : len;
+	struct sim_target *target = NULL;
+	unsigned long addr = 0;
+	char *end;
+
+	if (name_len == 0 || name_len >= sizeof(name))
+		return -1;
+	memcpy(name, spec, name_len);
+	name[name_len] = '\0';
+
+	if (at) {
+		addr = strtoul(at + 1, &end, 0);
+		if (end != spec + len || end == at + 1 || addr > 0x7f)
+			return -1;
+	}
+
+	if (strcmp(name, "nunchuk") == 0) {
+		target = sim_nunchuk_create(at ? addr : 0x52);
+	} else if (strncmp(name, "24c", 3) == 0) {
+		const unsigned long kbit = strtoul(name + 3, &end, 10);
+
+		if (*end != '\0' || kbit == 0 || kbit > 512 ||
+		    (kbit & (kbit - 1)) != 0)
+			return -1;
+		target = sim_eeprom_create(at ? addr : 0x50, kbit * 128);
+	} else {
+		return -1;
+	}
+
+	if (!target)
+		return -1;
+	return sim_attach(&sim->transport, target);
+}
+
+int sim_open(const char *spec, struct transport **transport)
+{
+	static const char defaults[] = "nunchuk,24c02";
+	struct sim *s;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return -1;
+	s->transport.ops = &sim_ops;
+	s->fd = -1;
+	sim_mpsse_reset(s);
+
+	if (*spec == '\0')
+		spec = defaults;
+
+	while (*spec) {
+		const char *comma = strchr(spec, ',');
+		const size_t len = comma ?
+			(size_t)(comma - spec) : strlen(spec);
+
+		if (sim_parse_target(s, spec, len) != 0) {
+			sim_close(&s->transport);
+			return -1;
+		}
+		spec += comma ? len + 1 : len;
+	}
+
+	*transport = &s->transport;
+	return 0;
+}
@@ -0,0 +1,89 @@
+// SPDX-License-Identifier: GPL-2.0
+#ifndef __SIM_H__
+#define __SIM_H__
+
+#include <stdio.h>
+
+#include "transport.h"
+
+// Simulator is a transport that doesn't talk to any hardware. Instead it
+// interprets the MPSSE commands itself and drives a virtual I2C bus with
+// target models attached to it, the way an FT232H wired as an I2C master
+// would: ADBUS0 is SCL, ADBUS1 and ADBUS2 are both connected to SDA and both
+// lines are open-drain with pull-ups.
+//
+// Everything happens synchronously inside the write operation, so the
+// results are deterministic and the simulator accounts for the time the
+// commands would take on the bus and the USB transfers they would need.
+
+// I2C target model. The bus calls start when the master addresses the
+// target, write for every byte the master sends and read for every byte the
+// master wants to read, stop is called on STOP condition if the target was
+// addressed. now is the simulated bus time in nanoseconds. start and write
+// return non-0 to ACK and 0 to NACK.
+struct sim_target;
+
+struct sim_target_ops {
+	int (*start)(
+		struct sim_target *target, int read, unsigned long long now);
+	int (*write)(struct sim_target *target, unsigned char byte);
+	unsigned char (*read)(struct sim_target *target);
+	void (*stop)(struct sim_target *target, unsigned long long now);
+	void (*release)(struct sim_target *target);
+};
+
+// Target models embed this structure and keep their own state next to it.
+struct sim_target {
+	const struct sim_target_ops *ops;
+	unsigned addr;
+	struct sim_target *next;
+};
+
+// Wii nunchuk: a register file where the first byte written sets the
+// register pointer, the following bytes are written to the registers and
+// reads return the registers starting from the pointer.
+struct sim_target *sim_nunchuk_create(unsigned addr);
+
+// 24Cxx EEPROM of the given size in bytes, after a write the EEPROM doesn't
+// respond to its address until the write cycle completes. Parts up to 256
+// bytes take one byte of the memory address, 4KiB and larger parts take two.
+struct sim_target *sim_eeprom_create(unsigned addr, unsigned size);
+
+struct sim_stats {
+	// Time the MPSSE spent clocking the bus and changing the pins.
+	unsigned long long bus_ns;
+	unsigned long long commands;
+	unsigned long long bad_commands;
+	unsigned long long usb_out_transfers;
+	unsigned long long usb_out_bytes;
+	unsigned long long usb_in_packets;
+	unsigned long long usb_in_bytes;
+	// How many times the host had to wait for the latency timer, because
+	// the responses were not followed by the send immediate command.
+	unsigned long long latency_flushes;
+	// The largest amount of responses generated, but not read by the
+	// host yet.
+	unsigned long long max_unread;
+};
+
+// Opens the simulator, the spec is a comma separated list of the targets
+// on the bus in format name[@addr], where name is nunchuk or 24cNN (e.g.
+// 24c02 or 24c256). An empty spec attaches a nunchuk at 0x52 and a 24c02 at
+// 0x50. Returns 0 on success and a non-0 value otherwise.
+int sim_open(const char *spec, struct transport **transport);
+
+// Attaches another target model to the bus, the simulator takes ownership
+// of the target.
+int sim_attach(struct transport *transport, struct sim_target *target);
+
+// Returns non-0 if the transport is a simulator.
+int sim_is_sim(struct transport *transport);
+
+void sim_stats(struct transport *transport, struct sim_stats *stats);
+void sim_reset_stats(struct transport *transport);
+
+// Prints the statistics collected since the last reset, tools call it
+// before closing the device when they run on top of the simulator.
+void sim_print_stats(struct transport *transport, FILE *out);
+
+#endif  // __SIM_H__
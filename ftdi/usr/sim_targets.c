@@ -0,0 +1,215 @@
+// SPDX-License-Identifier: GPL-2.0
+#include "sim.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define SIM_NUNCHUK_REGS 256
+
+struct sim_nunchuk {
+	struct sim_target target;
+	unsigned char regs[SIM_NUNCHUK_REGS];
+	unsigned char ptr;
+	// The first byte of a write sets the register pointer.
+	int first;
+};
+
+// The joystick in the center, accelerometers at rest and both buttons
+// released, followed by the identification bytes of the nunchuk.
+static const unsigned char sim_nunchuk_data[] = {
+	0x80, 0x80, 0x80, 0x80, 0xb3, 0xff
+};
+static const unsigned char sim_nunchuk_id[] = {
+	0x00, 0x00, 0xa4, 0x20, 0x00, 0x00
+};
+
+static int sim_nunchuk_start(
+	struct sim_target *target, int read, unsigned long long now)
+{
+	struct sim_nunchuk *nunchuk = (struct sim_nunchuk *)target;
+
+	(void) now;
+	if (!read)
+		nunchuk->first = 1;
+	return 1;
+}
+
+static int sim_nunchuk_write(struct sim_target *target, unsigned char byte)
+{
+	struct sim_nunchuk *nunchuk = (struct sim_nunchuk *)target;
+
+	if (nunchuk->first) {
+		nunchuk->ptr = byte;
+		nunchuk->first = 0;
+		return 1;
+	}
+
+	nunchuk->regs[nunchuk->ptr++] = byte;
+	return 1;
+}
+
+static unsigned char sim_nunchuk_read(struct sim_target *target)
+{
+	struct sim_nunchuk *nunchuk = (struct sim_nunchuk *)target;
+
+	return nunchuk->regs[nunchuk->ptr++];
+}
+
+static void sim_nunchuk_release(struct sim_target *target)
+{
+	free(target);
+}
+
+static const struct sim_target_ops sim_nunchuk_ops = {
+	.start = sim_nunchuk_start,
+	.write = sim_nunchuk_write,
+	.read = sim_nunchuk_read,
+	.release = sim_nunchuk_release,
+};
+
+struct sim_target *sim_nunchuk_create(unsigned addr)
+{
+	struct sim_nunchuk *nunchuk = calloc(1, sizeof(*nunchuk));
+
+	if (!nunchuk)
+		return NULL;
+
+	memcpy(nunchuk->regs, sim_nunchuk_data, sizeof(sim_nunchuk_data));
+	memcpy(&nunchuk->regs[SIM_NUNCHUK_REGS - sizeof(sim_nunchuk_id)],
+	       sim_nunchuk_id, sizeof(sim_nunchuk_id));
+	nunchuk->target.ops = &sim_nunchuk_ops;
+	nunchuk->target.addr = addr;
+	return &nunchuk->target;
+}
+
+
+// Time it takes the EEPROM to program the data it received, the EEPROM
+// doesn't respond to its address until then.
+static const unsigned long long SIM_EEPROM_WRITE_CYCLE_NS = 5000000;
+
+struct sim_eeprom {
+	struct sim_target target;
+	unsigned char *mem;
+	unsigned size;
+	unsigned page;
+	unsigned addr_bytes;
+
+	unsigned ptr;
+	// Number of the address bytes and the data bytes received since the
+	// beginning of the current write.
+	unsigned addr_seen;
+	unsigned written;
+	unsigned long long busy_until;
+};
+
+static int sim_eeprom_start(
+	struct sim_target *target, int read, unsigned long long now)
+{
+	struct sim_eeprom *eeprom = (struct sim_eeprom *)target;
+
+	if (now < eeprom->busy_until)
+		return 0;
+
+	if (!read) {
+		eeprom->addr_seen = 0;
+		eeprom->written = 0;
+	}
+	return 1;
+}
+
+static int sim_eeprom_write(struct sim_target *target, unsigned char byte)
+{
+	struct sim_eeprom *eeprom = (struct sim_eeprom *)target;
+	unsigned base;
+
+	if (eeprom->addr_seen < eeprom->addr_bytes) {
+		if (eeprom->addr_seen == 0)
+			eeprom->ptr = 0;
+		eeprom->ptr = ((eeprom->ptr << 8) | byte) & (eeprom->size - 1);
+		eeprom->addr_seen++;
+		return 1;
+	}
+
+	// Writes wrap around within the page.
+	base = eeprom->ptr & ~(eeprom->page - 1);
+	eeprom->mem[eeprom->ptr] = byte;
+	eeprom->ptr = base | ((eeprom->ptr + 1) & (eeprom->page - 1));
+	eeprom->written++;
+	return 1;
+}
+
+static unsigned char sim_eeprom_read(struct sim_target *target)
+{
+	struct sim_eeprom *eeprom = (struct sim_eeprom *)target;
+	const unsigned char byte = eeprom->mem[eeprom->ptr];
+
+	eeprom->ptr = (eeprom->ptr + 1) & (eeprom->size - 1);
+	return byte;
+}
+
+static void sim_eeprom_stop(struct sim_target *target, unsigned long long now)
+{
+	struct sim_eeprom *eeprom = (struct sim_eeprom *)target;
+
+	if (eeprom->written != 0)
+		eeprom->busy_until = now + SIM_EEPROM_WRITE_CYCLE_NS;
+	eeprom->addr_seen = 0;
+	eeprom->written = 0;
+}
+
+static void sim_eeprom_release(struct sim_target *target)
+{
+	struct sim_eeprom *eeprom = (struct sim_eeprom *)target;
+
+	free(eeprom->mem);
+	free(eeprom);
+}
+
+static const struct sim_target_ops sim_eeprom_ops = {
+	.start = sim_eeprom_start,
+	.write = sim_eeprom_write,
+	.read = sim_eeprom_read,
+	.stop = sim_eeprom_stop,
+	.release = sim_eeprom_release,
+};
+
+// Page sizes of the common 24Cxx parts, larger parts have larger pages.
+static unsigned sim_eeprom_page(unsigned size)
+{
+	if (size <= 256)
+		return 8;
+	if (size <= 8192)
+		return 32;
+	if (size <= 32768)
+		return 64;
+	return 128;
+}
+
+struct sim_target *sim_eeprom_create(unsigned addr, unsigned size)
+{
+	struct sim_eeprom *eeprom;
+
+	// 24C04 to 24C16 take the high bits of the memory address from the I2C
+	// address and respond to several addresses, we don't model them.
+	if (size == 0 || (size & (size - 1)) != 0 || size > 65536 ||
+	    (size > 256 && size < 4096))
+		return NULL;
+
+	eeprom = calloc(1, sizeof(*eeprom));
+	if (!eeprom)
+		return NULL;
+
+	eeprom->mem = malloc(size);
+	if (!eeprom->mem) {
+		free(eeprom);
+		return NULL;
+	}
+
+	memset(eeprom->mem, 0xff, size);
+	eeprom->size = size;
+	eeprom->page = sim_eeprom_page(size);
+	eeprom->addr_bytes = size <= 256 ? 1 : 2;
+	eeprom->target.ops = &sim_eeprom_ops;
+	eeprom->target.addr = addr;
+	return &eeprom->target;
+}
@@ -0,0 +1,196 @@
+// SPDX-License-Identifier: GPL-2.0
+#include "spi.h"
+
+
+// Waits for the MPSSE IO buffer in the slot to complete, the data it read
+// went straight to the rx buffers of the segments, so the slot is ready to
+// be reused after that.
+static int spi_bus_complete(struct spi_bus *spi, unsigned slot)
+{
+	int ret = 0;
+
+	if (spi->busy[slot]) {
+		ret = mpsse_wait(spi->mpsse, &spi->req[slot]);
+		spi->busy[slot] = 0;
+	}
+	mpsse_io_buffer_reset(&spi->io[slot]);
+	return ret;
+}
+
+// Sends the commands accumulated in the current slot and switches to the
+// other slot, waiting for it to complete if it's still in flight.
+static int spi_bus_flush(struct spi_bus *spi, unsigned *slot)
+{
+	struct mpsse_io_buffer *io = &spi->io[*slot];
+
+	if (io->cmd_size != 0) {
+		struct mpsse_request *req = &spi->req[*slot];
+
+		if (mpsse_submit_async(spi->mpsse, io, req, NULL, NULL) != 0)
+			return -1;
+		spi->busy[*slot] = 1;
+	}
+
+	*slot ^= 1;
+	return spi_bus_complete(spi, *slot);
+}
+
+// Commands that read have to fit into the RX FIFO several times over, so
+// mpsse_submit can keep a few of them in flight, writes are only limited by
+// the size of the MPSSE command.
+static unsigned spi_shift_limit(unsigned mode)
+{
+	return mode & MPSSE_SHIFT_IN ? MPSSE_RX_WINDOW / 4 : 0x10000;
+}
+
+static void spi_encode_select(struct spi_bus *spi, struct mpsse_io_buffer *io)
+{
+	const unsigned pinvals = spi->pinvals & ~(1u << spi->cs);
+
+	mpsse_set_output(io, spi->pinmask, pinvals, NULL);
+}
+
+static void spi_encode_deselect(
+	struct spi_bus *spi, struct mpsse_io_buffer *io)
+{
+	mpsse_set_output(io, spi->pinmask, spi->pinvals, NULL);
+}
+
+static int spi_bus_setup(struct spi_bus *spi, unsigned divisor)
+{
+	struct mpsse_io_buffer *io = &spi->io[0];
+	int ret;
+
+	mpsse_disable_freq_div5(io, NULL);
+	mpsse_disable_adaptive_clocking(io, NULL);
+	mpsse_disable_3phase_clocking(io, NULL);
+	mpsse_set_drive0_pins(io, 0, NULL);
+	mpsse_disable_loopback(io, NULL);
+	mpsse_set_freq_divisor(io, divisor, NULL);
+	spi_encode_deselect(spi, io);
+	ret = mpsse_submit(spi->mpsse, io);
+	mpsse_io_buffer_reset(io);
+	return ret;
+}
+
+int spi_bus_open(
+	struct spi_bus *spi,
+	struct mpsse *mpsse,
+	unsigned mode,
+	unsigned cs,
+	unsigned hz)
+{
+	const int cpol = (mode & SPI_CPOL) != 0;
+	const int cpha = (mode & SPI_CPHA) != 0;
+	unsigned divisor;
+
+	if ((mode & ~(SPI_MODE_3 | SPI_LSB_FIRST)) != 0)
+		return -1;
+	// ADBUS0 to ADBUS2 are taken by SCK, MOSI and MISO.
+	if (cs < 3 || cs > 15)
+		return -1;
+	if (hz == 0)
+		return -1;
+
+	// SCK is 30MHz / (1 + divisor).
+	divisor = (SPI_MAX_HZ + hz - 1) / hz - 1;
+	if (divisor > 0xffff)
+		divisor = 0xffff;
+
+	spi->mpsse = mpsse;
+	spi->mode = mode;
+	spi->cs = cs;
+	spi->hz = SPI_MAX_HZ / (1 + divisor);
+	// In modes 0 and 3 the target samples MOSI on the rising edge of SCK,
+	// so we change it on the falling edge and sample MISO on the rising
+	// edge. In modes 1 and 2 it's the other way around.
+	spi->shift = cpol == cpha ? MPSSE_SHIFT_OUT_NEG : MPSSE_SHIFT_IN_NEG;
+	if (mode & SPI_LSB_FIRST)
+		spi->shift |= MPSSE_SHIFT_LSB_FIRST;
+	// SCK, MOSI and the chip select are outputs, SCK idles according to
+	// CPOL and the chip select idles high.
+	spi->pinmask = 0x3 | (1u << cs);
+	spi->pinvals = (cpol ? 0x1 : 0x0) | (1u << cs);
+	for (unsigned i = 0; i < 2; ++i) {
+		mpsse_io_buffer_setup(&spi->io[i]);
+		spi->busy[i] = 0;
+	}
+
+	if (spi_bus_setup(spi, divisor) != 0) {
+		spi_bus_close(spi);
+		return -1;
+	}
+
+	return 0;
+}
+
+void spi_bus_close(struct spi_bus *spi)
+{
+	for (unsigned i = 0; i < 2; ++i)
+		mpsse_io_buffer_release(&spi->io[i]);
+	spi->mpsse = NULL;
+}
+
+int spi_bus_transfer(
+	struct spi_bus *spi, const struct spi_segment *segs, unsigned count)
+{
+	unsigned slot = 0;
+	int selected = 0;
+	int ret = 0;
+
+	for (unsigned i = 0; i < count; ++i) {
+		if (!segs[i].tx && !segs[i].rx)
+			return -1;
+	}
+
+	for (unsigned i = 0; i < count && ret == 0; ++i) {
+		const struct spi_segment *seg = &segs[i];
+		const unsigned char *tx = seg->tx;
+		unsigned char *rx = seg->rx;
+		const unsigned mode = spi->shift |
+			(tx ? MPSSE_SHIFT_OUT : 0) |
+			(seg->rx ? MPSSE_SHIFT_IN : 0);
+
+		if (!selected) {
+			spi_encode_select(spi, &spi->io[slot]);
+			selected = 1;
+		}
+
+		for (unsigned pos = 0; pos < seg->len && ret == 0;) {
+			struct mpsse_io_buffer *io = &spi->io[slot];
+			unsigned n = seg->len - pos;
+
+			if (n > spi_shift_limit(mode))
+				n = spi_shift_limit(mode);
+			if (rx)
+				mpsse_shift_bytes_to(io, mode,
+						     tx ? tx + pos : NULL,
+						     rx + pos, n, NULL);
+			else
+				mpsse_shift_bytes(
+					io, mode, tx ? tx + pos : NULL, n,
+					NULL);
+			pos += n;
+
+			if (io->cmd_size + io->data_size + io->sink_size >=
+					SPI_CHUNK_SIZE)
+				ret = spi_bus_flush(spi, &slot);
+		}
+
+		if ((seg->flags & SPI_SEGMENT_CS_CHANGE) || i + 1 == count) {
+			spi_encode_deselect(spi, &spi->io[slot]);
+			selected = 0;
+		}
+	}
+
+	if (ret == 0)
+		ret = spi_bus_flush(spi, &slot);
+
+	// Whatever happened the requests in flight must complete before we
+	// return, the current slot is the last one submitted.
+	if (spi_bus_complete(spi, slot ^ 1) != 0)
+		ret = -1;
+	if (spi_bus_complete(spi, slot) != 0)
+		ret = -1;
+	return ret;
+}
@@ -0,0 +1,83 @@
+// SPDX-License-Identifier: GPL-2.0
+#ifndef __SPI_H__
+#define __SPI_H__
+
+#include "mpsse.h"
+
+// SPI bus on top of an MPSSE device: ADBUS0 is SCK, ADBUS1 is MOSI, ADBUS2 is
+// MISO and the chip select is one of the remaining GPIO pins (ADBUS3 by
+// default), the chip select is active low.
+//
+// SPI mode flags, the same as used by Linux spidev.
+#define SPI_CPHA 0x01u
+#define SPI_CPOL 0x02u
+#define SPI_MODE_0 0
+#define SPI_MODE_1 SPI_CPHA
+#define SPI_MODE_2 SPI_CPOL
+#define SPI_MODE_3 (SPI_CPOL | SPI_CPHA)
+#define SPI_LSB_FIRST 0x08u
+
+// With the divide by 5 disabled the MPSSE clock is 60MHz and SCK is at most
+// half of that.
+#define SPI_MAX_HZ 30000000u
+#define SPI_DEFAULT_CS 3
+
+// Transfers are split into chunks of that many bytes, while the device
+// executes one chunk the next one is prepared and sent.
+#define SPI_CHUNK_SIZE 65536
+
+struct spi_bus {
+	struct mpsse *mpsse;
+	unsigned mode;
+	unsigned cs;
+	unsigned hz;
+	// MPSSE_SHIFT_* mode of the data shifting commands.
+	unsigned shift;
+	// Direction and the idle values of the pins.
+	unsigned pinmask;
+	unsigned pinvals;
+	// Two MPSSE IO buffers, so one can be filled while the other one is
+	// in flight. Amount of data written and read by the commands in each
+	// of them is tracked to decide when to send it.
+	struct mpsse_io_buffer io[2];
+	struct mpsse_request req[2];
+	unsigned queued[2];
+	int busy[2];
+};
+
+// Configures the MPSSE device for SPI with the given mode flags, the chip
+// select pin and the SCK frequency, the actual frequency is the highest
+// one the MPSSE can generate that is not above the requested one. Returns 0
+// on success and a non-0 value otherwise.
+int spi_bus_open(
+	struct spi_bus *spi,
+	struct mpsse *mpsse,
+	unsigned mode,
+	unsigned cs,
+	unsigned hz);
+void spi_bus_close(struct spi_bus *spi);
+
+// SPI segment flags:
+//   * SPI_SEGMENT_CS_CHANGE - deselect the target after the segment, so the
+//     next segment starts a new SPI command.
+#define SPI_SEGMENT_CS_CHANGE 0x1u
+
+// SPI segment describes a part of an SPI transfer. The segment writes len
+// bytes from tx and, at the same time, reads len bytes into rx. Either tx or
+// rx may be NULL, but not both.
+struct spi_segment {
+	const void *tx;
+	void *rx;
+	unsigned len;
+	unsigned flags;
+};
+
+// Executes the segments selecting the target before the first segment and
+// deselecting it after the last one. The segments may be of any length, the
+// commands are streamed to the device in chunks of SPI_CHUNK_SIZE bytes and
+// small segments share a single submission. Returns 0 on success and a non-0
+// value otherwise.
+int spi_bus_transfer(
+	struct spi_bus *spi, const struct spi_segment *segs, unsigned count);
+
+#endif  // __SPI_H__
@@ -0,0 +1,621 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mpsse.h"
+#include "spi.h"
+
+// Commands common to the SPI NOR flashes, only 3 byte addresses are used, so
+// only the first 16MiB of larger parts are accessible.
+#define FLASH_WRITE_ENABLE 0x06
+#define FLASH_READ_STATUS 0x05
+#define FLASH_PAGE_PROGRAM 0x02
+#define FLASH_SECTOR_ERASE 0x20
+#define FLASH_BLOCK_ERASE 0xd8
+#define FLASH_FAST_READ 0x0b
+#define FLASH_READ_ID 0x9f
+
+#define FLASH_STATUS_BUSY 0x01
+
+#define FLASH_PAGE_SIZE 256u
+#define FLASH_SECTOR_SIZE 4096u
+#define FLASH_BLOCK_SIZE 65536u
+#define FLASH_MAX_SIZE (1u << 24)
+
+// Typical page program time, used to guess how long to poll the status
+// after the first page, the following pages use the time the previous page
+// actually took.
+#define FLASH_PAGE_PROGRAM_US 700u
+#define FLASH_MAX_POLL 65536u
+
+struct flash {
+	struct spi_bus *spi;
+	unsigned size;
+	// How many status bytes to read right after a page program command.
+	unsigned poll;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *what, unsigned size, double start)
+{
+	const double seconds = now() - start;
+
+	fprintf(stdout, "%s %u bytes in %.3f s, %.2f MB/s\n",
+		what, size, seconds,
+		seconds > 0 ? size / seconds / 1e6 : 0.0);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stdout,
+		"%s -s serial [-c cs] [-f hz] [-a addr] [-l size] "
+		"[-r file | -w file | -v file | -e] [-h]\n\n"
+		"\t-h           print the usage information.\n"
+		"\t-s serial    specify the FTDI serial number of the device "
+		"               used as SPI bridge, optionally prefixed "
+		"               with the transport, e.g. d2xx:serial or "
+		"               usb:serial[@vid:pid], the usb transport "
+		"               looks for 0x0005:0x0001 and then for "
+		"               0x0403:0x6014 by default.\n"
+		"\t-c cs        ADBUS/ACBUS pin used as chip select, 3 by "
+		"               default.\n"
+		"\t-f hz        SCK frequency, 30MHz by default.\n"
+		"\t-a addr      flash address to start from, 0 by default.\n"
+		"\t-l size      amount of data to read or erase, the whole "
+		"               flash by default.\n"
+		"\t-r file      read the flash into the file.\n"
+		"\t-w file      erase the sectors covered by the file, "
+		"               program the file and verify it.\n"
+		"\t-v file      compare the flash with the file.\n"
+		"\t-e           erase the sectors covering the range.\n",
+		name);
+}
+
+static int flash_read_id(struct flash *flash)
+{
+	const unsigned char cmd = FLASH_READ_ID;
+	unsigned char id[3];
+	struct spi_segment segs[] = {
+		{ &cmd, NULL, sizeof(cmd), 0 },
+		{ NULL, id, sizeof(id), 0 },
+	};
+
+	if (spi_bus_transfer(flash->spi, segs, 2) != 0)
+		return -1;
+
+	if ((id[0] == 0x00 && id[1] == 0x00) ||
+	    (id[0] == 0xff && id[1] == 0xff)) {
+		fprintf(stderr, "No SPI flash found\n");
+		return -1;
+	}
+
+	// Most vendors encode the size as log2 of the size in bytes.
+	fprintf(stdout, "JEDEC ID: 0x%02x 0x%02x 0x%02x\n",
+		id[0], id[1], id[2]);
+	if (id[2] < 16 || id[2] > 31) {
+		fprintf(stderr, "Unknown flash size code 0x%02x\n", id[2]);
+		return -1;
+	}
+	flash->size = 1u << id[2];
+	if (flash->size > FLASH_MAX_SIZE) {
+		fprintf(stderr,
+			"Only the first %u bytes of the flash are accessible\n",
+			FLASH_MAX_SIZE);
+		flash->size = FLASH_MAX_SIZE;
+	}
+	return 0;
+}
+
+static void flash_addr(unsigned char *cmd, unsigned char op, unsigned addr)
+{
+	cmd[0] = op;
+	cmd[1] = (addr >> 16) & 0xff;
+	cmd[2] = (addr >> 8) & 0xff;
+	cmd[3] = addr & 0xff;
+}
+
+// Returns the index of the first status byte that has the busy bit clear or
+// size if the flash is busy in all of them.
+static unsigned flash_ready(const unsigned char *status, unsigned size)
+{
+	for (unsigned i = 0; i < size; ++i) {
+		if (!(status[i] & FLASH_STATUS_BUSY))
+			return i;
+	}
+	return size;
+}
+
+// Polls the status of the flash until it's not busy anymore, erases take
+// milliseconds to seconds, so sleep between the polls.
+static int flash_wait(struct flash *flash, unsigned sleep_us)
+{
+	const unsigned char cmd = FLASH_READ_STATUS;
+	unsigned char status[16];
+	struct spi_segment segs[] = {
+		{ &cmd, NULL, sizeof(cmd), 0 },
+		{ NULL, status, sizeof(status), 0 },
+	};
+
+	while (1) {
+		if (spi_bus_transfer(flash->spi, segs, 2) != 0)
+			return -1;
+		if (flash_ready(status, sizeof(status)) < sizeof(status))
+			return 0;
+		if (sleep_us)
+			usleep(sleep_us);
+	}
+}
+
+static int flash_read(
+	struct flash *flash, unsigned addr, void *data, unsigned size)
+{
+	unsigned char cmd[5];
+	struct spi_segment segs[] = {
+		{ cmd, NULL, sizeof(cmd), 0 },
+		{ NULL, data, size, 0 },
+	};
+
+	// Fast read takes one dummy byte after the address.
+	flash_addr(cmd, FLASH_FAST_READ, addr);
+	cmd[4] = 0;
+	return spi_bus_transfer(flash->spi, segs, 2);
+}
+
+static int flash_erase(struct flash *flash, unsigned addr, unsigned size)
+{
+	const unsigned char wren = FLASH_WRITE_ENABLE;
+	const unsigned end = addr + size;
+	unsigned char cmd[4];
+	struct spi_segment segs[] = {
+		{ &wren, NULL, sizeof(wren), SPI_SEGMENT_CS_CHANGE },
+		{ cmd, NULL, sizeof(cmd), 0 },
+	};
+
+	while (addr < end) {
+		unsigned step = FLASH_SECTOR_SIZE;
+		unsigned char op = FLASH_SECTOR_ERASE;
+
+		if (addr % FLASH_BLOCK_SIZE == 0 &&
+		    end - addr >= FLASH_BLOCK_SIZE) {
+			step = FLASH_BLOCK_SIZE;
+			op = FLASH_BLOCK_ERASE;
+		}
+
+		flash_addr(cmd, op, addr);
+		if (spi_bus_transfer(flash->spi, segs, 2) != 0 ||
+		    flash_wait(flash, 1000) != 0)
+			return -1;
+		addr += step;
+	}
+
+	return 0;
+}
+
+static int flash_page_empty(const unsigned char *data, unsigned size)
+{
+	for (unsigned i = 0; i < size; ++i) {
+		if (data[i] != 0xff)
+			return 0;
+	}
+	return 1;
+}
+
+// Every submission polls the status while the previous page is programmed
+// and then sends the write enable and the program commands for the next page,
+// so every page costs one round trip. If the flash was still busy at the end
+// of the poll it ignored the commands for the next page, in that case we wait
+// and program the page again.
+static int flash_program(
+	struct flash *flash, unsigned addr, const void *data, unsigned size)
+{
+	const unsigned char rdsr = FLASH_READ_STATUS;
+	const unsigned char wren = FLASH_WRITE_ENABLE;
+	const unsigned char *bytes = data;
+	unsigned char cmd[4 + FLASH_PAGE_SIZE];
+	unsigned char *status;
+	unsigned poll = 0;
+	unsigned pos = 0;
+
+	status = malloc(FLASH_MAX_POLL);
+	if (!status)
+		return -1;
+
+	while (pos < size) {
+		const unsigned offset = (addr + pos) % FLASH_PAGE_SIZE;
+		unsigned len = FLASH_PAGE_SIZE - offset;
+		struct spi_segment segs[4];
+		unsigned count = 0;
+
+		if (len > size - pos)
+			len = size - pos;
+		// Erased flash is all 0xff already.
+		if (flash_page_empty(bytes + pos, len)) {
+			pos += len;
+			continue;
+		}
+
+		if (poll != 0) {
+			segs[count++] = (struct spi_segment){
+				&rdsr, NULL, sizeof(rdsr), 0 };
+			segs[count++] = (struct spi_segment){
+				NULL, status, poll, SPI_SEGMENT_CS_CHANGE };
+		}
+		segs[count++] = (struct spi_segment){
+			&wren, NULL, sizeof(wren), SPI_SEGMENT_CS_CHANGE };
+		flash_addr(cmd, FLASH_PAGE_PROGRAM, addr + pos);
+		memcpy(&cmd[4], bytes + pos, len);
+		segs[count++] = (struct spi_segment){ cmd, NULL, 4 + len, 0 };
+
+		if (spi_bus_transfer(flash->spi, segs, count) != 0)
+			goto err;
+
+		if (poll != 0) {
+			const unsigned ready = flash_ready(status, poll);
+
+			if (ready == poll) {
+				if (flash_wait(flash, 0) != 0)
+					goto err;
+				flash->poll = poll * 2 > FLASH_MAX_POLL ?
+					FLASH_MAX_POLL : poll * 2;
+				// Program the page again, but now there is
+				// nothing to poll.
+				poll = 0;
+				continue;
+			}
+			// Leave some margin, so we don't have to redo pages
+			// because of small variations of the program time.
+			flash->poll = ready + ready / 4 + 8;
+			if (flash->poll > FLASH_MAX_POLL)
+				flash->poll = FLASH_MAX_POLL;
+		}
+
+		poll = flash->poll;
+		pos += len;
+	}
+
+	free(status);
+	return flash_wait(flash, 0);
+
+err:
+	free(status);
+	return -1;
+}
+
+static int flash_verify(
+	struct flash *flash, unsigned addr, const void *data, unsigned size)
+{
+	const unsigned char *expected = data;
+	unsigned char *actual = malloc(size);
+
+	if (!actual)
+		return -1;
+
+	if (flash_read(flash, addr, actual, size) != 0) {
+		free(actual);
+		return -1;
+	}
+
+	for (unsigned i = 0; i < size; ++i) {
+		if (actual[i] != expected[i]) {
+			fprintf(stderr,
+				"Mismatch at 0x%06x: expected 0x%02x, "
+				"got 0x%02x\n",
+				addr + i, expected[i], actual[i]);
+			free(actual);
+			return -1;
+		}
+	}
+
+	free(actual);
+	return 0;
+}
+
+// Maps the whole image file for reading.
+static void *map_image(const char *name, unsigned *size)
+{
+	struct stat st;
+	void *data;
+	int fd;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) != 0 || st.st_size == 0 ||
+	    st.st_size > FLASH_MAX_SIZE) {
+		close(fd);
+		return NULL;
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return NULL;
+
+	*size = st.st_size;
+	return data;
+}
+
+static int do_read(
+	struct flash *flash, unsigned addr, unsigned size, const char *name)
+{
+	double start;
+	void *data;
+	int ret;
+	int fd;
+
+	fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to create %s\n", name);
+		return -1;
+	}
+
+	// The data read goes straight to the page cache of the file.
+	if (ftruncate(fd, size) != 0) {
+		fprintf(stderr, "Failed to resize %s\n", name);
+		close(fd);
+		return -1;
+	}
+
+	data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		fprintf(stderr, "Failed to map %s\n", name);
+		return -1;
+	}
+
+	start = now();
+	ret = flash_read(flash, addr, data, size);
+	if (ret == 0)
+		report("Read", size, start);
+	else
+		fprintf(stderr, "Failed to read the flash\n");
+	munmap(data, size);
+	return ret;
+}
+
+static int do_erase(struct flash *flash, unsigned addr, unsigned size)
+{
+	const double start = now();
+
+	if (flash_erase(flash, addr, size) != 0) {
+		fprintf(stderr, "Failed to erase the flash\n");
+		return -1;
+	}
+	report("Erased", size, start);
+	return 0;
+}
+
+static int do_write(struct flash *flash, unsigned addr, const char *name)
+{
+	unsigned size;
+	double start;
+	void *data;
+	int ret = -1;
+
+	data = map_image(name, &size);
+	if (!data) {
+		fprintf(stderr, "Failed to map %s\n", name);
+		return -1;
+	}
+
+	if (size > flash->size - addr) {
+		fprintf(stderr, "%s doesn't fit into the flash\n", name);
+		goto out;
+	}
+
+	// The erase covers whole sectors.
+	if (do_erase(flash, addr, (size + FLASH_SECTOR_SIZE - 1) /
+			FLASH_SECTOR_SIZE * FLASH_SECTOR_SIZE) != 0)
+		goto out;
+
+	start = now();
+	if (flash_program(flash, addr, data, size) != 0) {
+		fprintf(stderr, "Failed to program the flash\n");
+		goto out;
+	}
+	report("Programmed", size, start);
+
+	start = now();
+	if (flash_verify(flash, addr, data, size) != 0) {
+		fprintf(stderr, "Failed to verify the flash\n");
+		goto out;
+	}
+	report("Verified", size, start);
+	ret = 0;
+
+out:
+	munmap(data, size);
+	return ret;
+}
+
+static int do_verify(struct flash *flash, unsigned addr, const char *name)
+{
+	unsigned size;
+	double start;
+	void *data;
+	int ret;
+
+	data = map_image(name, &size);
+	if (!data) {
+		fprintf(stderr, "Failed to map %s\n", name);
+		return -1;
+	}
+
+	if (size > flash->size - addr) {
+		fprintf(stderr, "%s doesn't fit into the flash\n", name);
+		munmap(data, size);
+		return -1;
+	}
+
+	start = now();
+	ret = flash_verify(flash, addr, data, size);
+	if (ret == 0)
+		report("Verified", size, start);
+	else
+		fprintf(stderr, "Failed to verify the flash\n");
+	munmap(data, size);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	const char *serial = NULL;
+	const char *read_file = NULL;
+	const char *write_file = NULL;
+	const char *verify_file = NULL;
+	unsigned cs = SPI_DEFAULT_CS;
+	unsigned hz = SPI_MAX_HZ;
+	unsigned addr = 0;
+	unsigned size = 0;
+	int erase = 0;
+	int actions;
+	char *endptr;
+
+	struct mpsse mpsse;
+	struct spi_bus spi;
+	struct flash flash;
+	int ret;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:c:f:a:l:r:w:v:eh")) != -1) {
+		switch (opt) {
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		case 's':
+			serial = optarg;
+			break;
+		case 'c':
+			cs = strtoul(optarg, &endptr, 0);
+			if (*endptr != '\0') {
+				fprintf(stderr, "Failed to parse pin %s\n",
+					optarg);
+				return 1;
+			}
+			break;
+		case 'f':
+			hz = strtoul(optarg, &endptr, 0);
+			if (*endptr != '\0' || hz == 0) {
+				fprintf(stderr,
+					"Failed to parse frequency %s\n",
+					optarg);
+				return 1;
+			}
+			break;
+		case 'a':
+			addr = strtoul(optarg, &endptr, 0);
+			if (*endptr != '\0') {
+				fprintf(stderr,
+					"Failed to parse address %s\n",
+					optarg);
+				return 1;
+			}
+			break;
+		case 'l':
+			size = strtoul(optarg, &endptr, 0);
+			if (*endptr != '\0') {
+				fprintf(stderr, "Failed to parse size %s\n",
+					optarg);
+				return 1;
+			}
+			break;
+		case 'r':
+			read_file = optarg;
+			break;
+		case 'w':
+			write_file = optarg;
+			break;
+		case 'v':
+			verify_file = optarg;
+			break;
+		case 'e':
+			erase = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (!serial) {
+		fprintf(stderr, "Expect exactly one -s argument\n");
+		return 1;
+	}
+
+	actions = !!read_file + !!write_file + !!verify_file + erase;
+	if (actions != 1) {
+		fprintf(stderr, "Expect exactly one of -r, -w, -v and -e\n");
+		return 1;
+	}
+
+	if ((erase || write_file) && addr % FLASH_SECTOR_SIZE != 0) {
+		fprintf(stderr, "Address must be aligned to %u bytes\n",
+			FLASH_SECTOR_SIZE);
+		return 1;
+	}
+
+	if (mpsse_open_spec(serial, &mpsse) != 0) {
+		fprintf(stderr, "Failed to enable MPSSE on %s\n", serial);
+		return 1;
+	}
+
+	if (mpsse_verify(&mpsse) != 0) {
+		fprintf(stderr, "Failed to verify MPSSE mode on %s\n", serial);
+		mpsse_close(&mpsse);
+		return 1;
+	}
+
+	if (spi_bus_open(&spi, &mpsse, SPI_MODE_0, cs, hz) != 0) {
+		fprintf(stderr, "Failed to configure SPI on %s\n", serial);
+		mpsse_close(&mpsse);
+		return 1;
+	}
+	fprintf(stdout, "SCK: %u Hz\n", spi.hz);
+
+	flash.spi = &spi;
+	flash.poll = spi.hz / 8 / 1000 * FLASH_PAGE_PROGRAM_US / 1000 + 1;
+	if (flash_read_id(&flash) != 0) {
+		spi_bus_close(&spi);
+		mpsse_close(&mpsse);
+		return 1;
+	}
+
+	if (addr >= flash.size) {
+		fprintf(stderr, "Address 0x%x is beyond the flash\n", addr);
+		ret = -1;
+	} else {
+		if (size == 0 || size > flash.size - addr)
+			size = flash.size - addr;
+
+		if (read_file)
+			ret = do_read(&flash, addr, size, read_file);
+		else if (write_file)
+			ret = do_write(&flash, addr, write_file);
+		else if (verify_file)
+			ret = do_verify(&flash, addr, verify_file);
+		else
+			ret = do_erase(&flash, addr, size);
+	}
+
+	spi_bus_close(&spi);
+	if (mpsse_close(&mpsse) != 0) {
+		fprintf(stderr, "Failed to close %s\n", serial);
+		return 1;
+	}
+
+	return ret == 0 ? 0 : 1;
+}
@@ -0,0 +1,439 @@
+// SPDX-License-Identifier: GPL-2.0
+#include "swd.h"
+
+#include <stdlib.h>
+
+
+// The host changes SWDIO on the falling edge of SWCLK and the target samples
+// it on the rising edge, the target changes SWDIO on the rising edge and the
+// host samples it on the same edge. Everything is LSB first.
+#define SWD_OUT (MPSSE_SHIFT_OUT_NEG | MPSSE_SHIFT_LSB_FIRST | MPSSE_SHIFT_OUT)
+#define SWD_IN (MPSSE_SHIFT_LSB_FIRST | MPSSE_SHIFT_IN)
+
+// SWCLK and SWDIO out are outputs, SWCLK idles low and SWDIO high. Releasing
+// SWDIO makes ADBUS1 an input.
+#define SWD_PINMASK_DRIVE 0x0003
+#define SWD_PINMASK_RELEASE 0x0001
+#define SWD_PINVALS 0x0002
+
+// ABORT bits that clear all the sticky errors.
+#define SWD_ABORT_CLEAR 0x1eu
+
+// CTRL/STAT bits.
+#define SWD_CTRL_ORUNDETECT (1u << 0)
+#define SWD_CTRL_CDBGPWRUPREQ (1u << 28)
+#define SWD_CTRL_CDBGPWRUPACK (1u << 29)
+#define SWD_CTRL_CSYSPWRUPREQ (1u << 30)
+#define SWD_CTRL_CSYSPWRUPACK (1u << 31)
+
+// CSW for 32-bit accesses with the single auto-increment of TAR and the
+// privileged debug master access.
+#define SWD_CSW_WORD 0x23000012u
+
+// TAR auto-increment is only guaranteed within 1KiB blocks, TAR is written
+// again at the start of each block.
+#define SWD_TAR_BLOCK 1024u
+
+// How many words swd_mem_read and swd_mem_write transfer in one submission
+// and how many times a batch is retried after a WAIT.
+#define SWD_BATCH 4096u
+#define SWD_RETRIES 8
+#define SWD_POWERUP_TRIES 100
+
+struct swd_op {
+	uint32_t *dst;
+	int read;
+	// Position of the byte with the ACK in the MPSSE IO buffer data and
+	// the shift of the ACK in it.
+	unsigned ack_offset;
+	unsigned ack_shift;
+	// Position of the 32 bits of data and of the byte with the parity in
+	// the top bits for reads.
+	unsigned data_offset;
+	unsigned parity_offset;
+};
+
+static unsigned swd_parity(uint32_t value)
+{
+	value ^= value >> 16;
+	value ^= value >> 8;
+	value ^= value >> 4;
+	value ^= value >> 2;
+	value ^= value >> 1;
+	return value & 1;
+}
+
+static void swd_drive(struct swd *swd, int drive)
+{
+	if (swd->driving == drive)
+		return;
+
+	mpsse_set_output(&swd->io,
+			 drive ? SWD_PINMASK_DRIVE : SWD_PINMASK_RELEASE,
+			 SWD_PINVALS, NULL);
+	swd->driving = drive;
+}
+
+static struct swd_op *swd_add_op(struct swd *swd)
+{
+	if (swd->nops == swd->capacity) {
+		const unsigned capacity = swd->capacity ?
+			swd->capacity * 2 : 16;
+		struct swd_op *ops = realloc(
+			swd->ops, capacity * sizeof(*ops));
+
+		if (!ops) {
+			swd->error = 1;
+			return NULL;
+		}
+		swd->ops = ops;
+		swd->capacity = capacity;
+	}
+
+	return &swd->ops[swd->nops++];
+}
+
+// The request is the start bit, APnDP, RnW, A[2:3], the parity of the four
+// bits before it, the stop bit and the park bit.
+static unsigned char swd_request(int ap, int read, unsigned addr)
+{
+	const unsigned bits = (ap ? 0x2 : 0) | (read ? 0x4 : 0) |
+		((addr & 0xc) << 1);
+
+	return 0x81 | bits | (swd_parity(bits) << 5);
+}
+
+static void swd_transaction(
+	struct swd *swd, int ap, int read, unsigned addr, uint32_t value,
+	uint32_t *dst)
+{
+	struct swd_op *op = swd_add_op(swd);
+	unsigned char data[4];
+	struct mpsse_cmd cmd;
+
+	if (!op)
+		return;
+
+	op->dst = dst;
+	op->read = read;
+
+	swd_drive(swd, 1);
+	mpsse_shift_bits(&swd->io, SWD_OUT, swd_request(ap, read, addr), 8,
+			 NULL);
+	swd_drive(swd, 0);
+
+	if (read) {
+		// Turnaround and ACK, then data, parity and the turnaround
+		// back to the host.
+		mpsse_shift_bits(&swd->io, SWD_IN, 0, 4, &cmd);
+		op->ack_offset = cmd.data_offset;
+		op->ack_shift = 5;
+		mpsse_shift_bytes(&swd->io, SWD_IN, NULL, 4, &cmd);
+		op->data_offset = cmd.data_offset;
+		mpsse_shift_bits(&swd->io, SWD_IN, 0, 2, &cmd);
+		op->parity_offset = cmd.data_offset;
+		return;
+	}
+
+	// Turnaround, ACK and turnaround back to the host, then data and
+	// parity.
+	mpsse_shift_bits(&swd->io, SWD_IN, 0, 5, &cmd);
+	op->ack_offset = cmd.data_offset;
+	op->ack_shift = 4;
+	swd_drive(swd, 1);
+	data[0] = value & 0xff;
+	data[1] = (value >> 8) & 0xff;
+	data[2] = (value >> 16) & 0xff;
+	data[3] = (value >> 24) & 0xff;
+	mpsse_shift_bytes(&swd->io, SWD_OUT, data, 4, NULL);
+	mpsse_shift_bits(&swd->io, SWD_OUT, swd_parity(value), 1, NULL);
+}
+
+// Reads RDBUFF to get the data of the last AP read if it's still missing.
+static void swd_complete_posted(struct swd *swd)
+{
+	uint32_t *dst = swd->posted;
+
+	if (!dst)
+		return;
+	swd->posted = NULL;
+	swd_transaction(swd, 0, 1, SWD_DP_RDBUFF, 0, dst);
+}
+
+void swd_read_dp(struct swd *swd, unsigned addr, uint32_t *value)
+{
+	swd_complete_posted(swd);
+	swd_transaction(swd, 0, 1, addr, 0, value);
+}
+
+void swd_write_dp(struct swd *swd, unsigned addr, uint32_t value)
+{
+	swd_complete_posted(swd);
+	swd_transaction(swd, 0, 0, addr, value, NULL);
+}
+
+void swd_read_ap(struct swd *swd, unsigned addr, uint32_t *value)
+{
+	// The data of an AP read comes with the next AP read.
+	swd_transaction(swd, 1, 1, addr, 0, swd->posted);
+	swd->posted = value;
+}
+
+void swd_write_ap(struct swd *swd, unsigned addr, uint32_t value)
+{
+	swd_complete_posted(swd);
+	swd_transaction(swd, 1, 0, addr, value, NULL);
+}
+
+unsigned swd_pending(const struct swd *swd)
+{
+	return swd->nops;
+}
+
+static int swd_check(struct swd *swd, const unsigned char *data)
+{
+	for (unsigned i = 0; i < swd->nops; ++i) {
+		const struct swd_op *op = &swd->ops[i];
+		const unsigned ack =
+			(data[op->ack_offset] >> op->ack_shift) & 7;
+		const unsigned char *word = data + op->data_offset;
+		uint32_t value;
+
+		if (ack != SWD_ACK_OK) {
+			swd->status = ack;
+			return -1;
+		}
+
+		if (!op->read)
+			continue;
+
+		value = (uint32_t)word[0] | ((uint32_t)word[1] << 8) |
+			((uint32_t)word[2] << 16) | ((uint32_t)word[3] << 24);
+		if (swd_parity(value) != ((data[op->parity_offset] >> 6) & 1)) {
+			swd->status = SWD_PARITY_ERROR;
+			return -1;
+		}
+
+		if (op->dst)
+			*op->dst = value;
+	}
+
+	swd->status = SWD_ACK_OK;
+	return 0;
+}
+
+int swd_flush(struct swd *swd)
+{
+	const unsigned char idle = 0;
+	int ret = -1;
+
+	swd_complete_posted(swd);
+
+	// At least 8 idle cycles after the last transaction let the target
+	// complete it before the clock stops.
+	swd_drive(swd, 1);
+	mpsse_shift_bytes(&swd->io, SWD_OUT, &idle, 1, NULL);
+
+	swd->status = SWD_ACK_OK;
+	if (!swd->error && mpsse_submit(swd->mpsse, &swd->io) == 0)
+		ret = swd_check(swd, swd->io.data);
+
+	mpsse_io_buffer_reset(&swd->io);
+	swd->nops = 0;
+	swd->error = 0;
+	return ret;
+}
+
+int swd_clear_errors(struct swd *swd)
+{
+	swd_write_dp(swd, SWD_DP_ABORT, SWD_ABORT_CLEAR);
+	return swd_flush(swd);
+}
+
+int swd_connect(struct swd *swd, uint32_t *dpidr)
+{
+	// Line reset, the JTAG to SWD select sequence 0xe79e, another line
+	// reset and idle cycles. A line reset is at least 50 cycles of SWDIO
+	// high.
+	static const unsigned char select[] = {
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x9e, 0xe7,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00,
+	};
+	const uint32_t powerup = SWD_CTRL_CSYSPWRUPREQ | SWD_CTRL_CDBGPWRUPREQ;
+	const uint32_t acks = SWD_CTRL_CSYSPWRUPACK | SWD_CTRL_CDBGPWRUPACK;
+	uint32_t ctrl;
+
+	swd_drive(swd, 1);
+	mpsse_shift_bytes(&swd->io, SWD_OUT, select, sizeof(select), NULL);
+
+	// DPIDR must be the first register read after the line reset.
+	swd_read_dp(swd, SWD_DP_DPIDR, dpidr);
+	swd_write_dp(swd, SWD_DP_ABORT, SWD_ABORT_CLEAR);
+	swd_write_dp(swd, SWD_DP_CTRL_STAT, powerup | SWD_CTRL_ORUNDETECT);
+	if (swd_flush(swd) != 0)
+		return -1;
+
+	for (unsigned i = 0; i < SWD_POWERUP_TRIES; ++i) {
+		swd_read_dp(swd, SWD_DP_CTRL_STAT, &ctrl);
+		if (swd_flush(swd) != 0)
+			return -1;
+		if ((ctrl & acks) == acks)
+			return 0;
+	}
+
+	return -1;
+}
+
+// Returns the number of words from addr to the end of the TAR
+// auto-increment block, but not more than count.
+static unsigned swd_mem_block(uint32_t addr, unsigned count)
+{
+	const unsigned left = (SWD_TAR_BLOCK - addr % SWD_TAR_BLOCK) / 4;
+
+	return count < left ? count : left;
+}
+
+// Queues the accesses to count words starting at addr, the words are read if
+// rdata is not NULL and written from wdata otherwise.
+static void swd_mem_queue(
+	struct swd *swd,
+	unsigned ap,
+	uint32_t addr,
+	uint32_t *rdata,
+	const uint32_t *wdata,
+	unsigned count)
+{
+	swd_write_dp(swd, SWD_DP_SELECT, ap << 24);
+	swd_write_ap(swd, SWD_AP_CSW, SWD_CSW_WORD);
+
+	for (unsigned pos = 0; pos < count;) {
+		const unsigned n = swd_mem_block(addr, count - pos);
+
+		swd_write_ap(swd, SWD_AP_TAR, addr);
+		for (unsigned i = 0; i < n; ++i) {
+			if (rdata)
+				swd_read_ap(swd, SWD_AP_DRW, &rdata[pos + i]);
+			else
+				swd_write_ap(swd, SWD_AP_DRW, wdata[pos + i]);
+		}
+		addr += n * 4;
+		pos += n;
+	}
+}
+
+static int swd_mem_transfer(
+	struct swd *swd,
+	unsigned ap,
+	uint32_t addr,
+	uint32_t *rdata,
+	const uint32_t *wdata,
+	unsigned count)
+{
+	if (addr % 4 != 0)
+		return -1;
+
+	while (count != 0) {
+		const unsigned n = count < SWD_BATCH ? count : SWD_BATCH;
+		unsigned tries = 0;
+
+		// A WAIT in the middle of the batch sets the sticky overrun
+		// error and all the following transactions fail, so the whole
+		// batch is repeated. Repeating the accesses is harmless for
+		// memory.
+		for (;;) {
+			swd_mem_queue(swd, ap, addr, rdata, wdata, n);
+			if (swd_flush(swd) == 0)
+				break;
+			if (swd->status != SWD_ACK_WAIT ||
+			    ++tries == SWD_RETRIES)
+				return -1;
+			if (swd_clear_errors(swd) != 0)
+				return -1;
+		}
+
+		if (rdata)
+			rdata += n;
+		else
+			wdata += n;
+		addr += n * 4;
+		count -= n;
+	}
+
+	return 0;
+}
+
+int swd_mem_read(
+	struct swd *swd,
+	unsigned ap,
+	uint32_t addr,
+	uint32_t *data,
+	unsigned count)
+{
+	return swd_mem_transfer(swd, ap, addr, data, NULL, count);
+}
+
+int swd_mem_write(
+	struct swd *swd,
+	unsigned ap,
+	uint32_t addr,
+	const uint32_t *data,
+	unsigned count)
+{
+	return swd_mem_transfer(swd, ap, addr, NULL, data, count);
+}
+
+static int swd_setup(struct swd *swd, unsigned divisor)
+{
+	struct mpsse_io_buffer *io = &swd->io;
+
+	mpsse_disable_freq_div5(io, NULL);
+	mpsse_disable_adaptive_clocking(io, NULL);
+	mpsse_disable_3phase_clocking(io, NULL);
+	mpsse_set_drive0_pins(io, 0, NULL);
+	mpsse_disable_loopback(io, NULL);
+	mpsse_set_freq_divisor(io, divisor, NULL);
+	mpsse_set_output(io, SWD_PINMASK_DRIVE, SWD_PINVALS, NULL);
+	swd->driving = 1;
+	return swd_flush(swd);
+}
+
+int swd_open(struct swd *swd, struct mpsse *mpsse, unsigned hz)
+{
+	unsigned divisor;
+
+	if (hz == 0)
+		return -1;
+
+	// SWCLK is 30MHz / (1 + divisor).
+	divisor = (SWD_MAX_HZ + hz - 1) / hz - 1;
+	if (divisor > 0xffff)
+		divisor = 0xffff;
+
+	swd->mpsse = mpsse;
+	swd->hz = SWD_MAX_HZ / (1 + divisor);
+	swd->driving = 0;
+	swd->posted = NULL;
+	swd->ops = NULL;
+	swd->nops = 0;
+	swd->capacity = 0;
+	swd->error = 0;
+	swd->status = SWD_ACK_OK;
+	mpsse_io_buffer_setup(&swd->io);
+
+	if (swd_setup(swd, divisor) != 0) {
+		swd_close(swd);
+		return -1;
+	}
+
+	return 0;
+}
+
+void swd_close(struct swd *swd)
+{
+	mpsse_io_buffer_release(&swd->io);
+	free(swd->ops);
+	swd->ops = NULL;
+	swd->nops = 0;
+	swd->capacity = 0;
+	swd->mpsse = NULL;
+}
@@ -0,0 +1,114 @@
+// SPDX-License-Identifier: GPL-2.0
+#ifndef __SWD_H__
+#define __SWD_H__
+
+#include <stdint.h>
+
+#include "mpsse.h"
+
+// Serial Wire Debug on top of an MPSSE device: ADBUS0 is SWCLK, ADBUS1 drives
+// SWDIO through a resistor and ADBUS2 reads SWDIO. ADBUS1 is switched to input
+// while the target drives SWDIO.
+//
+// The functions that access the DP and AP registers only add MPSSE commands
+// to the MPSSE IO buffer of the SWD structure, nothing is sent to the device
+// until swd_flush. All the ACKs and the parity of the data read are checked
+// after the whole batch completes, so the target must have the overrun
+// detection enabled (swd_connect does that): with it the target always has a
+// data phase, even after a WAIT or a FAULT, so the transactions stay in sync
+// with the commands and an error sticks until it's cleared.
+#define SWD_ACK_OK 0x1
+#define SWD_ACK_WAIT 0x2
+#define SWD_ACK_FAULT 0x4
+// Not an ACK, reported when the data read has wrong parity.
+#define SWD_PARITY_ERROR 0x100
+
+// DP registers.
+#define SWD_DP_DPIDR 0x0
+#define SWD_DP_ABORT 0x0
+#define SWD_DP_CTRL_STAT 0x4
+#define SWD_DP_SELECT 0x8
+#define SWD_DP_RDBUFF 0xc
+
+// MEM-AP registers.
+#define SWD_AP_CSW 0x00
+#define SWD_AP_TAR 0x04
+#define SWD_AP_DRW 0x0c
+
+// With the divide by 5 disabled the MPSSE clock is 60MHz and SWCLK is at
+// most half of that.
+#define SWD_MAX_HZ 30000000u
+
+// Transaction waiting for swd_flush to check its ACK and to copy the data.
+struct swd_op;
+
+struct swd {
+	struct mpsse *mpsse;
+	struct mpsse_io_buffer io;
+	unsigned hz;
+	// Non-0 if ADBUS1 currently drives SWDIO.
+	int driving;
+	// Destination of the AP read that hasn't returned its data yet, AP
+	// reads are posted and the data comes with the next AP read or with
+	// the RDBUFF read.
+	uint32_t *posted;
+	struct swd_op *ops;
+	unsigned nops;
+	unsigned capacity;
+	// Non-0 if we failed to allocate memory for one of the transactions,
+	// in this case swd_flush fails.
+	int error;
+	// ACK of the first transaction that failed in the last swd_flush or
+	// SWD_PARITY_ERROR, SWD_ACK_OK if all of them succeeded.
+	unsigned status;
+};
+
+// Configures the MPSSE device for SWD with the given SWCLK frequency, the
+// actual frequency is the highest one the MPSSE can generate that is not
+// above the requested one. Returns 0 on success and a non-0 value otherwise.
+int swd_open(struct swd *swd, struct mpsse *mpsse, unsigned hz);
+void swd_close(struct swd *swd);
+
+// Switches the target from JTAG to SWD, reads the DPIDR, clears the sticky
+// errors, enables the overrun detection and powers up the debug and the
+// system domains. Returns 0 on success and a non-0 value otherwise.
+int swd_connect(struct swd *swd, uint32_t *dpidr);
+
+// Queue register accesses, addr is the register address (0x0, 0x4, 0x8 or
+// 0xc), the AP is selected by the SELECT DP register. The value read is
+// stored during swd_flush, so the pointer must stay valid until then.
+void swd_read_dp(struct swd *swd, unsigned addr, uint32_t *value);
+void swd_write_dp(struct swd *swd, unsigned addr, uint32_t value);
+void swd_read_ap(struct swd *swd, unsigned addr, uint32_t *value);
+void swd_write_ap(struct swd *swd, unsigned addr, uint32_t value);
+
+// Returns the number of transactions waiting for swd_flush.
+unsigned swd_pending(const struct swd *swd);
+
+// Sends all the transactions queued so far to the device and checks their
+// ACKs and the parity of the data read. Returns 0 on success and a non-0
+// value otherwise, in which case the status field says what went wrong and
+// the sticky errors have to be cleared with swd_clear_errors.
+int swd_flush(struct swd *swd);
+
+// Clears the sticky errors of the DP through the ABORT register.
+int swd_clear_errors(struct swd *swd);
+
+// Read and write count 32-bit words of the target memory through the MEM-AP
+// with the given index, addr must be 4 bytes aligned. The transfers are
+// split into batches of many transactions, each batch takes one submission.
+// Returns 0 on success and a non-0 value otherwise.
+int swd_mem_read(
+	struct swd *swd,
+	unsigned ap,
+	uint32_t addr,
+	uint32_t *data,
+	unsigned count);
+int swd_mem_write(
+	struct swd *swd,
+	unsigned ap,
+	uint32_t addr,
+	const uint32_t *data,
+	unsigned count);
+
+#endif  // __SWD_H__
@@ -0,0 +1,339 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mpsse.h"
+#include "swd.h"
+
+// Files larger than that are not expected to fit into the RAM of the target.
+#define MEM_MAX_SIZE (1u << 26)
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *what, unsigned size, double start)
+{
+	const double seconds = now() - start;
+
+	fprintf(stdout, "%s %u bytes in %.3f s, %.2f MB/s\n",
+		what, size, seconds,
+		seconds > 0 ? size / seconds / 1e6 : 0.0);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stdout,
+		"%s -s serial [-f hz] [-p ap] -a addr "
+		"[-r file -l size | -w file] [-h]\n\n"
+		"\t-h           print the usage information.\n"
+		"\t-s serial    specify the FTDI serial number of the device "
+		"               used as SWD probe, optionally prefixed "
+		"               with the transport, e.g. d2xx:serial or "
+		"               usb:serial[@vid:pid], the usb transport "
+		"               looks for 0x0005:0x0001 and then for "
+		"               0x0403:0x6014 by default.\n"
+		"\t-f hz        SWCLK frequency, 1MHz by default.\n"
+		"\t-p ap        index of the MEM-AP, 0 by default.\n"
+		"\t-a addr      target address, must be 4 bytes aligned.\n"
+		"\t-l size      amount of data to read, multiple of 4.\n"
+		"\t-r file      read the target memory into the file.\n"
+		"\t-w file      write the file to the target memory and "
+		"               verify it, the file size must be a multiple "
+		"               of 4.\n",
+		name);
+}
+
+// The target is little endian, the files keep the bytes in the target order
+// regardless of the host.
+static void words_to_bytes(unsigned char *bytes, const uint32_t *words,
+			   unsigned count)
+{
+	for (unsigned i = 0; i < count; ++i) {
+		const uint32_t word = words[i];
+
+		bytes[4 * i] = word & 0xff;
+		bytes[4 * i + 1] = (word >> 8) & 0xff;
+		bytes[4 * i + 2] = (word >> 16) & 0xff;
+		bytes[4 * i + 3] = (word >> 24) & 0xff;
+	}
+}
+
+static void bytes_to_words(uint32_t *words, const unsigned char *bytes,
+			   unsigned count)
+{
+	for (unsigned i = 0; i < count; ++i) {
+		words[i] = (uint32_t)bytes[4 * i] |
+			((uint32_t)bytes[4 * i + 1] << 8) |
+			((uint32_t)bytes[4 * i + 2] << 16) |
+			((uint32_t)bytes[4 * i + 3] << 24);
+	}
+}
+
+static int do_read(struct swd *swd, unsigned ap, uint32_t addr,
+		   unsigned size, const char *name)
+{
+	uint32_t *words = malloc(size);
+	double start;
+	FILE *file;
+	int ret = -1;
+
+	if (!words)
+		return -1;
+
+	start = now();
+	if (swd_mem_read(swd, ap, addr, words, size / 4) != 0) {
+		fprintf(stderr, "Failed to read the memory, status 0x%x\n",
+			swd->status);
+		goto out;
+	}
+	report("Read", size, start);
+
+	file = fopen(name, "wb");
+	if (!file) {
+		fprintf(stderr, "Failed to create %s\n", name);
+		goto out;
+	}
+
+	// The conversion is done in place, each word is converted before
+	// its bytes are overwritten.
+	words_to_bytes((unsigned char *)words, words, size / 4);
+	if (fwrite(words, 1, size, file) != size) {
+		fprintf(stderr, "Failed to write %s\n", name);
+		fclose(file);
+		goto out;
+	}
+	if (fclose(file) != 0) {
+		fprintf(stderr, "Failed to write %s\n", name);
+		goto out;
+	}
+	ret = 0;
+
+out:
+	free(words);
+	return ret;
+}
+
+static unsigned char *load_file(const char *name, unsigned *size)
+{
+	unsigned char *data;
+	FILE *file;
+	long len;
+
+	file = fopen(name, "rb");
+	if (!file)
+		return NULL;
+
+	if (fseek(file, 0, SEEK_END) != 0 || (len = ftell(file)) <= 0 ||
+	    len > MEM_MAX_SIZE || len % 4 != 0 || fseek(file, 0, SEEK_SET)) {
+		fclose(file);
+		return NULL;
+	}
+
+	data = malloc(len);
+	if (data && fread(data, 1, len, file) != (size_t)len) {
+		free(data);
+		data = NULL;
+	}
+	fclose(file);
+
+	*size = len;
+	return data;
+}
+
+static int do_write(struct swd *swd, unsigned ap, uint32_t addr,
+		    const char *name)
+{
+	unsigned char *bytes;
+	uint32_t *words = NULL;
+	uint32_t *actual = NULL;
+	unsigned size;
+	double start;
+	int ret = -1;
+
+	bytes = load_file(name, &size);
+	if (!bytes) {
+		fprintf(stderr, "Failed to load %s\n", name);
+		return -1;
+	}
+
+	words = malloc(size);
+	actual = malloc(size);
+	if (!words || !actual)
+		goto out;
+	bytes_to_words(words, bytes, size / 4);
+
+	start = now();
+	if (swd_mem_write(swd, ap, addr, words, size / 4) != 0) {
+		fprintf(stderr, "Failed to write the memory, status 0x%x\n",
+			swd->status);
+		goto out;
+	}
+	report("Written", size, start);
+
+	start = now();
+	if (swd_mem_read(swd, ap, addr, actual, size / 4) != 0) {
+		fprintf(stderr, "Failed to read the memory, status 0x%x\n",
+			swd->status);
+		goto out;
+	}
+
+	for (unsigned i = 0; i < size / 4; ++i) {
+		if (actual[i] != words[i]) {
+			fprintf(stderr,
+				"Mismatch at 0x%08x: expected 0x%08x, "
+				"got 0x%08x\n",
+				addr + 4 * i, words[i], actual[i]);
+			goto out;
+		}
+	}
+	report("Verified", size, start);
+	ret = 0;
+
+out:
+	free(actual);
+	free(words);
+	free(bytes);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	const char *serial = NULL;
+	const char *read_file = NULL;
+	const char *write_file = NULL;
+	unsigned hz = 1000000;
+	unsigned ap = 0;
+	unsigned long addr = 0;
+	unsigned size = 0;
+	int has_addr = 0;
+	char *endptr;
+
+	struct mpsse mpsse;
+	struct swd swd;
+	uint32_t dpidr;
+	int ret;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:f:p:a:l:r:w:h")) != -1) {
+		switch (opt) {
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		case 's':
+			serial = optarg;
+			break;
+		case 'f':
+			hz = strtoul(optarg, &endptr, 0);
+			if (*endptr != '\0' || hz == 0) {
+				fprintf(stderr,
+					"Failed to parse frequency %s\n",
+					optarg);
+				return 1;
+			}
+			break;
+		case 'p':
+			ap = strtoul(optarg, &endptr, 0);
+			if (*endptr != '\0' || ap > 0xff) {
+				fprintf(stderr, "Failed to parse AP %s\n",
+					optarg);
+				return 1;
+			}
+			break;
+		case 'a':
+			addr = strtoul(optarg, &endptr, 0);
+			if (*endptr != '\0' || addr > 0xffffffffu) {
+				fprintf(stderr,
+					"Failed to parse address %s\n",
+					optarg);
+				return 1;
+			}
+			has_addr = 1;
+			break;
+		case 'l':
+			size = strtoul(optarg, &endptr, 0);
+			if (*endptr != '\0') {
+				fprintf(stderr, "Failed to parse size %s\n",
+					optarg);
+				return 1;
+			}
+			break;
+		case 'r':
+			read_file = optarg;
+			break;
+		case 'w':
+			write_file = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (!serial) {
+		fprintf(stderr, "Expect exactly one -s argument\n");
+		return 1;
+	}
+
+	if (!has_addr || addr % 4 != 0) {
+		fprintf(stderr, "Expect a 4 bytes aligned -a argument\n");
+		return 1;
+	}
+
+	if (!!read_file + !!write_file != 1) {
+		fprintf(stderr, "Expect exactly one of -r and -w\n");
+		return 1;
+	}
+
+	if (read_file && (size == 0 || size % 4 != 0 ||
+			  size > MEM_MAX_SIZE)) {
+		fprintf(stderr, "Expect a -l argument that is a multiple "
+			"of 4\n");
+		return 1;
+	}
+
+	if (mpsse_open_spec(serial, &mpsse) != 0) {
+		fprintf(stderr, "Failed to enable MPSSE on %s\n", serial);
+		return 1;
+	}
+
+	if (mpsse_verify(&mpsse) != 0) {
+		fprintf(stderr, "Failed to verify MPSSE mode on %s\n", serial);
+		mpsse_close(&mpsse);
+		return 1;
+	}
+
+	if (swd_open(&swd, &mpsse, hz) != 0) {
+		fprintf(stderr, "Failed to configure SWD on %s\n", serial);
+		mpsse_close(&mpsse);
+		return 1;
+	}
+	fprintf(stdout, "SWCLK: %u Hz\n", swd.hz);
+
+	if (swd_connect(&swd, &dpidr) != 0) {
+		fprintf(stderr, "Failed to connect to the target, "
+			"status 0x%x\n", swd.status);
+		ret = -1;
+	} else {
+		fprintf(stdout, "DPIDR: 0x%08x\n", dpidr);
+		if (read_file)
+			ret = do_read(&swd, ap, addr, size, read_file);
+		else
+			ret = do_write(&swd, ap, addr, write_file);
+	}
+
+	swd_close(&swd);
+	if (mpsse_close(&mpsse) != 0) {
+		fprintf(stderr, "Failed to close %s\n", serial);
+		return 1;
+	}
+
+	return ret == 0 ? 0 : 1;
+}
@@ -0,0 +1,135 @@
+// SPDX-License-Identifier: GPL-2.0
+#include "transport.h"
+
+#include <string.h>
+
+#include "ftdi.h"
+#include "ftdi_usb.h"
+#include "sim.h"
+
+// Upper bound on a single sleep in transport_read_exactly, so we don't rely
+// on every transport to never miss a wake up.
+static const int TRANSPORT_WAIT_TIMEOUT = 100;
+
+// Returns the rest of the spec if it starts with the prefix and NULL otherwise.
+static const char *transport_match(const char *spec, const char *prefix)
+{
+	const size_t len = strlen(prefix);
+
+	if (strncmp(spec, prefix, len) != 0)
+		return NULL;
+	return spec + len;
+}
+
+#ifdef TRANSPORT_D2XX
+static int transport_open_d2xx(const char *spec, struct transport **transport)
+{
+	struct serial serial;
+
+	if (strlen(spec) > sizeof(serial.serial) - 1)
+		return -1;
+
+	strncpy(serial.serial, spec, sizeof(serial.serial));
+	return ftdi_transport_open(&serial, transport);
+}
+#endif
+
+int transport_open(const char *spec, struct transport **transport)
+{
+	const char *rest;
+
+	rest = transport_match(spec, "sim:");
+	if (rest)
+		return sim_open(rest, transport);
+
+#ifdef TRANSPORT_LIBUSB
+	rest = transport_match(spec, "usb:");
+	if (rest)
+		return ftdi_usb_open(rest, transport);
+#endif
+
+#ifdef TRANSPORT_D2XX
+	rest = transport_match(spec, "d2xx:");
+	return transport_open_d2xx(rest ? rest : spec, transport);
+#endif
+
+	return -1;
+}
+
+int transport_close(struct transport *transport)
+{
+	return transport->ops->close(transport);
+}
+
+int transport_reset(struct transport *transport)
+{
+	return transport->ops->reset(transport);
+}
+
+int transport_drain(struct transport *transport)
+{
+	return transport->ops->drain(transport);
+}
+
+int transport_disable_special_chars(struct transport *transport)
+{
+	return transport->ops->disable_special_chars(transport);
+}
+
+int transport_set_bit_mode(struct transport *transport, unsigned mode)
+{
+	return transport->ops->set_bit_mode(transport, mode);
+}
+
+int transport_write(
+	struct transport *transport, const void *buf, unsigned size)
+{
+	return transport->ops->write(transport, buf, size);
+}
+
+int transport_read(struct transport *transport, void *buf, unsigned size)
+{
+	return transport->ops->read(transport, buf, size);
+}
+
+int transport_wait(struct transport *transport, int timeout)
+{
+	return transport->ops->wait(transport, timeout);
+}
+
+int transport_fd(struct transport *transport)
+{
+	if (!transport->ops->fd)
+		return -1;
+	return transport->ops->fd(transport);
+}
+
+int transport_read_exactly(
+	struct transport *transport, void *buf, unsigned size, unsigned spin)
+{
+	unsigned char *b = buf;
+	unsigned total = 0;
+	unsigned spins = 0;
+
+	while (total < size) {
+		int ret = transport_read(transport, b + total, size - total);
+
+		if (ret < 0)
+			return -1;
+
+		if (ret > 0) {
+			total += ret;
+			spins = 0;
+			continue;
+		}
+
+		if (spins < spin) {
+			++spins;
+			continue;
+		}
+
+		if (transport_wait(transport, TRANSPORT_WAIT_TIMEOUT) < 0)
+			return -1;
+	}
+	return total;
+}
@@ -0,0 +1,71 @@
+// SPDX-License-Identifier: GPL-2.0
+#ifndef __TRANSPORT_H__
+#define __TRANSPORT_H__
+
+// Transport is the way the MPSSE library talks to the FTDI chip. The MPSSE
+// code doesn't care whether the bytes go through the D2XX driver or somewhere
+// else, so every transport implements the same small set of operations and
+// the MPSSE code only uses those.
+//
+// All the operations, unless stated otherwise, return 0 on success and a
+// non-0 value otherwise.
+struct transport;
+
+struct transport_ops {
+	// Closes the transport and frees all the resources associated with it
+	// including the transport structure itself.
+	int (*close)(struct transport *transport);
+	int (*reset)(struct transport *transport);
+	// Drops all the data in the receive and transmit buffers.
+	int (*drain)(struct transport *transport);
+	int (*disable_special_chars)(struct transport *transport);
+	int (*set_bit_mode)(struct transport *transport, unsigned mode);
+	// Writes all the data and returns size or a negative value on error.
+	int (*write)(
+		struct transport *transport, const void *buf, unsigned size);
+	// Never blocks and returns the number of bytes read, which might be 0,
+	// or a negative value on error.
+	int (*read)(struct transport *transport, void *buf, unsigned size);
+	// Waits until there is data to read or the timeout in milliseconds
+	// expires. Returns 1 if there is data to read, 0 on timeout and a
+	// negative value on error.
+	int (*wait)(struct transport *transport, int timeout);
+	// Returns a file descriptor that becomes readable when there might be
+	// data to read or a negative value if the transport doesn't have one.
+	// It's cleared by the read operation.
+	int (*fd)(struct transport *transport);
+};
+
+// Transport implementations embed this structure and keep their own state
+// next to it.
+struct transport {
+	const struct transport_ops *ops;
+};
+
+// Opens the transport described by the spec. The spec is one of:
+//  - usb:[serial][@vid:pid] opens the device through libusb, see
+//    ftdi_usb_open for details;
+//  - [d2xx:]serial opens the device with the given FTDI serial number through
+//    the D2XX driver;
+//  - sim:[targets] opens the simulator, see sim_open for details.
+// Only the transports enabled at build time are available, the simulator is
+// always available.
+int transport_open(const char *spec, struct transport **transport);
+
+int transport_close(struct transport *transport);
+int transport_reset(struct transport *transport);
+int transport_drain(struct transport *transport);
+int transport_disable_special_chars(struct transport *transport);
+int transport_set_bit_mode(struct transport *transport, unsigned mode);
+int transport_write(
+	struct transport *transport, const void *buf, unsigned size);
+int transport_read(struct transport *transport, void *buf, unsigned size);
+int transport_wait(struct transport *transport, int timeout);
+int transport_fd(struct transport *transport);
+
+// Blocks until size bytes are read. Checks for the data spin times before
+// going to sleep waiting for it. Returns size or a negative value on error.
+int transport_read_exactly(
+	struct transport *transport, void *buf, unsigned size, unsigned spin);
+
+#endif  // __TRANSPORT_H__
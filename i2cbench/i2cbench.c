@@ -0,0 +1,526 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <linux/completion.h>
+#include <linux/debugfs.h>
+#include <linux/i2c.h>
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+
+// The module generates I2C traffic on the chosen adapter and measures how
+// much of it the adapter can sustain. All the knobs and the results live in
+// /sys/kernel/debug/i2cbench:
+//
+//   * adapter, addr, reg - I2C adapter number, target address and register;
+//   * workload - one of "read", "write_read", "page_write" and "mixed";
+//   * len - payload size of a single transaction;
+//   * threads - number of kthreads generating the traffic concurrently;
+//   * iterations - number of transactions each thread performs;
+//   * run - writing anything to this file runs the benchmark and returns
+//     when it completes;
+//   * results - the results of the last run.
+//
+// Adapters that don't support plain I2C transfers, like i2c-stub that can be
+// used as a local emulated device, are driven using SMBus transfers of the
+// same shape instead. SMBus has no plain multi-byte read, so on such
+// adapters the read and mixed workloads only run with len of 1.
+//
+// Be careful with the page_write and mixed workloads, they actually write the
+// target registers.
+
+enum i2cbench_workload {
+	I2CBENCH_READ,
+	I2CBENCH_WRITE_READ,
+	I2CBENCH_PAGE_WRITE,
+	I2CBENCH_MIXED,
+};
+
+static const char *const i2cbench_workload_names[] = {
+	[I2CBENCH_READ] = "read",
+	[I2CBENCH_WRITE_READ] = "write_read",
+	[I2CBENCH_PAGE_WRITE] = "page_write",
+	[I2CBENCH_MIXED] = "mixed",
+};
+
+struct i2cbench_config {
+	u32 adapter;
+	u32 addr;
+	u32 reg;
+	u32 len;
+	u32 threads;
+	u32 iterations;
+	enum i2cbench_workload workload;
+};
+
+struct i2cbench_results {
+	u64 transactions;
+	u64 errors;
+	u64 bytes;
+	u64 elapsed_ns;
+	u64 p50_ns;
+	u64 p90_ns;
+	u64 p99_ns;
+	u64 max_ns;
+};
+
+struct i2cbench_worker {
+	const struct i2cbench_config *config;
+	struct i2c_adapter *adapter;
+	struct completion done;
+	// Latency of every transaction performed by the worker in nanoseconds
+	u64 *latency;
+	u64 errors;
+	u64 bytes;
+};
+
+static struct i2cbench_config i2cbench_config = {
+	.adapter = 0,
+	.addr = 0x50,
+	.reg = 0x00,
+	.len = 1,
+	.threads = 1,
+	.iterations = 1000,
+	.workload = I2CBENCH_READ,
+};
+static struct i2cbench_results i2cbench_results;
+static struct dentry *i2cbench_dir;
+// Protects the configuration and the results, also serializes the runs
+static DEFINE_MUTEX(i2cbench_lock);
+
+static const u32 I2CBENCH_MAX_LEN = I2C_SMBUS_BLOCK_MAX;
+static const u32 I2CBENCH_MAX_THREADS = 64;
+
+// SMBus transactions the workload uses on adapters without plain I2C.
+static u32 i2cbench_smbus_func(enum i2cbench_workload workload)
+{
+	switch (workload) {
+	case I2CBENCH_READ:
+		return I2C_FUNC_SMBUS_READ_BYTE;
+	case I2CBENCH_WRITE_READ:
+		return I2C_FUNC_SMBUS_READ_I2C_BLOCK;
+	case I2CBENCH_PAGE_WRITE:
+		return I2C_FUNC_SMBUS_WRITE_I2C_BLOCK;
+	default:
+		return I2C_FUNC_SMBUS_READ_BYTE |
+		       I2C_FUNC_SMBUS_READ_I2C_BLOCK |
+		       I2C_FUNC_SMBUS_WRITE_I2C_BLOCK;
+	}
+}
+
+// Checks that the adapter can run the workload with transactions of the
+// same shape as on plain I2C adapters.
+static int i2cbench_check_adapter(const struct i2cbench_config *config,
+				  struct i2c_adapter *adapter)
+{
+	if (i2c_check_functionality(adapter, I2C_FUNC_I2C))
+		return 0;
+
+	if ((config->workload == I2CBENCH_READ ||
+	     config->workload == I2CBENCH_MIXED) && config->len != 1)
+		return -EOPNOTSUPP;
+
+	if (!i2c_check_functionality(adapter,
+				     i2cbench_smbus_func(config->workload)))
+		return -EOPNOTSUPP;
+	return 0;
+}
+
+static int i2cbench_smbus(const struct i2cbench_worker *worker,
+			  enum i2cbench_workload workload, u8 reg, u8 *buf,
+			  u32 len)
+{
+	union i2c_smbus_data data;
+	int ret;
+
+	switch (workload) {
+	case I2CBENCH_READ:
+		// i2cbench_check_adapter allows only 1 byte reads here.
+		ret = i2c_smbus_xfer(worker->adapter, worker->config->addr, 0,
+				     I2C_SMBUS_READ, 0, I2C_SMBUS_BYTE, &data);
+		if (ret < 0)
+			return ret;
+		return 1;
+	case I2CBENCH_WRITE_READ:
+		data.block[0] = len;
+		ret = i2c_smbus_xfer(worker->adapter, worker->config->addr, 0,
+				     I2C_SMBUS_READ, reg,
+				     I2C_SMBUS_I2C_BLOCK_DATA, &data);
+		if (ret < 0)
+			return ret;
+		return 1 + len;
+	case I2CBENCH_PAGE_WRITE:
+		data.block[0] = len;
+		memcpy(&data.block[1], buf, len);
+		ret = i2c_smbus_xfer(worker->adapter, worker->config->addr, 0,
+				     I2C_SMBUS_WRITE, reg,
+				     I2C_SMBUS_I2C_BLOCK_DATA, &data);
+		if (ret < 0)
+			return ret;
+		return 1 + len;
+	default:
+		return -EINVAL;
+	}
+}
+
+static int i2cbench_i2c(const struct i2cbench_worker *worker,
+			enum i2cbench_workload workload, u8 reg, u8 *buf,
+			u32 len)
+{
+	const u16 addr = worker->config->addr;
+	struct i2c_msg msgs[2];
+	u8 page[1 + I2C_SMBUS_BLOCK_MAX];
+	int num;
+	int ret;
+
+	switch (workload) {
+	case I2CBENCH_READ:
+		msgs[0].addr = addr;
+		msgs[0].flags = I2C_M_RD;
+		msgs[0].len = len;
+		msgs[0].buf = buf;
+		num = 1;
+		break;
+	case I2CBENCH_WRITE_READ:
+		msgs[0].addr = addr;
+		msgs[0].flags = 0;
+		msgs[0].len = 1;
+		msgs[0].buf = &reg;
+		msgs[1].addr = addr;
+		msgs[1].flags = I2C_M_RD;
+		msgs[1].len = len;
+		msgs[1].buf = buf;
+		num = 2;
+		break;
+	case I2CBENCH_PAGE_WRITE:
+		page[0] = reg;
+		memcpy(&page[1], buf, len);
+		msgs[0].addr = addr;
+		msgs[0].flags = 0;
+		msgs[0].len = 1 + len;
+		msgs[0].buf = page;
+		num = 1;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	// A partial transfer didn't move all the payload.
+	ret = i2c_transfer(worker->adapter, msgs, num);
+	if (ret < 0)
+		return ret;
+	if (ret != num)
+		return -EIO;
+
+	return workload == I2CBENCH_READ ? len : 1 + len;
+}
+
+// Returns the number of payload bytes transferred or a negative error.
+static int i2cbench_transaction(const struct i2cbench_worker *worker,
+				u32 iteration, u8 *buf)
+{
+	const struct i2cbench_config *config = worker->config;
+	enum i2cbench_workload workload = config->workload;
+	u32 len = config->len;
+
+	// The mixed workload cycles through all the other workloads and
+	// through all the power of 2 sizes up to len.
+	if (workload == I2CBENCH_MIXED) {
+		workload = iteration % I2CBENCH_MIXED;
+		len = min_t(u32, len, 1u << ((iteration / I2CBENCH_MIXED) %
+					     (ilog2(len) + 1)));
+	}
+
+	if (i2c_check_functionality(worker->adapter, I2C_FUNC_I2C))
+		return i2cbench_i2c(worker, workload, config->reg, buf, len);
+	return i2cbench_smbus(worker, workload, config->reg, buf, len);
+}
+
+static int i2cbench_worker_fn(void *data)
+{
+	struct i2cbench_worker *worker = data;
+	u8 buf[I2C_SMBUS_BLOCK_MAX];
+	u32 i;
+
+	memset(buf, 0xa5, sizeof(buf));
+	for (i = 0; i < worker->config->iterations; ++i) {
+		const ktime_t start = ktime_get();
+		int ret = i2cbench_transaction(worker, i, buf);
+
+		worker->latency[i] = ktime_to_ns(ktime_sub(ktime_get(), start));
+		if (ret < 0)
+			++worker->errors;
+		else
+			worker->bytes += ret;
+	}
+
+	complete(&worker->done);
+	return 0;
+}
+
+static int i2cbench_cmp_u64(const void *l, const void *r)
+{
+	const u64 left = *(const u64 *)l;
+	const u64 right = *(const u64 *)r;
+
+	if (left < right)
+		return -1;
+	if (left > right)
+		return 1;
+	return 0;
+}
+
+static u64 i2cbench_percentile(const u64 *sorted, size_t size, unsigned pct)
+{
+	if (size == 0)
+		return 0;
+	return sorted[div_u64((u64)(size - 1) * pct, 100)];
+}
+
+static int i2cbench_run(const struct i2cbench_config *config,
+			struct i2cbench_results *results)
+{
+	const size_t total = (size_t)config->threads * config->iterations;
+	struct i2cbench_worker *workers = NULL;
+	struct i2c_adapter *adapter;
+	u64 *latency = NULL;
+	ktime_t start;
+	u32 started;
+	u32 i;
+	int ret = 0;
+
+	if (config->threads == 0 || config->threads > I2CBENCH_MAX_THREADS)
+		return -EINVAL;
+
+	if (config->len == 0 || config->len > I2CBENCH_MAX_LEN)
+		return -EINVAL;
+
+	if (config->iterations == 0 || config->addr > 0x7f)
+		return -EINVAL;
+
+	adapter = i2c_get_adapter(config->adapter);
+	if (!adapter)
+		return -ENODEV;
+
+	ret = i2cbench_check_adapter(config, adapter);
+	if (ret < 0)
+		goto out;
+
+	workers = kcalloc(config->threads, sizeof(*workers), GFP_KERNEL);
+	latency = vmalloc(array_size(total, sizeof(*latency)));
+	if (!workers || !latency) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	start = ktime_get();
+	for (started = 0; started < config->threads; ++started) {
+		struct i2cbench_worker *worker = &workers[started];
+		struct task_struct *task;
+
+		worker->config = config;
+		worker->adapter = adapter;
+		worker->latency = latency + (size_t)started * config->iterations;
+		init_completion(&worker->done);
+
+		task = kthread_run(i2cbench_worker_fn, worker,
+				   "i2cbench/%u", started);
+		if (IS_ERR(task)) {
+			ret = PTR_ERR(task);
+			break;
+		}
+	}
+
+	for (i = 0; i < started; ++i)
+		wait_for_completion(&workers[i].done);
+
+	if (ret < 0)
+		goto out;
+
+	memset(results, 0, sizeof(*results));
+	results->elapsed_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	for (i = 0; i < config->threads; ++i) {
+		results->errors += workers[i].errors;
+		results->bytes += workers[i].bytes;
+	}
+	results->transactions = total - results->errors;
+
+	sort(latency, total, sizeof(*latency), i2cbench_cmp_u64, NULL);
+	results->p50_ns = i2cbench_percentile(latency, total, 50);
+	results->p90_ns = i2cbench_percentile(latency, total, 90);
+	results->p99_ns = i2cbench_percentile(latency, total, 99);
+	results->max_ns = latency[total - 1];
+
+out:
+	vfree(latency);
+	kfree(workers);
+	i2c_put_adapter(adapter);
+	return ret;
+}
+
+static ssize_t i2cbench_run_write(struct file *file, const char __user *buf,
+				  size_t count, loff_t *ppos)
+{
+	struct i2cbench_config config;
+	struct i2cbench_results results;
+	int ret;
+
+	(void) file;
+	(void) buf;
+	(void) ppos;
+
+	mutex_lock(&i2cbench_lock);
+	config = i2cbench_config;
+	ret = i2cbench_run(&config, &results);
+	if (ret == 0)
+		i2cbench_results = results;
+	mutex_unlock(&i2cbench_lock);
+
+	if (ret < 0)
+		return ret;
+	return count;
+}
+
+static const struct file_operations i2cbench_run_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.write = i2cbench_run_write,
+	.llseek = noop_llseek,
+};
+
+static ssize_t i2cbench_results_read(struct file *file, char __user *buf,
+				     size_t count, loff_t *ppos)
+{
+	struct i2cbench_results results;
+	char text[512];
+	u64 elapsed_us;
+	int len;
+
+	(void) file;
+
+	mutex_lock(&i2cbench_lock);
+	results = i2cbench_results;
+	mutex_unlock(&i2cbench_lock);
+
+	elapsed_us = max_t(u64, div_u64(results.elapsed_ns, NSEC_PER_USEC), 1);
+	len = scnprintf(text, sizeof(text),
+			"transactions: %llu\n"
+			"errors: %llu\n"
+			"bytes: %llu\n"
+			"elapsed_us: %llu\n"
+			"transactions_per_sec: %llu\n"
+			"bytes_per_sec: %llu\n"
+			"latency_p50_us: %llu\n"
+			"latency_p90_us: %llu\n"
+			"latency_p99_us: %llu\n"
+			"latency_max_us: %llu\n",
+			results.transactions,
+			results.errors,
+			results.bytes,
+			div_u64(results.elapsed_ns, NSEC_PER_USEC),
+			div64_u64(results.transactions * USEC_PER_SEC,
+				  elapsed_us),
+			div64_u64(results.bytes * USEC_PER_SEC, elapsed_us),
+			div_u64(results.p50_ns, NSEC_PER_USEC),
+			div_u64(results.p90_ns, NSEC_PER_USEC),
+			div_u64(results.p99_ns, NSEC_PER_USEC),
+			div_u64(results.max_ns, NSEC_PER_USEC));
+	return simple_read_from_buffer(buf, count, ppos, text, len);
+}
+
+static const struct file_operations i2cbench_results_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.read = i2cbench_results_read,
+	.llseek = default_llseek,
+};
+
+static ssize_t i2cbench_workload_read(struct file *file, char __user *buf,
+				      size_t count, loff_t *ppos)
+{
+	char text[32];
+	int len;
+
+	(void) file;
+
+	mutex_lock(&i2cbench_lock);
+	len = scnprintf(text, sizeof(text), "%s\n",
+			i2cbench_workload_names[i2cbench_config.workload]);
+	mutex_unlock(&i2cbench_lock);
+	return simple_read_from_buffer(buf, count, ppos, text, len);
+}
+
+static ssize_t i2cbench_workload_write(struct file *file,
+				       const char __user *buf,
+				       size_t count, loff_t *ppos)
+{
+	char text[32];
+	int ret;
+
+	(void) file;
+	(void) ppos;
+
+	if (count >= sizeof(text))
+		return -EINVAL;
+
+	if (copy_from_user(text, buf, count))
+		return -EFAULT;
+	text[count] = '\0';
+
+	ret = sysfs_match_string(i2cbench_workload_names, strim(text));
+	if (ret < 0)
+		return ret;
+
+	mutex_lock(&i2cbench_lock);
+	i2cbench_config.workload = ret;
+	mutex_unlock(&i2cbench_lock);
+	return count;
+}
+
+static const struct file_operations i2cbench_workload_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.read = i2cbench_workload_read,
+	.write = i2cbench_workload_write,
+	.llseek = default_llseek,
+};
+
+static int __init i2cbench_init(void)
+{
+	struct i2cbench_config *config = &i2cbench_config;
+
+	i2cbench_dir = debugfs_create_dir("i2cbench", NULL);
+	if (IS_ERR(i2cbench_dir))
+		return PTR_ERR(i2cbench_dir);
+
+	debugfs_create_u32("adapter", 0600, i2cbench_dir, &config->adapter);
+	debugfs_create_x32("addr", 0600, i2cbench_dir, &config->addr);
+	debugfs_create_x32("reg", 0600, i2cbench_dir, &config->reg);
+	debugfs_create_u32("len", 0600, i2cbench_dir, &config->len);
+	debugfs_create_u32("threads", 0600, i2cbench_dir, &config->threads);
+	debugfs_create_u32(
+		"iterations", 0600, i2cbench_dir, &config->iterations);
+	debugfs_create_file("workload", 0600, i2cbench_dir, NULL,
+			    &i2cbench_workload_fops);
+	debugfs_create_file("run", 0200, i2cbench_dir, NULL,
+			    &i2cbench_run_fops);
+	debugfs_create_file("results", 0400, i2cbench_dir, NULL,
+			    &i2cbench_results_fops);
+	return 0;
+}
+
+static void __exit i2cbench_exit(void)
+{
+	debugfs_remove_recursive(i2cbench_dir);
+}
+
+module_init(i2cbench_init);
+module_exit(i2cbench_exit);
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("I2C adapter load generator and benchmark");
+MODULE_AUTHOR("Krinkin Mike <krinkin.m.u@gmail.com>");